@@ -14,8 +14,81 @@ static int fuzzy_cmp(const void *aa, const void *bb) {
   return a->str.length - b->str.length;
 }
 
-// returns number of found matches
-static int fuzzy_match(Slice string, View<Slice> strings, View<FuzzyMatch> result, bool ignore_identical_strings) {
+// Precomputed data for fuzzy matching against the same strings many times, for example when the user is typing into a menu.
+// Every string gets a lowercase copy, and a mask of which characters it contains, so most non-matches can be thrown away with a single AND
+struct FuzzyIndex {
+  Array<u64> masks;
+  Array<char> lower; // all the strings lowercased, back to back
+  Array<int> offsets; // where each string starts in lower
+};
+
+static void util_free(FuzzyIndex &f) {
+  f.masks.free_shallow();
+  f.lower.free_shallow();
+  f.offsets.free_shallow();
+  f = {};
+}
+
+static char fuzzy_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// letters and digits get their own bit, everything else shares the rest
+static u64 fuzzy_char_bit(char c) {
+  u8 u = (u8)c;
+  if (u >= 'a' && u <= 'z')
+    return 1ULL << (u - 'a');
+  if (u >= '0' && u <= '9')
+    return 1ULL << (26 + u - '0');
+  return 1ULL << (36 + u % 28);
+}
+
+static void fuzzy_index_init(FuzzyIndex *f, View<Slice> strings) {
+  util_free(*f);
+  int total = 0;
+  for (int i = 0; i < strings.size; ++i)
+    total += strings[i].length;
+  f->masks.resize(strings.size);
+  f->offsets.resize(strings.size);
+  f->lower.resize(total);
+
+  char *out = f->lower.items;
+  for (int i = 0; i < strings.size; ++i) {
+    Slice s = strings[i];
+    u64 mask = 0;
+    f->offsets[i] = (int)(out - f->lower.items);
+    for (int j = 0; j < s.length; ++j) {
+      out[j] = fuzzy_lower(s.chars[j]);
+      mask |= fuzzy_char_bit(out[j]);
+    }
+    f->masks[i] = mask;
+    out += s.length;
+  }
+}
+
+// result is a min-heap on points while we are collecting matches, so the worst match is always at the top
+static void _fuzzy_heap_down(View<FuzzyMatch> heap, int n, int i) {
+  for (;;) {
+    int l = 2*i+1, r = l+1, m = i;
+    if (l < n && heap[l].points < heap[m].points) m = l;
+    if (r < n && heap[r].points < heap[m].points) m = r;
+    if (m == i)
+      return;
+    swap(heap[i], heap[m]);
+    i = m;
+  }
+}
+
+static void _fuzzy_heap_up(View<FuzzyMatch> heap, int i) {
+  while (i > 0 && heap[i].points < heap[(i-1)/2].points) {
+    swap(heap[i], heap[(i-1)/2]);
+    i = (i-1)/2;
+  }
+}
+
+// returns number of found matches. index must have been built from strings
+// If candidates is given, only those strings are looked at. If all_matches is given, every match is pushed to it, not just the best ones
+static int fuzzy_match(Slice string, View<Slice> strings, const FuzzyIndex &index, View<FuzzyMatch> result, bool ignore_identical_strings, const Array<int> *candidates = 0, Array<int> *all_matches = 0) {
   int num_results = 0;
 
   if (string.length == 0) {
@@ -24,37 +97,55 @@ static int fuzzy_match(Slice string, View<Slice> strings, View<FuzzyMatch> resul
       result[i] = {strings[i], 0.0f, i};
     return l;
   }
+  if (!result.size)
+    return 0;
 
-  for (int i = 0; i < strings.size; ++i) {
-    Slice identifier = strings[i];
-    if (ignore_identical_strings && string == identifier)
+  char lower_input_buf[256];
+  Array<char> lower_input_alloc = {};
+  char *lower_input = lower_input_buf;
+  if (string.length > (int)ARRAY_LEN(lower_input_buf)) {
+    lower_input_alloc.resize(string.length);
+    lower_input = lower_input_alloc.items;
+  }
+  u64 input_mask = 0;
+  for (int i = 0; i < string.length; ++i) {
+    lower_input[i] = fuzzy_lower(string.chars[i]);
+    input_mask |= fuzzy_char_bit(lower_input[i]);
+  }
+
+  const int num_candidates = candidates ? candidates->size : strings.size;
+  for (int c = 0; c < num_candidates; ++c) {
+    const int i = candidates ? (*candidates)[c] : c;
+
+    // does it have all the characters?
+    if (input_mask & ~index.masks[i])
       continue;
 
+    Slice identifier = strings[i];
     const int test_len = identifier.length;
     if (string.length > test_len)
       continue;
+    if (ignore_identical_strings && string == identifier)
+      continue;
 
     const char *in = string.chars;
+    const char *in_lower = lower_input;
     const char *in_end = in + string.length;
     const char *test = identifier.chars;
+    const char *test_lower = index.lower.items + index.offsets[i];
     const char *test_end = test + test_len;
 
     float points = 0;
     float gain = 10;
 
-    for (; in < in_end && test < test_end; ++test) {
-      if (*in == *test) {
-        points += gain;
-        gain = 10;
-        ++in;
-      }
-      else if (tolower(*in) == tolower(*test)) {
-        points += gain*0.8f;
+    for (; in < in_end && test < test_end; ++test, ++test_lower) {
+      if (*in_lower == *test_lower) {
+        points += *in == *test ? gain : gain*0.8f;
         gain = 10;
-        ++in;
+        ++in, ++in_lower;
       }
       /* Don't penalize special characters */
-      else if (isalnum(*test))
+      else if (isalnum(*test_lower))
         gain *= 0.7;
     }
 
@@ -63,26 +154,86 @@ static int fuzzy_match(Slice string, View<Slice> strings, View<FuzzyMatch> resul
 
     /* push match */
 
+    if (all_matches)
+      *all_matches += i;
     if (num_results < result.size) {
-      result[num_results].str = identifier;
-      result[num_results].points = points;
-      result[num_results].idx = i;
-      ++num_results;
-    } else {
-      /* find worst match and replace */
-      FuzzyMatch &worst = result[ARRAY_MIN_BY(result, points)];
-      if (points > worst.points) {
-        worst.str = identifier;
-        worst.points = points;
-        worst.idx = i;
-      }
+      result[num_results] = {identifier, points, i};
+      _fuzzy_heap_up(result, num_results++);
+    }
+    else if (points > result[0].points) {
+      /* replace worst match */
+      result[0] = {identifier, points, i};
+      _fuzzy_heap_down(result, num_results, 0);
     }
   }
 
+  lower_input_alloc.free_shallow();
   qsort(result.items, num_results, sizeof(result[0]), fuzzy_cmp);
   return num_results;
 }
 
+// Fuzzy matching against the same strings over and over while the user is typing.
+// Besides the index, it remembers every string that matched the last input. When the user types another character,
+// the new matches must be among those, so we only have to look at them. Anything else means a full scan.
+struct FuzzyMenuCache {
+  Array<Slice> strings;
+  FuzzyIndex index;
+  String input; // what matched was computed for
+  Array<int> matched;
+  bool valid; // set this to false whenever the strings change
+};
+
+static void util_free(FuzzyMenuCache &c) {
+  c.strings.free_shallow();
+  util_free(c.index);
+  util_free(c.input);
+  c.matched.free_shallow();
+  c = {};
+}
+
+static void fuzzy_cache_init(FuzzyMenuCache *c, View<Slice> strings) {
+  util_free(*c);
+  c->strings.resize(strings.size);
+  for (int i = 0; i < strings.size; ++i)
+    c->strings[i] = strings[i];
+  fuzzy_index_init(&c->index, view(c->strings));
+  c->valid = true;
+}
+
+// returns number of found matches
+static int fuzzy_match(Slice string, FuzzyMenuCache *c, View<FuzzyMatch> result, bool ignore_identical_strings) {
+  if (!string.length) {
+    util_free(c->input);
+    c->matched.free_shallow();
+    c->matched = {};
+    return fuzzy_match(string, view(c->strings), c->index, result, ignore_identical_strings);
+  }
+
+  // matching is case insensitive, so that is all that matters when narrowing
+  bool narrow = c->input.length && string.length >= c->input.length;
+  for (int i = 0; narrow && i < c->input.length; ++i)
+    narrow = fuzzy_lower(string[i]) == fuzzy_lower(c->input[i]);
+
+  Array<int> matched = {};
+  int n = fuzzy_match(string, view(c->strings), c->index, result, ignore_identical_strings, narrow ? &c->matched : 0, &matched);
+
+  c->matched.free_shallow();
+  c->matched = matched;
+  util_free(c->input);
+  c->input = String::create(string);
+  return n;
+}
+
+// returns number of found matches
+static int fuzzy_match(Slice string, View<Slice> strings, View<FuzzyMatch> result, bool ignore_identical_strings) {
+  FuzzyIndex index = {};
+  if (string.length)
+    fuzzy_index_init(&index, strings);
+  int n = fuzzy_match(string, strings, index, result, ignore_identical_strings);
+  util_free(index);
+  return n;
+}
+
 static void easy_fuzzy_match(Slice input, View<Slice> options, bool ignore_identical_strings, Array<int> *result) {
   StackArray<FuzzyMatch, 15> matches = {};
   *result = {};
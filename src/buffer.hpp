@@ -7,6 +7,9 @@ const char * const ENDLINE_UNIX = "\n";
 static void util_free(Pos) {}
 
 static bool lines_from_file(Slice filename, Array<StringBuffer> *result, const char **endline_string_result);
+static void lines_from_contents(Slice contents, Array<StringBuffer> *result, const char **endline_string_result);
+static void lines_to_contents(const Array<StringBuffer> &lines, const char *endline_string, String *result);
+static bool contents_to_file(Slice filename, Slice contents);
 
 union Cursor {
   struct {
@@ -77,10 +80,25 @@ static void move_on_delete(Cursor &c, Pos a, Pos b) {
 enum UndoActionType {
   ACTIONTYPE_INSERT,
   ACTIONTYPE_DELETE,
+  ACTIONTYPE_INSERT_BATCH,
   ACTIONTYPE_CURSOR_SNAPSHOT,
   ACTIONTYPE_GROUP_BEGIN,
   ACTIONTYPE_GROUP_END,
 };
+// One of the inserts in BufferData::insert_batch
+struct BatchInsert {
+  Pos a; // where to insert, before any of the inserts in the batch are done
+  Slice s;
+  int cursor_idx;
+  Pos new_a, new_b; // the inserted range, after all of the inserts are done
+};
+
+struct CursorChange {
+  int idx;
+  Cursor cursor;
+};
+
+// All the memory an UndoAction points to is allocated from BufferData::_undo_arena
 struct UndoAction {
   UndoActionType type;
   union {
@@ -88,7 +106,7 @@ struct UndoAction {
     struct {
       Pos a;
       Pos b;
-      String s;
+      Slice s;
       int cursor_idx;
     } insert;
 
@@ -96,21 +114,83 @@ struct UndoAction {
     struct {
       Pos a;
       Pos b;
-      String s;
+      Slice s;
       int cursor_idx;
     } remove;
 
+    // ACTIONTYPE_INSERT_BATCH
+    struct {
+      BatchInsert *inserts; // sorted, and the slices point into text
+      int num_inserts;
+      Slice text;
+    } insert_batch;
+
     // ACTIONTYPE_CURSOR_SNAPSHOT
+    // Only the cursors that changed since the snapshot before it are stored. If all of them are there it's a keyframe
     struct {
-      Array<Cursor> cursors;
-    };
+      CursorChange *changes; // sorted by idx
+      int num_changes;
+      int num_cursors;
+    } snapshot;
   };
+};
+
+// A run of old undo groups, delta encoded into a stream of varints. See undo_compress_actions
+struct UndoBlock {
+  Array<u8> data;
+  int num_actions;
+  int num_groups;
+};
+static void util_free(UndoBlock &b);
+
+// Redos that were replaced by new changes. They are kept, so that you can still go back to them with BufferData::undo_goto
+struct UndoBranch {
+  UndoBlock block; // starts with a keyframe
+  int fork; // the state it branches off from
+  int parent; // the branch it branches off, or -1 for the current history
+  int save; // where the file was saved, counted in actions from the start of the branch. UNDO_NO_SAVE if it wasn't
+};
+static void util_free(UndoBranch &b);
+
+// The whole text at some state of the current history, so that going far back or forward only has to replay the groups from the closest one
+struct UndoCheckpoint {
+  int group;
+  String text; // the lines, separated by '\n'
+};
+static void util_free(UndoCheckpoint &c);
+
+// A state in the undo tree
+struct UndoState {
+  int branch; // index into BufferData::_undo_branches, or -1 for the current history
+  int group; // the number of groups from the start of the history
+};
+struct Journal;
+struct SaveJob;
+#define UNDO_NO_SAVE (-0x7fffffff-1)
+
+// The matches of the current search, found once per search and then patched as lines change. See BufferData::search_matches
+struct SearchMatches {
+  int generation; // the G.search_generation they were found for
+  Array<Range> ranges; // sorted
+  int dirty_y0, dirty_y1; // lines that have to be searched again
+};
+
+// A run of lines in the line index, see BufferData::offset_of
+struct LineBlock {
+  i64 bytes; // including an endline for each line
+  int num_lines;
+};
 
-  static UndoAction delete_range(Range r, String s, int cursor_idx = -1);
-  static UndoAction cursor_snapshot(Array<Cursor> cursors);
-  static UndoAction insert_slice(Pos a, Pos b, Slice s, int cursor_idx = -1);
+// The visual columns of a long line, see BufferData::visual_x
+struct VisualLineCache {
+  int y;
+  int tab_width;
+  bool simple; // no tabs or multibyte chars, so the visual column is the same as x
+  Array<int> columns; // the visual column at every VISUAL_CACHE_STEP chars
 };
-static void util_free(UndoAction &a);
+void util_free(VisualLineCache &c) {
+  c.columns.free_shallow();
+}
 
 struct BufferHighlight {
   Pos a;
@@ -145,6 +225,7 @@ struct BufferRectIter {
 
 struct BufferData {
   String filename;
+  u64 file_modify_time, file_size; // what the file looked like when we last loaded or saved it
   Slice description; // only used for special buffers (i.e. if it does not have a filename)
   const char * endline_string; // ENDLINE_WINDOWS or ENDLINE_UNIX
   Language language;
@@ -156,6 +237,13 @@ struct BufferData {
   Array<StringBuffer> lines;
   GroupedData<Array<BlameData>> blame;
 
+  // Files bigger than BUFFER_MAP_SIZE are mapped instead of loaded, and can't be changed.
+  // Their lines point straight into the mapping, and are only found as far as they are needed, see map_lines.
+  // Only the lines on screen are tokenized, see parse_view
+  MappedFile mapping;
+  u64 _mapped_offset; // where the next line starts, or past the end if all lines have been found
+  int _parsed_y0, _parsed_y1; // the lines in parser
+
   Array<BufferHighlight> highlights;
 
   int tab_type; /* 0 for tabs, 1+ for spaces */
@@ -166,13 +254,20 @@ struct BufferData {
 
   /* parser stuff */
   ParseResult parser;
+  FuzzyMenuCache definitions_fuzzy_cache; // for the names of parser.definitions, invalidated by every parse
 
   // methods
   Slice name() const {return filename.chars ? Path::name(filename.slice) : description;}
-  void parse() {util_free(parser); parser = ::parse(lines, language);}
+  void parse() {if (is_mapped()) _parse_mapped(_parsed_y0, _parsed_y1); else util_free(parser), parser = ::parse(lines, language), _search.generation = 0, definitions_fuzzy_cache.valid = false;}
+  void parse_view(int y0, int y1) {if (is_mapped() && (y0 != _parsed_y0 || y1 != _parsed_y1)) _parse_mapped(y0, y1);}
+  void _parse_mapped(int y0, int y1);
+  bool is_mapped() const {return mapping.data;}
+  bool map_lines(int y) {return y < lines.size || (is_mapped() && _map_lines(y));} // finds line y if it isn't already. Returns false if there is no such line
+  bool _map_lines(int y);
+  bool parse(int y0, int old_y1, int new_y1, int limit = INT_MAX) {if (!parse_incremental(parser, lines, language, y0, old_y1, new_y1, limit)) return false; _search_dirty(parser.changed_y0, parser.changed_y1); definitions_fuzzy_cache.valid = false; return true;}
   bool is_bound_to_file() {return filename.chars;}
   void init(bool is_dynamic, Slice description = {});
-  Range* getdefinition(Slice s);
+  Range* getdefinition(Slice s, Range *prev = 0); // the definitions named s are returned in order, pass the previous one to get the next
   Slice getslice(Pos a, Pos b) {return lines[a.y](a.x, b.x);} // range is inclusive
   Slice getslice(Range r) const {return lines[r.a.y](r.a.x, r.b.x);} // range is inclusive
   String get_merged_range(Range r) const;
@@ -184,12 +279,54 @@ struct BufferData {
   StringBuffer& operator[](int i) {return lines[i];}
   const StringBuffer& operator[](int i) const {return lines[i];}
   int num_lines() const {return lines.size;}
+
+  // Converts between positions and byte offsets into the text, counting one byte for each endline.
+  // The lines are split into blocks of about LINE_BLOCK_LINES, with a Fenwick tree of the line and byte counts of the blocks.
+  // Edits update the counts of the blocks they touch, so a query is logarithmic plus a walk over the lines of one block.
+  // Blocks that grew too big or too small are fixed on the next query, when all of lines is up to date again
+  Array<LineBlock> _line_blocks;
+  Array<LineBlock> _line_tree; // 1-based
+  int _line_index_lines; // the lines in the index. If it's not lines.size, someone changed lines behind our back, and it's rebuilt
+  bool _line_index_unbalanced;
+  i64 offset_of(Pos p);
+  Pos pos_of(i64 offset);
+  i64 total_bytes();
+  void _line_index_add(int y, int n); // line y got n chars longer
+  void _line_index_remove(int y0, int y1); // lines [y0, y1] are about to be removed, and are still in lines
+  void _line_index_insert(int y0, int y1); // lines [y0, y1] were inserted
+  void _line_index_clear();
+  void _line_index_update();
+  void _line_index_build();
+  void _line_index_balance();
+  int _line_index_block(int y, int *first_line, i64 *first_byte);
+  void _line_tree_add(int block, int num_lines, i64 bytes);
+  void _line_tree_build();
   Slice slice(Pos p, int len) {return lines[p.y](p.x,p.x+len); }
   Pos to_visual_pos(Pos p);
+
+  // Converts between chars and visual columns in line y. Long lines keep a table of columns, so this doesn't
+  // have to scan from the start of the line every time
+  Array<VisualLineCache> _visual_cache; // sorted by y
+  int visual_x(int y, int x);
+  int from_visual_x(int y, int visual_x);
+  VisualLineCache* _visual_cache_get(int y);
+  void _visual_cache_changed(int y0, int old_y1, int new_y1); // lines [y0, old_y1] were replaced by [y0, new_y1]
   bool find_r(Slice s, int stay, Pos *pos);
   bool find_r(char c, int stay, Pos *pos);
   bool find_r(Array<TokenInfo> search, bool stay, Pos *pos, Range *result);
+  bool find_r(Regex *r, bool stay, Pos *pos, Range *result);
+  bool find(Regex *r, bool stay, Pos *pos, Range *result);
+  View<TokenInfo> line_tokens(int y); // the tokens that start on line y
+
+  // All the matches of the current search. Not for mapped buffers, those are too big to search all at once
+  SearchMatches _search;
+  Array<Range>& search_matches();
+  int search_match_lower_bound(Pos p); // the first match that starts at or after p
+  void _search_line(int y, Array<Range> *result);
+  void _search_changed(int y0, int old_y1, int new_y1); // lines [y0, old_y1] were replaced by [y0, new_y1]
+  void _search_dirty(int y0, int y1);
   bool find(Slice s, bool stay, Pos *pos);
+  bool _matches_lines(int y, Slice s);
   bool find(char c, bool stay, Pos *pos);
   bool find(Array<TokenInfo> search, bool stay, Pos *pos, Range *result);
   TokenInfo* find_start_of_identifier(Pos p);
@@ -198,6 +335,7 @@ struct BufferData {
   void insert(Array<Cursor> &cursors, Slice s, int cursor_idx);
   void remove_trailing_whitespace(Array<Cursor> &cursors, int cursor_idx);
   void insert(Array<Cursor> &cursors, Pos p, Utf8char ch);
+  void insert_batch(Array<Cursor> &cursors, Array<BatchInsert> &inserts, bool re_parse = true);
   void insert(Array<Cursor> &cursors, Utf8char ch, int cursor_idx);
   void insert(Array<Cursor> &cursors, Utf8char ch);
   void delete_line_at(int y);
@@ -243,14 +381,42 @@ struct BufferData {
   // .. call methods on buffer that mutate it
   // buffer.action_end(cursors);
   //
-  // TODO: Use a fixed buffer (circular queue) of undo actions
+  // The history is kept within G.undo_budget bytes. When the recent actions grow too large, the oldest groups
+  // are compressed into UndoBlocks, and when that isn't enough, the oldest blocks are dropped.
+  // Blocks are decompressed again when undo reaches them
+  //
+  // The actions themselves live in _undo_arena. Inserts that follow right after the one before them (typing) are merged
+  // into that one, and cursor snapshots only store the cursors that changed since the previous snapshot
+  //
+  // Changing something after an undo doesn't throw the redos away, they become a branch of the undo tree.
+  // undo_goto can go to any state in the tree. To keep that fast, a copy of the whole text is saved every now and then,
+  // so that it only has to replay the groups from the closest copy. The copies are kept within another G.undo_budget bytes
   int undo_disabled;
   void disable_undo() {++undo_disabled;}
   void enable_undo() {--undo_disabled;}
   Array<UndoAction> _undo_actions;
+  BumpAllocator _undo_arena;
+  Array<Cursor> _undo_last_snapshot; // the cursors of the snapshot before _next_undo_action, if _undo_last_snapshot_valid
+  bool _undo_last_snapshot_valid;
+  int _undo_snapshots_since_keyframe;
+  Array<UndoBlock> _undo_blocks; // compressed history from before _undo_actions[0], oldest first. The first snapshot in _undo_actions is always a keyframe
+  long _undo_bytes; // memory used by _undo_actions
+  long _undo_block_bytes; // memory used by _undo_blocks
+  Array<UndoBranch> _undo_branches;
+  long _undo_branch_bytes;
+  Array<UndoCheckpoint> _undo_checkpoints; // sorted by group. They are all on the current history
+  long _undo_checkpoint_bytes;
+  long _undo_checkpoint_debt; // bytes changed since the last checkpoint
+  int _undo_group; // the state at _next_undo_action, in groups since the start of the history
+  int _undo_first_group; // the oldest state we can go back to. The groups before it have been forgotten
   int _next_undo_action;
-  int _last_save_undo_action;
+  int _last_save_undo_action; // can be negative if the save point has been compressed. UNDO_NO_SAVE if it can never be reached
+  int _saving_undo_action; // what _last_save_undo_action becomes when the save in progress is done. Moves along with it
   int _action_group_depth;
+  Journal *journal; // where the history is streamed to, so that it survives crashes and restarts. See journal.hpp
+  SaveJob *saving; // the save in progress, if any
+  long undo_memory() const {return _undo_bytes + _undo_block_bytes + _undo_branch_bytes;}
+  UndoState undo_state() const {return {-1, _undo_group};}
 
   void print_undo_actions();
   void redo(Array<Cursor> &cursors);
@@ -258,6 +424,35 @@ struct BufferData {
   void action_end(Array<Cursor> &cursors);
   void action_begin(Array<Cursor> &cursors);
   void push_undo_action(UndoAction a);
+  void undo_push_snapshot(Array<Cursor> &cursors);
+  void undo_push_insert(Pos a, Pos b, Slice s, int cursor_idx);
+  void undo_push_insert_batch(Array<BatchInsert> &inserts);
+  void undo_push_delete(Pos a, Pos b, int cursor_idx);
+  void undo_get_snapshot(int i, Array<Cursor> *result);
+  void undo_free(UndoAction &a);
+  bool undo_can_coalesce(UndoActionType type);
+  bool undo_merge_insert(Pos a, Pos b, Slice s, int cursor_idx);
+  bool undo_merge_insert_batch(Array<BatchInsert> &inserts);
+  void undo_remove_empty_group();
+  void redo_action(Array<Cursor> &cursors, const UndoAction &a);
+  bool undo_group(Array<Cursor> &cursors);
+  bool redo_group(Array<Cursor> &cursors);
+  void undo_limit();
+  void undo_make_keyframe(int i);
+  void undo_compress(int i, int n, UndoBlock *block);
+  void undo_decompress();
+  void undo_goto(Array<Cursor> &cursors, UndoState s, Array<UndoState> *keep = 0);
+  void undo_move(Array<Cursor> &cursors, int group);
+  int undo_find_group(int group);
+  int undo_last_group();
+  void undo_compress_redos(UndoBranch *branch);
+  void undo_branch_redos();
+  void undo_swap_branch(int i, Array<UndoState> *keep);
+  void undo_drop_branches(int i, int group);
+  void undo_checkpoint();
+  void undo_drop_checkpoints(int from, int to);
+  void undo_restore_checkpoint(const UndoCheckpoint &c);
+  void undo_list_states(Array<UndoState> *states, Array<String> *labels);
 
   static bool reload(BufferData *b);
   static bool from_file(Slice filename, BufferData *b);
@@ -297,15 +492,19 @@ struct BufferView {
   void action_begin() {data->action_begin(cursors);}
   void undo() {data->undo(cursors);}
   void redo() {data->redo(cursors);}
+  void undo_goto(UndoState s, Array<UndoState> *keep = 0) {data->undo_goto(cursors, s, keep);}
   void deduplicate_cursors();
   void collapse_cursors();
   void update();
   bool find_and_move(Slice s, bool stay);
   bool find_and_move(char c, bool stay);
   bool find_and_move(Array<TokenInfo> search, bool stay);
+  bool find_and_move(Regex *r, bool stay);
   bool find_and_move_r(Slice s, bool stay);
   bool find_and_move_r(char c, bool stay);
   bool find_and_move_r(Array<TokenInfo> search, bool stay);
+  bool find_and_move_r(Regex *r, bool stay);
+  int goto_search_match(bool backwards); // returns the index of the match cursor 0 moved to, or -1
   int advance();
   int advance(Pos &p) {return data->advance(p);}
   int advance(int marker_idx);
@@ -384,45 +583,17 @@ static void util_free(BufferView &b) {
   b.data = 0;
 }
 
-static void util_free(UndoAction &a) {
-  switch (a.type) {
-    case ACTIONTYPE_INSERT:
-      // puts("Freeing INSERT");
-      util_free(a.insert.s);
-      break;
-    case ACTIONTYPE_DELETE:
-      // puts("Freeing DELETE");
-      util_free(a.remove.s);
-      break;
-    case ACTIONTYPE_CURSOR_SNAPSHOT:
-      // puts("Freeing CURSOR SNAPSHOT");
-      util_free(a.cursors);
-      break;
-    case ACTIONTYPE_GROUP_BEGIN:
-    case ACTIONTYPE_GROUP_END:
-      break;
-  }
-}
-
-UndoAction UndoAction::delete_range(Range r, String s, int cursor_idx) {
-  UndoAction a;
-  a.type = ACTIONTYPE_DELETE;
-  a.remove = {r.a, r.b, s, cursor_idx};
-  return a;
+static void util_free(UndoBlock &b) {
+  b.data.free_shallow();
+  b.data = {};
 }
 
-UndoAction UndoAction::cursor_snapshot(Array<Cursor> cursors) {
-  UndoAction a;
-  a.type = ACTIONTYPE_CURSOR_SNAPSHOT;
-  a.cursors = cursors.copy_shallow();
-  return a;
+static void util_free(UndoBranch &b) {
+  util_free(b.block);
 }
 
-UndoAction UndoAction::insert_slice(Pos a, Pos b, Slice s, int cursor_idx) {
-  UndoAction act;
-  act.type = ACTIONTYPE_INSERT;
-  act.insert = {a, b, String::create(s), cursor_idx};
-  return act;
+static void util_free(UndoCheckpoint &c) {
+  util_free(c.text);
 }
 
 void swap_range(BufferData &buffer, Pos &a, Pos &b) {
@@ -479,8 +650,37 @@ static void name(BufferData *buffer, Pos a, Pos b) { \
   } \
 }
 
+// moves p past all the inserts of the batch that was just done, in one go
+static Array<BatchInsert> *_batch_insert_current;
+static void move_on_batch_insert(Pos &p, Pos, Pos) {
+  Array<BatchInsert> &inserts = *_batch_insert_current;
+
+  // find the last insert at or before p
+  int lo = 0, hi = inserts.size;
+  while (lo < hi) {
+    int mid = (lo + hi)/2;
+    if (inserts[mid].a <= p)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return;
+
+  BatchInsert &e = inserts[lo-1];
+  if (e.a.y == p.y)
+    p = {e.new_b.x + p.x - e.a.x, e.new_b.y};
+  else
+    p.y += e.new_b.y - e.a.y;
+}
+static void move_on_batch_insert(Cursor &c, Pos a, Pos b) {
+  move_on_batch_insert(c.pos, a, b);
+  c.ghost_x = c.x;
+}
+
 UPDATE_CURSORS(move_cursors_on_insert, move_on_insert)
 UPDATE_CURSORS(move_cursors_on_delete, move_on_delete)
+UPDATE_CURSORS(move_cursors_on_batch_insert, move_on_batch_insert)
 UPDATE_CURSORS(clamp_cursors, clamp_cursor)
 
 TokenInfo* BufferData::find_start_of_identifier(Pos pos) {
@@ -492,6 +692,8 @@ TokenInfo* BufferData::find_start_of_identifier(Pos pos) {
 }
 
 void BufferData::remove_range(Array<Cursor> &cursors, Pos a, Pos b, int cursor_idx, bool re_parse) {
+  if (is_mapped())
+    return;
   // log_info("before: (%i %i) (%i %i)\n", a.x, a.y, b.x, b.y);
   if (b <= a)
     swap_range(*this, a, b);
@@ -501,21 +703,30 @@ void BufferData::remove_range(Array<Cursor> &cursors, Pos a, Pos b, int cursor_i
   G.flags.cursor_dirty = true;
 
   if (!undo_disabled)
-    push_undo_action(UndoAction::delete_range({a,b}, range_to_string({a,b}).string, cursor_idx));
+    undo_push_delete(a, b, cursor_idx);
 
-  if (a.y == b.y)
+  int num_removed = 0;
+  _visual_cache_changed(a.y, at_most(b.y, lines.size-1), a.y);
+  _search_changed(a.y, at_most(b.y, lines.size-1), a.y);
+  if (a.y == b.y) {
     lines[a.y].remove(a.x, b.x-a.x);
+    _line_index_add(a.y, a.x-b.x);
+  }
   else {
+    num_removed = at_most(b.y - a.y, lines.size - a.y - 1);
+    _line_index_remove(a.y, a.y + num_removed);
+
     // append end of b onto a
     lines[a.y].length = a.x;
     if (b.y < lines.size)
       lines[a.y] += lines[b.y](b.x, -1);
     // delete lines a+1 to and including b
-    lines.remove_slow_and_free(a.y+1, at_most(b.y - a.y, lines.size - a.y - 1));
+    lines.remove_slow_and_free(a.y+1, num_removed);
+    _line_index_insert(a.y, a.y);
   }
 
   if (re_parse)
-    parse();
+    parse(a.y, a.y + num_removed, a.y);
 
   move_cursors_on_delete(this, a, b);
 
@@ -706,19 +917,18 @@ void BufferData::insert(Array<Cursor> &cursors, Slice s, int cursor_idx) {
 }
 
 void BufferData::insert(Array<Cursor> &cursors, const Pos a, Slice s, int cursor_index_hint, bool re_parse) {
-  if (!s.length)
+  if (!s.length || is_mapped())
     return;
 
   action_begin(cursors);
   G.flags.cursor_dirty = true;
 
+  // count lines, memchr is a lot faster than looking at each char for long pastes
   int num_lines = 0;
   int last_endline = 0;
-  for (int i = 0; i < s.length; ++i) {
-    if (s[i] == '\n') {
-      last_endline = i;
-      ++num_lines;
-    }
+  for (const char *c = s.chars, *end = s.chars + s.length; (c = (const char*)memchr(c, '\n', end - c)); ++c) {
+    last_endline = c - s.chars;
+    ++num_lines;
   }
 
   Pos b;
@@ -728,52 +938,205 @@ void BufferData::insert(Array<Cursor> &cursors, const Pos a, Slice s, int cursor
     b = {a.x + s.length, a.y};
 
   if (!undo_disabled)
-    push_undo_action(UndoAction::insert_slice(a, b, s, cursor_index_hint));
+    undo_push_insert(a, b, s, cursor_index_hint);
 
-  if (num_lines == 0)
+  _visual_cache_changed(a.y, a.y, b.y);
+  _search_changed(a.y, a.y, b.y);
+  if (num_lines == 0) {
     lines[a.y].insert(a.x, s);
+    _line_index_add(a.y, s.length);
+  }
   else {
+    _line_index_remove(a.y, a.y);
+
+    // make room for all the new lines with a single move of the line array
     lines.insertz(a.y+1, num_lines);
-    // construct last line
-    lines[b.y] += s(last_endline+1, -1);
-    lines[b.y] += lines[a.y](a.x, -1);
 
-    // resize first line
-    lines[a.y].length = a.x;
+    // construct last line
+    // every new line is allocated at its final size, instead of growing it piece by piece
+    Slice last = s(last_endline+1, -1);
+    Slice rest = lines[a.y](a.x, -1);
+    if (last.length + rest.length) {
+      lines[b.y] = StringBuffer::create(last.length + rest.length);
+      lines[b.y] += last;
+      lines[b.y] += rest;
+    }
 
     // first line
-    int ai = 0, bi = 0;
-    s.find('\n', &bi);
-    lines[a.y] += s(0, bi);
-    ++bi;
-    ai = bi;
+    const char *p = s.chars;
+    const char *nl = (const char*)memchr(p, '\n', s.length);
+    lines[a.y].length = a.x;
+    lines[a.y] += Slice{(char*)p, (int)(nl - p)};
 
     // all lines in between
-    int y = a.y+1;
-    while (s.find(ai, '\n', &bi)) {
-      lines[y++] += s(ai, bi);
-      ++bi;
-      ai = bi;
+    for (int y = a.y+1; y < b.y; ++y) {
+      p = nl+1;
+      nl = (const char*)memchr(p, '\n', s.chars + s.length - p);
+      if (nl > p) {
+        lines[y] = StringBuffer::create((int)(nl - p));
+        lines[y] += Slice{(char*)p, (int)(nl - p)};
+      }
     }
+    _line_index_insert(a.y, b.y);
   }
 
   if (re_parse)
-    parse();
+    parse(a.y, a.y, b.y);
   move_cursors_on_insert(this, a, b);
 
   highlight_range(a,b);
   action_end(cursors);
 }
 
-void BufferData::insert(Array<Cursor> &cursors, Slice s) {
+static int batch_insert_cmp(const void *aa, const void *bb) {
+  BatchInsert *a = (BatchInsert*)aa, *b = (BatchInsert*)bb;
+  if (a->a != b->a)
+    return a->a < b->a ? -1 : 1;
+  return a->cursor_idx - b->cursor_idx;
+}
+
+// Does a lot of inserts at once, for example one for each cursor.
+// This is the same as calling insert() for each of them in order, except that the buffer is only walked once,
+// markers are only moved once, each area is only reparsed once, and only one undo action is added.
+// Inserts at the same position are done in cursor_idx order
+void BufferData::insert_batch(Array<Cursor> &cursors, Array<BatchInsert> &inserts, bool re_parse) {
+  if (is_mapped())
+    return;
+  for (int i = 0; i < inserts.size; ++i)
+    if (!inserts[i].s.length)
+      inserts[i--] = inserts[--inserts.size];
+  if (!inserts.size)
+    return;
+
   action_begin(cursors);
+  G.flags.cursor_dirty = true;
 
-  for (int i = 0; i < cursors.size; ++i)
-    insert(cursors, cursors[i].pos, s);
+  qsort(inserts.items, inserts.size, sizeof(inserts[0]), batch_insert_cmp);
+
+  int num_new_lines = 0;
+  for (BatchInsert &e : inserts)
+    for (const char *c = e.s.chars, *end = e.s.chars + e.s.length; (c = (const char*)memchr(c, '\n', end - c)); ++c)
+      ++num_new_lines;
+
+  // no new lines, so we can just rebuild each line that has inserts on it
+  if (num_new_lines == 0) {
+    for (int i = 0; i < inserts.size;) {
+      const int y = inserts[i].a.y;
+      int len = lines[y].length;
+      for (int j = i; j < inserts.size && inserts[j].a.y == y; ++j)
+        len += inserts[j].s.length;
+
+      StringBuffer line = StringBuffer::create(len);
+      int x = 0;
+      for (; i < inserts.size && inserts[i].a.y == y; ++i) {
+        BatchInsert &e = inserts[i];
+        line += lines[y](x, e.a.x);
+        x = e.a.x;
+        e.new_a = {line.length, y};
+        line += e.s;
+        e.new_b = {line.length, y};
+      }
+      line += lines[y](x, -1);
+      _line_index_add(y, line.length - lines[y].length);
+      _visual_cache_changed(y, y, y);
+      util_free(lines[y]);
+      lines[y] = line;
+    }
+  }
+  // otherwise build a new line array in one pass. Lines without inserts are just moved over
+  else {
+    // each line with inserts is replaced by the lines it becomes. From the bottom, so the lines above keep their place in the index
+    for (int i = inserts.size-1; i >= 0; --i)
+      if (i == inserts.size-1 || inserts[i].a.y != inserts[i+1].a.y)
+        _line_index_remove(inserts[i].a.y, inserts[i].a.y);
+
+    Array<StringBuffer> result = {};
+    result.reserve(lines.size + num_new_lines);
+    result.push(lines.items, inserts[0].a.y);
+
+    int i = 0;
+    for (int y = inserts[0].a.y; y < lines.size; ++y) {
+      if (i == inserts.size) {
+        result.push(lines.items + y, lines.size - y);
+        break;
+      }
+      if (inserts[i].a.y != y) {
+        result += lines[y];
+        continue;
+      }
+
+      StringBuffer line = {};
+      int x = 0;
+      for (; i < inserts.size && inserts[i].a.y == y; ++i) {
+        BatchInsert &e = inserts[i];
+        line += lines[y](x, e.a.x);
+        x = e.a.x;
+        e.new_a = {line.length, result.size};
+        for (Slice rest = e.s;;) {
+          const char *nl = (const char*)memchr(rest.chars, '\n', rest.length);
+          if (!nl) {
+            line += rest;
+            break;
+          }
+          line += Slice{rest.chars, (int)(nl - rest.chars)};
+          result += line;
+          line = {};
+          rest = Slice{(char*)nl+1, (int)(rest.chars + rest.length - nl - 1)};
+        }
+        e.new_b = {line.length, result.size};
+      }
+      line += lines[y](x, -1);
+      result += line;
+      util_free(lines[y]);
+    }
+
+    lines.free_shallow();
+    lines = result;
+    util_free(_visual_cache);
+    // and then the new lines go in from the top, where the lines above are all in the index again
+    for (int i = 0, first = 0; i < inserts.size; ++i) {
+      if (inserts[i].a.y != inserts[first].a.y)
+        first = i;
+      if (i == inserts.size-1 || inserts[i].a.y != inserts[i+1].a.y)
+        _line_index_insert(inserts[first].new_a.y, inserts[i].new_b.y);
+    }
+  }
+  // the lines between the first and last insert are searched again too, since the dirty lines are one range anyway
+  _search_changed(inserts[0].a.y, inserts.last().a.y, inserts.last().new_b.y);
+
+  if (!undo_disabled)
+    undo_push_insert_batch(inserts);
+
+  // reparse each run of inserts that are close enough to share a parse window,
+  // so that two cursors far apart don't reparse everything in between.
+  // If the window of a run reaches the next one (say an unclosed comment was inserted), they are parsed together
+  if (re_parse) {
+    int dy = 0; // lines added by the runs above, which the old tokens below them have already been moved by
+    for (int i = 0, j = 0; i < inserts.size; i = j) {
+      do {
+        for (++j; j < inserts.size && inserts[j].a.y - inserts[j-1].a.y <= 2*PARSE_CONTEXT_LINES+1; ++j);
+      } while (!parse(inserts[i].a.y + dy, inserts[j-1].a.y + dy, inserts[j-1].new_b.y, j < inserts.size ? inserts[j].new_a.y : INT_MAX));
+      dy = inserts[j-1].new_b.y - inserts[j-1].a.y;
+    }
+  }
 
+  _batch_insert_current = &inserts;
+  move_cursors_on_batch_insert(this, {}, {});
+
+  for (BatchInsert &e : inserts)
+    highlight_range(e.new_a, e.new_b);
   action_end(cursors);
 }
 
+void BufferData::insert(Array<Cursor> &cursors, Slice s) {
+  Array<BatchInsert> inserts = {};
+  inserts.reserve(cursors.size);
+  for (int i = 0; i < cursors.size; ++i)
+    inserts += BatchInsert{cursors[i].pos, s, i};
+  insert_batch(cursors, inserts);
+  inserts.free_shallow();
+}
+
 void BufferData::insert(Array<Cursor> &cursors, Pos pos, Utf8char ch) {
   action_begin(cursors);
 
@@ -790,8 +1153,16 @@ void BufferData::insert(Array<Cursor> &cursors, Pos pos, Utf8char ch) {
 void BufferData::insert(Array<Cursor> &cursors, Utf8char ch) {
   action_begin(cursors);
 
-  for (int i = 0; i < cursors.size; ++i)
-    insert(cursors, cursors[i].pos, ch);
+  // closing brackets reindent the line after each insert, so those can't be batched
+  if (ch == '}' || ch == ')' || ch == ']' || ch == '>') {
+    for (int i = 0; i < cursors.size; ++i)
+      insert(cursors, cursors[i].pos, ch);
+  }
+  else {
+    // TODO: @utf8
+    char c = ch.ansi();
+    insert(cursors, Slice{&c, 1});
+  }
 
   action_end(cursors);
 }
@@ -809,12 +1180,14 @@ void BufferData::insert_tab(Array<Cursor> &cursors, int cursor_idx) {
 }
 
 void BufferData::insert_tab(Array<Cursor> &cursors) {
-  action_begin(cursors);
-
-  for (int i = 0; i < cursors.size; ++i)
-    insert_tab(cursors, i);
-
-  action_end(cursors);
+  if (tab_type == 0)
+    insert(cursors, Slice::create("\t"));
+  else {
+    StringBuffer spaces = {};
+    spaces.append(' ', tab_type);
+    insert(cursors, spaces.slice);
+    util_free(spaces);
+  }
 }
 
 void BufferData::insert_newline(Array<Cursor> &cursors) {
@@ -982,7 +1355,7 @@ int BufferView::advance(int marker_idx) {
   int err = data->advance(&pos.x, &pos.y);
   if (err)
     return err;
-  cursors[marker_idx].ghost_x = data->lines[pos.y].visual_offset(pos.x, G.tab_width);
+  cursors[marker_idx].ghost_x = data->visual_x(pos.y, pos.x);
   return 0;
 }
 
@@ -1020,7 +1393,7 @@ int BufferView::advance_r(int marker_idx) {
   int err = data->advance_r(pos);
   if (err)
     return err;
-  cursors[marker_idx].ghost_x = data->lines[cursors[marker_idx].y].visual_offset(pos.x, G.tab_width);
+  cursors[marker_idx].ghost_x = data->visual_x(cursors[marker_idx].y, pos.x);
   return 0;
 }
 
@@ -1057,6 +1430,56 @@ Language language_from_filename(Slice filename) {
   return language;
 }
 
+#define BUFFER_MAP_SIZE (128*1024*1024)
+// how many lines are found at a time in mapped files
+#define BUFFER_MAP_LINES 4096
+
+bool BufferData::_map_lines(int y) {
+  const char *begin = mapping.data, *end = mapping.data + mapping.size;
+  // find a few more while we're at it, so that scrolling down doesn't come back here for every line
+  const int n = y < INT_MAX - BUFFER_MAP_LINES ? y + BUFFER_MAP_LINES : INT_MAX;
+  while (_mapped_offset <= mapping.size && lines.size < n) {
+    const char *p = begin + _mapped_offset;
+    const char *nl = (const char*)memchr(p, '\n', end - p);
+    const char *e = nl ? nl : end;
+    if (nl && e > p && e[-1] == '\r') {
+      --e;
+      endline_string = ENDLINE_WINDOWS;
+    }
+    // no capacity, since we don't own the chars
+    StringBuffer line = {};
+    line.chars = (char*)p;
+    line.length = (int)at_most(e - p, (ptrdiff_t)INT_MAX);
+    lines += line;
+    _mapped_offset = nl ? (u64)(nl - begin) + 1 : mapping.size + 1;
+  }
+  return y < lines.size;
+}
+
+// Tokenizes lines [y0, y1). They are copied out of the mapping first, since the tokenizers look at the char after the end of a line,
+// and then the tokens are pointed back into the mapping
+void BufferData::_parse_mapped(int y0, int y1) {
+  y1 = clamp(y1, y0+1, lines.size);
+  Array<StringBuffer> window = {};
+  window.resize(y1 - y0);
+  for (int y = y0; y < y1; ++y)
+    window[y - y0] = StringBuffer::create(lines[y].slice);
+
+  util_free(parser);
+  parser = ::parse(window, language);
+  definitions_fuzzy_cache.valid = false;
+  for (TokenInfo &t : parser.tokens) {
+    t.a.y += y0, t.b.y += y0;
+    if (t.str.chars)
+      t.str = lines[t.a.y](t.a.x, t.b.x);
+  }
+  for (Range &r : parser.definitions)
+    r.a.y += y0, r.b.y += y0;
+  _parsed_y0 = y0;
+  _parsed_y1 = y1;
+  util_free(window);
+}
+
 // filename must be absolute
 bool BufferData::from_file(Slice filename, BufferData *buffer) {
   *buffer = {};
@@ -1067,6 +1490,16 @@ bool BufferData::from_file(Slice filename, BufferData *buffer) {
   b.endline_string = ENDLINE_UNIX;
 
   b.filename = filename.copy();
+  File::info(b.filename.chars, &b.file_modify_time, &b.file_size);
+
+  // too big to load, so map it instead
+  if (b.file_size > BUFFER_MAP_SIZE && MappedFile::open(b.filename.chars, &b.mapping)) {
+    b.disable_undo();
+    b.map_lines(0);
+    b._parse_mapped(0, 1);
+    return true;
+  }
+
   if (!lines_from_file(filename, &b.lines, &b.endline_string))
     goto err;
 
@@ -1087,13 +1520,18 @@ bool BufferData::from_file(Slice filename, BufferData *buffer) {
 }
 
 StringBuffer BufferData::range_to_string(const Range r) {
-    // turn range into a string with endlines in it
+  // turn range into a string with endlines in it
   // TODO: We could probably do some compression on this
   if (r.a.y == r.b.y)
     return StringBuffer::create(lines[r.a.y](r.a.x, r.b.x));
   else {
+    // size it up front so we only allocate once
+    int len = lines[r.a.y].length - r.a.x + 1 + r.b.x;
+    for (int y = r.a.y+1; y < r.b.y; ++y)
+      len += lines[y].length + 1;
+    StringBuffer s = StringBuffer::create(len);
+
     // first row
-    StringBuffer s = {};
     s += lines[r.a.y](r.a.x, -1);
     s += '\n';
     for (int y = r.a.y+1; y < r.b.y; ++y) {
@@ -1106,10 +1544,12 @@ StringBuffer BufferData::range_to_string(const Range r) {
   }
 }
 
-Range* BufferData::getdefinition(Slice s) {
-  for (Range &r : parser.definitions)
-    if (getslice(r) == s)
-      return &r;
+Range* BufferData::getdefinition(Slice s, Range *prev) {
+  DefinitionTable &t = parser.definition_table;
+  int i = prev ? definition_table_next(t, (int)(prev - parser.definitions.items)) : definition_table_find(t, s);
+  for (; i != -1; i = definition_table_next(t, i))
+    if (getslice(parser.definitions[i]) == s)
+      return &parser.definitions[i];
   return 0;
 }
 
@@ -1138,142 +1578,652 @@ TokenInfo* BufferData::gettoken(Pos p) {
 }
 #endif
 
-void BufferData::push_undo_action(UndoAction a) {
-  if (undo_disabled)
-    return;
-
-  // remove any redos we might have
-  if (_next_undo_action < _undo_actions.size) {
-    for (int i = _next_undo_action; i < _undo_actions.size; ++i)
-      util_free(_undo_actions[i]);
-
-    // invalidate the save position
-    if (_last_save_undo_action > _next_undo_action)
-      _last_save_undo_action = -1;
+static long undo_action_size(const UndoAction &a) {
+  switch (a.type) {
+    case ACTIONTYPE_INSERT:
+      return sizeof(a) + a.insert.s.length;
+    case ACTIONTYPE_DELETE:
+      return sizeof(a) + a.remove.s.length;
+    case ACTIONTYPE_INSERT_BATCH:
+      return sizeof(a) + a.insert_batch.num_inserts * sizeof(BatchInsert) + a.insert_batch.text.length;
+    case ACTIONTYPE_CURSOR_SNAPSHOT:
+      return sizeof(a) + a.snapshot.num_changes * sizeof(CursorChange);
+    case ACTIONTYPE_GROUP_BEGIN:
+    case ACTIONTYPE_GROUP_END:
+      break;
   }
-  _undo_actions.size = _next_undo_action;
-  _undo_actions += a;
-  ++_next_undo_action;
+  return sizeof(a);
 }
 
-void BufferData::action_begin(Array<Cursor> &cursors) {
-  util_free(blame);
+static bool undo_is_keyframe(const UndoAction &a) {
+  return a.type == ACTIONTYPE_CURSOR_SNAPSHOT && a.snapshot.num_changes == a.snapshot.num_cursors;
+}
 
-  if (undo_disabled)
-    return;
+static Slice undo_copy(BumpAllocator &arena, Slice s) {
+  char *chars = (char*)arena.alloc(s.length);
+  memcpy(chars, s.chars, s.length);
+  return {chars, s.length};
+}
 
-  if (_action_group_depth == 0) {
-    push_undo_action({ACTIONTYPE_GROUP_BEGIN});
-    push_undo_action(UndoAction::cursor_snapshot(cursors));
+void BufferData::undo_free(UndoAction &a) {
+  switch (a.type) {
+    case ACTIONTYPE_INSERT:
+      _undo_arena.dealloc(a.insert.s.chars);
+      break;
+    case ACTIONTYPE_DELETE:
+      _undo_arena.dealloc(a.remove.s.chars);
+      break;
+    case ACTIONTYPE_INSERT_BATCH:
+      _undo_arena.dealloc(a.insert_batch.inserts);
+      _undo_arena.dealloc(a.insert_batch.text.chars);
+      break;
+    case ACTIONTYPE_CURSOR_SNAPSHOT:
+      _undo_arena.dealloc(a.snapshot.changes);
+      break;
+    case ACTIONTYPE_GROUP_BEGIN:
+    case ACTIONTYPE_GROUP_END:
+      break;
   }
-  // TODO: check if anything actually happened between begin and end
-  ++_action_group_depth;
 }
 
-void BufferData::action_end(Array<Cursor> &cursors) {
+void BufferData::push_undo_action(UndoAction a) {
   if (undo_disabled)
     return;
 
-  --_action_group_depth;
-  if (_action_group_depth == 0) {
-    // check if something actually happened
-    bool changed = true;
-    if (_undo_actions[_next_undo_action-1].type == ACTIONTYPE_CURSOR_SNAPSHOT && _undo_actions[_next_undo_action-2].type == ACTIONTYPE_GROUP_BEGIN) {
-      changed = false;
-      UndoAction a = _undo_actions[_next_undo_action-1];
-      // check if cursors changed
-      if (a.cursors.size != cursors.size)
-        changed = true;
-      else {
-        for (int i = 0; i < a.cursors.size; ++i) {
-          if (cursors[i] == a.cursors[i])
-            continue;
-          changed = true;
-          break;
-        }
-      }
-    }
+  // any redos we might have become a branch
+  if (_next_undo_action < _undo_actions.size)
+    undo_branch_redos();
+  _undo_actions += a;
+  _undo_bytes += undo_action_size(a);
+  ++_next_undo_action;
+  if (a.type == ACTIONTYPE_GROUP_END)
+    ++_undo_group;
+  else if (a.type != ACTIONTYPE_CURSOR_SNAPSHOT && a.type != ACTIONTYPE_GROUP_BEGIN)
+    _undo_checkpoint_debt += undo_action_size(a);
+  journal_push(*this, a);
+}
 
-    // if nothing happened, remove group
-    if (!changed) {
-      assert(_undo_actions[_next_undo_action-1].type == ACTIONTYPE_CURSOR_SNAPSHOT);
-      util_free(_undo_actions[_next_undo_action-1]);
-      assert(_undo_actions[_next_undo_action-2].type == ACTIONTYPE_GROUP_BEGIN);
-      _next_undo_action -= 2;
-      _undo_actions.size -= 2;
-      return;
-    }
+// a snapshot stores the whole cursor array at least this often, so getting one back never has to go through more deltas than this
+#define UNDO_KEYFRAME_INTERVAL 64
 
-    if (this == G.editing_pane->buffer.data)
-      G.activation_meter += 1.0f;
+void BufferData::undo_push_snapshot(Array<Cursor> &cursors) {
+  Array<Cursor> &prev = _undo_last_snapshot;
+  // the first snapshot must be a keyframe, since the ones before it might get compressed
+  const bool keyframe = !_undo_last_snapshot_valid || _next_undo_action <= 1 || _undo_snapshots_since_keyframe >= UNDO_KEYFRAME_INTERVAL;
 
-    push_undo_action(UndoAction::cursor_snapshot(cursors));
-    push_undo_action({ACTIONTYPE_GROUP_END});
+  int n = 0;
+  for (int i = 0; i < cursors.size; ++i)
+    if (keyframe || i >= prev.size || !(cursors[i] == prev[i]))
+      ++n;
+
+  UndoAction a = {ACTIONTYPE_CURSOR_SNAPSHOT};
+  a.snapshot.changes = (CursorChange*)_undo_arena.alloc(n * sizeof(CursorChange));
+  a.snapshot.num_changes = n;
+  a.snapshot.num_cursors = cursors.size;
+  n = 0;
+  for (int i = 0; i < cursors.size; ++i)
+    if (keyframe || i >= prev.size || !(cursors[i] == prev[i]))
+      a.snapshot.changes[n++] = {i, cursors[i]};
 
-    // CLIPBOARD
-    {
-      Array<StringBuffer> clips = {};
+  if (undo_is_keyframe(a))
+    _undo_snapshots_since_keyframe = 0;
+  else
+    ++_undo_snapshots_since_keyframe;
+  prev.size = 0;
+  prev.push(cursors.items, cursors.size);
+  _undo_last_snapshot_valid = true;
 
-      // find start of group
-      UndoAction *a = &_undo_actions[_next_undo_action-1];
-      assert(a->type == ACTIONTYPE_GROUP_END);
-      while (a[-1].type != ACTIONTYPE_GROUP_BEGIN) --a;
-      assert(a->type == ACTIONTYPE_CURSOR_SNAPSHOT);
+  push_undo_action(a);
+}
 
-      // only do clipboard if no inserts were done
-      for (UndoAction *act = a; act->type != ACTIONTYPE_GROUP_END; ++act)
-        if (act->type == ACTIONTYPE_INSERT)
-          goto clipboard_done;
+// the cursors of the snapshot at _undo_actions[i]
+void BufferData::undo_get_snapshot(int i, Array<Cursor> *result) {
+  int k = i;
+  while (k > 0 && !undo_is_keyframe(_undo_actions[k]))
+    --k;
 
-      // create stringbuffers
-      clips.resize(a->cursors.size);
-      clips.zero();
+  result->size = 0;
+  for (; k <= i; ++k) {
+    UndoAction &a = _undo_actions[k];
+    if (a.type != ACTIONTYPE_CURSOR_SNAPSHOT)
+      continue;
+    result->resize(a.snapshot.num_cursors);
+    for (int j = 0; j < a.snapshot.num_changes; ++j)
+      (*result)[a.snapshot.changes[j].idx] = a.snapshot.changes[j].cursor;
+  }
+}
 
-      // find every delete action, and if there is a cursor for that, add that delete that cursors 
-      {
-        bool clip_filled = false;
-        for (; a->type != ACTIONTYPE_GROUP_END; ++a) {
-          if (a->type != ACTIONTYPE_DELETE)
-            continue;
-          if (a->remove.cursor_idx == -1)
-            continue;
+// inserts are only merged up to this size, so that the merged text doesn't have to be moved around too much
+#define UNDO_COALESCE_MAX 1024
 
-          clips[a->remove.cursor_idx] += a->remove.s;
-          clip_filled = true;
-        }
+// whether the next action can be merged into the one before it
+bool BufferData::undo_can_coalesce(UndoActionType type) {
+  return _next_undo_action > 0 &&
+         _next_undo_action == _undo_actions.size &&
+         _last_save_undo_action != _next_undo_action &&
+         _saving_undo_action != _next_undo_action &&
+         _undo_actions[_next_undo_action-1].type == type;
+}
 
-        if (clip_filled) {
-          StringBuffer clip = {};
-          for (int i = 0; i < clips.size; ++i) {
-            clip += clips[i];
-            if (i < clips.size-1)
-              clip += '\n';
-          }
-          clip += '\0';
-          SDL_SetClipboardText(clip.chars);
-          util_free(clip);
-        }
-      }
+// typing appends to the insert before it, instead of adding a new action for every key. Returns false if it can't be merged
+bool BufferData::undo_merge_insert(Pos a, Pos b, Slice s, int cursor_idx) {
+  if (!undo_can_coalesce(ACTIONTYPE_INSERT))
+    return false;
+  UndoAction &prev = _undo_actions[_next_undo_action-1];
+  if (prev.insert.b != a || prev.insert.cursor_idx != cursor_idx || prev.insert.s.length + s.length > UNDO_COALESCE_MAX)
+    return false;
 
-      clipboard_done:
-      util_free(clips);
+  _undo_bytes -= undo_action_size(prev);
+  char *chars = (char*)_undo_arena.grow(prev.insert.s.chars, prev.insert.s.length, prev.insert.s.length + s.length);
+  memcpy(chars + prev.insert.s.length, s.chars, s.length);
+  prev.insert.s = {chars, prev.insert.s.length + s.length};
+  prev.insert.b = b;
+  _undo_bytes += undo_action_size(prev);
+  _undo_checkpoint_debt += s.length;
+  return true;
+}
+
+// typing with multiple cursors appends to each insert of the batch before it
+bool BufferData::undo_merge_insert_batch(Array<BatchInsert> &inserts) {
+  if (!undo_can_coalesce(ACTIONTYPE_INSERT_BATCH))
+    return false;
+
+  int len = 0;
+  for (BatchInsert &e : inserts)
+    len += e.s.length;
+  UndoAction &prev = _undo_actions[_next_undo_action-1];
+  bool follows = prev.insert_batch.num_inserts == inserts.size && prev.insert_batch.text.length + len <= UNDO_COALESCE_MAX * inserts.size;
+  for (int i = 0; follows && i < inserts.size; ++i)
+    follows = inserts[i].a == prev.insert_batch.inserts[i].new_b && inserts[i].cursor_idx == prev.insert_batch.inserts[i].cursor_idx;
+  if (!follows)
+    return false;
+
+  _undo_bytes -= undo_action_size(prev);
+  Slice &text = prev.insert_batch.text;
+
+  // with a single insert we can just grow the text
+  if (inserts.size == 1) {
+    BatchInsert &e = prev.insert_batch.inserts[0];
+    char *chars = (char*)_undo_arena.grow(text.chars, text.length, text.length + len);
+    memcpy(chars + text.length, inserts[0].s.chars, len);
+    text = {chars, text.length + len};
+    e.s = text;
+    e.new_b = inserts[0].new_b;
+  }
+  // otherwise each insert gets its new text at the end, so it has to be rebuilt
+  else {
+    char *chars = (char*)_undo_arena.alloc(text.length + len);
+    int n = 0;
+    _batch_insert_current = &inserts;
+    for (int i = 0; i < inserts.size; ++i) {
+      BatchInsert &e = prev.insert_batch.inserts[i];
+      memcpy(chars + n, e.s.chars, e.s.length);
+      memcpy(chars + n + e.s.length, inserts[i].s.chars, inserts[i].s.length);
+      e.s = {chars + n, e.s.length + inserts[i].s.length};
+      n += e.s.length;
+      move_on_batch_insert(e.new_a, {}, {});
+      e.new_b = inserts[i].new_b;
     }
+    _undo_arena.dealloc(text.chars);
+    text = {chars, n};
   }
-}
 
-void BufferData::undo(Array<Cursor> &cursors) {
-  util_free(blame);
+  _undo_bytes += undo_action_size(prev);
+  _undo_checkpoint_debt += len;
+  return true;
+}
 
-  if (undo_disabled)
+void BufferData::undo_push_insert(Pos a, Pos b, Slice s, int cursor_idx) {
+  if (undo_merge_insert(a, b, s, cursor_idx)) {
+    journal_merge_insert(*this, a, b, s, cursor_idx);
     return;
-  if (!_next_undo_action)
+  }
+
+  UndoAction act = {ACTIONTYPE_INSERT};
+  act.insert = {a, b, undo_copy(_undo_arena, s), cursor_idx};
+  push_undo_action(act);
+}
+
+// the positions in inserts must already be filled in by insert_batch
+void BufferData::undo_push_insert_batch(Array<BatchInsert> &inserts) {
+  if (undo_merge_insert_batch(inserts)) {
+    journal_merge_insert_batch(*this, inserts);
     return;
+  }
 
-  ++undo_disabled;
-  raw_begin();
-  --_next_undo_action;
-  assert(_undo_actions[_next_undo_action].type == ACTIONTYPE_GROUP_END);
-  --_next_undo_action;
+  int len = 0;
+  for (BatchInsert &e : inserts)
+    len += e.s.length;
+  UndoAction a = {ACTIONTYPE_INSERT_BATCH};
+  a.insert_batch.inserts = (BatchInsert*)_undo_arena.alloc(inserts.size * sizeof(BatchInsert));
+  a.insert_batch.num_inserts = inserts.size;
+  char *chars = (char*)_undo_arena.alloc(len);
+  a.insert_batch.text = {chars, len};
+  int n = 0;
+  for (int i = 0; i < inserts.size; ++i) {
+    BatchInsert e = inserts[i];
+    memcpy(chars + n, e.s.chars, e.s.length);
+    e.s.chars = chars + n;
+    n += e.s.length;
+    a.insert_batch.inserts[i] = e;
+  }
+  push_undo_action(a);
+}
+
+void BufferData::undo_push_delete(Pos a, Pos b, int cursor_idx) {
+  StringBuffer s = range_to_string({a,b});
+  UndoAction act = {ACTIONTYPE_DELETE};
+  act.remove = {a, b, undo_copy(_undo_arena, s.slice), cursor_idx};
+  util_free(s);
+  push_undo_action(act);
+}
+
+/*
+ * Undo compression
+ *
+ * Groups are written as a stream of zigzag varints. Positions are stored relative to the position of
+ * the action before it (just the x if on the same line), and the cursors in a snapshot relative to the cursor before them.
+ * So most numbers fit in a single byte.
+ */
+
+static void undo_write(Array<u8> &out, int v) {
+  u32 z = ((u32)v << 1) ^ (u32)(v >> 31);
+  for (; z >= 0x80; z >>= 7)
+    out += (u8)(z | 0x80);
+  out += (u8)z;
+}
+
+static int undo_read(const u8 *&p) {
+  u32 z = 0;
+  for (int shift = 0;; shift += 7) {
+    u8 b = *p++;
+    z |= (u32)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  return (int)(z >> 1) ^ -(int)(z & 1);
+}
+
+static void undo_write(Array<u8> &out, Pos p, Pos prev) {
+  undo_write(out, p.y - prev.y);
+  undo_write(out, p.y == prev.y ? p.x - prev.x : p.x);
+}
+
+static Pos undo_read(const u8 *&p, Pos prev) {
+  Pos r;
+  r.y = prev.y + undo_read(p);
+  r.x = undo_read(p);
+  if (r.y == prev.y)
+    r.x += prev.x;
+  return r;
+}
+
+static void undo_write(Array<u8> &out, Slice s) {
+  undo_write(out, s.length);
+  out.push((u8*)s.chars, s.length);
+}
+
+static Slice undo_read_string(BumpAllocator &arena, const u8 *&p) {
+  Slice s;
+  s.length = undo_read(p);
+  s = undo_copy(arena, Slice{(char*)p, s.length});
+  p += s.length;
+  return s;
+}
+
+static void undo_compress_actions(Array<u8> &out, const UndoAction *actions, int n) {
+  Pos prev = {};
+
+  for (const UndoAction *a = actions; a < actions+n; ++a) {
+    out += (u8)a->type;
+    switch (a->type) {
+      case ACTIONTYPE_INSERT:
+      case ACTIONTYPE_DELETE: {
+        // insert and remove have the same layout
+        undo_write(out, a->insert.a, prev);
+        undo_write(out, a->insert.b, a->insert.a);
+        undo_write(out, a->insert.cursor_idx);
+        undo_write(out, a->insert.s);
+        prev = a->insert.a;
+        break;
+      }
+      case ACTIONTYPE_INSERT_BATCH:
+        undo_write(out, a->insert_batch.num_inserts);
+        undo_write(out, a->insert_batch.text);
+        for (int i = 0; i < a->insert_batch.num_inserts; ++i) {
+          const BatchInsert &e = a->insert_batch.inserts[i];
+          undo_write(out, e.a, prev);
+          undo_write(out, e.s.length);
+          undo_write(out, e.cursor_idx);
+          undo_write(out, e.new_a, e.a);
+          undo_write(out, e.new_b, e.new_a);
+          prev = e.a;
+        }
+        break;
+      case ACTIONTYPE_CURSOR_SNAPSHOT: {
+        undo_write(out, a->snapshot.num_cursors);
+        undo_write(out, a->snapshot.num_changes);
+        CursorChange base = {-1};
+        for (int i = 0; i < a->snapshot.num_changes; ++i) {
+          CursorChange c = a->snapshot.changes[i];
+          undo_write(out, c.idx - base.idx);
+          undo_write(out, c.cursor.pos, base.cursor.pos);
+          undo_write(out, c.cursor.ghost_x);
+          base = c;
+        }
+        break;
+      }
+      case ACTIONTYPE_GROUP_BEGIN:
+      case ACTIONTYPE_GROUP_END:
+        break;
+    }
+  }
+}
+
+static void undo_decompress_actions(BumpAllocator &arena, const Array<u8> &data, UndoAction *actions, int n) {
+  Pos prev = {};
+  const u8 *p = data.items;
+
+  for (UndoAction *a = actions; a < actions+n; ++a) {
+    a->type = (UndoActionType)*p++;
+    switch (a->type) {
+      case ACTIONTYPE_INSERT:
+      case ACTIONTYPE_DELETE: {
+        a->insert.a = undo_read(p, prev);
+        a->insert.b = undo_read(p, a->insert.a);
+        a->insert.cursor_idx = undo_read(p);
+        a->insert.s = undo_read_string(arena, p);
+        prev = a->insert.a;
+        break;
+      }
+      case ACTIONTYPE_INSERT_BATCH: {
+        a->insert_batch.num_inserts = undo_read(p);
+        a->insert_batch.inserts = (BatchInsert*)arena.alloc(a->insert_batch.num_inserts * sizeof(BatchInsert));
+        a->insert_batch.text = undo_read_string(arena, p);
+        const char *s = a->insert_batch.text.chars;
+        for (int i = 0; i < a->insert_batch.num_inserts; ++i) {
+          BatchInsert &e = a->insert_batch.inserts[i];
+          e.a = undo_read(p, prev);
+          e.s = Slice{s, undo_read(p)};
+          e.cursor_idx = undo_read(p);
+          e.new_a = undo_read(p, e.a);
+          e.new_b = undo_read(p, e.new_a);
+          s += e.s.length;
+          prev = e.a;
+        }
+        break;
+      }
+      case ACTIONTYPE_CURSOR_SNAPSHOT: {
+        a->snapshot.num_cursors = undo_read(p);
+        a->snapshot.num_changes = undo_read(p);
+        a->snapshot.changes = (CursorChange*)arena.alloc(a->snapshot.num_changes * sizeof(CursorChange));
+        CursorChange base = {-1};
+        for (int i = 0; i < a->snapshot.num_changes; ++i) {
+          CursorChange &c = a->snapshot.changes[i];
+          c.idx = base.idx + undo_read(p);
+          c.cursor.pos = undo_read(p, base.cursor.pos);
+          c.cursor.ghost_x = undo_read(p);
+          base = c;
+        }
+        break;
+      }
+      case ACTIONTYPE_GROUP_BEGIN:
+      case ACTIONTYPE_GROUP_END:
+        break;
+    }
+  }
+}
+
+// how much of the recent history to compress into one block
+#define UNDO_BLOCK_SIZE (64*1024)
+
+// Keeps the undo history within G.undo_budget. Only whole groups that are before _next_undo_action are compressed,
+// so redo never has to decompress anything
+void BufferData::undo_limit() {
+  if (undo_disabled || _action_group_depth)
+    return;
+
+  // compress the oldest groups until the recent history is down to a quarter of the budget
+  if (_undo_bytes > G.undo_budget/2) {
+    while (_undo_bytes > G.undo_budget/4) {
+      // find the groups that go into this block
+      int n = 0;
+      long bytes = 0;
+      for (int i = 0; i < _next_undo_action && (bytes < UNDO_BLOCK_SIZE || !n); ++i) {
+        bytes += undo_action_size(_undo_actions[i]);
+        if (_undo_actions[i].type == ACTIONTYPE_GROUP_END)
+          n = i+1;
+      }
+      if (!n)
+        break;
+
+      // the snapshots left behind are built on the keyframe before them, so make sure that one doesn't go away
+      undo_make_keyframe(n);
+
+      UndoBlock block;
+      undo_compress(0, n, &block);
+      _undo_blocks += block;
+      _undo_block_bytes += sizeof(block) + block.data.cap;
+      _next_undo_action -= n;
+      if (_last_save_undo_action != UNDO_NO_SAVE)
+        _last_save_undo_action -= n;
+      if (_saving_undo_action != UNDO_NO_SAVE)
+        _saving_undo_action -= n;
+    }
+  }
+
+  // and if that wasn't enough, forget the oldest history, and then the branches
+  while (undo_memory() > G.undo_budget && _undo_blocks.size) {
+    _undo_first_group += _undo_blocks[0].num_groups;
+    _undo_block_bytes -= sizeof(_undo_blocks[0]) + _undo_blocks[0].data.cap;
+    _undo_blocks.remove_slow_and_free(0, 1);
+    undo_drop_branches(-1, _undo_first_group);
+    undo_drop_checkpoints(INT_MIN, _undo_first_group);
+  }
+  while (undo_memory() > G.undo_budget && _undo_branches.size)
+    undo_drop_branches(0, INT_MIN);
+}
+
+// makes the first snapshot at or after i a keyframe, so that it doesn't depend on anything before i
+void BufferData::undo_make_keyframe(int i) {
+  while (i < _undo_actions.size && _undo_actions[i].type != ACTIONTYPE_CURSOR_SNAPSHOT)
+    ++i;
+  if (i == _undo_actions.size || undo_is_keyframe(_undo_actions[i]))
+    return;
+
+  UndoAction &a = _undo_actions[i];
+  Array<Cursor> cursors = {};
+  undo_get_snapshot(i, &cursors);
+  _undo_bytes -= undo_action_size(a);
+  _undo_arena.dealloc(a.snapshot.changes);
+  a.snapshot.changes = (CursorChange*)_undo_arena.alloc(cursors.size * sizeof(CursorChange));
+  for (int j = 0; j < cursors.size; ++j)
+    a.snapshot.changes[j] = {j, cursors[j]};
+  a.snapshot.num_changes = a.snapshot.num_cursors = cursors.size;
+  _undo_bytes += undo_action_size(a);
+  util_free(cursors);
+}
+
+// compresses the actions [i, i+n) into a block, and removes them
+void BufferData::undo_compress(int i, int n, UndoBlock *block) {
+  Array<u8> data = {};
+  undo_compress_actions(data, _undo_actions.items + i, n);
+  *block = {};
+  block->data.reserve(data.size);
+  block->data.push(data.items, data.size);
+  block->num_actions = n;
+  data.free_shallow();
+
+  for (int j = i; j < i+n; ++j) {
+    if (_undo_actions[j].type == ACTIONTYPE_GROUP_END)
+      ++block->num_groups;
+    _undo_bytes -= undo_action_size(_undo_actions[j]);
+    undo_free(_undo_actions[j]);
+  }
+  _undo_actions.remove_slow(i, n);
+}
+
+// puts the newest compressed block back in front of _undo_actions
+void BufferData::undo_decompress() {
+  if (!_undo_blocks.size)
+    return;
+
+  UndoBlock &block = _undo_blocks.last();
+  const int n = block.num_actions;
+  _undo_actions.insertz(0, n);
+  undo_decompress_actions(_undo_arena, block.data, _undo_actions.items, n);
+  for (int i = 0; i < n; ++i)
+    _undo_bytes += undo_action_size(_undo_actions[i]);
+  _next_undo_action += n;
+  if (_last_save_undo_action != UNDO_NO_SAVE)
+    _last_save_undo_action += n;
+  if (_saving_undo_action != UNDO_NO_SAVE)
+    _saving_undo_action += n;
+
+  _undo_block_bytes -= sizeof(block) + block.data.cap;
+  util_free(block);
+  --_undo_blocks.size;
+}
+
+void BufferData::action_begin(Array<Cursor> &cursors) {
+  util_free(blame);
+
+  if (undo_disabled)
+    return;
+
+  if (_action_group_depth == 0) {
+    push_undo_action({ACTIONTYPE_GROUP_BEGIN});
+    undo_push_snapshot(cursors);
+  }
+  // TODO: check if anything actually happened between begin and end
+  ++_action_group_depth;
+}
+
+// removes a group that only has the GROUP_BEGIN and the first snapshot in it
+void BufferData::undo_remove_empty_group() {
+  assert(_undo_actions[_next_undo_action-1].type == ACTIONTYPE_CURSOR_SNAPSHOT);
+  _undo_bytes -= undo_action_size(_undo_actions[_next_undo_action-1]) + undo_action_size(_undo_actions[_next_undo_action-2]);
+  undo_free(_undo_actions[_next_undo_action-1]);
+  assert(_undo_actions[_next_undo_action-2].type == ACTIONTYPE_GROUP_BEGIN);
+  _next_undo_action -= 2;
+  _undo_actions.size -= 2;
+  _undo_last_snapshot_valid = false;
+}
+
+void BufferData::action_end(Array<Cursor> &cursors) {
+  if (undo_disabled)
+    return;
+
+  --_action_group_depth;
+  if (_action_group_depth == 0) {
+    // check if something actually happened
+    bool changed = true;
+    if (_undo_actions[_next_undo_action-1].type == ACTIONTYPE_CURSOR_SNAPSHOT && _undo_actions[_next_undo_action-2].type == ACTIONTYPE_GROUP_BEGIN) {
+      changed = false;
+      // check if cursors changed
+      Array<Cursor> &prev = _undo_last_snapshot;
+      if (prev.size != cursors.size)
+        changed = true;
+      else {
+        for (int i = 0; i < prev.size; ++i) {
+          if (cursors[i] == prev[i])
+            continue;
+          changed = true;
+          break;
+        }
+      }
+    }
+
+    // if nothing happened, remove group
+    if (!changed) {
+      undo_remove_empty_group();
+      journal_record(*this, JOURNAL_POP);
+      return;
+    }
+
+    if (this == G.editing_pane->buffer.data)
+      G.activation_meter += 1.0f;
+
+    undo_push_snapshot(cursors);
+    push_undo_action({ACTIONTYPE_GROUP_END});
+    undo_checkpoint();
+
+    // CLIPBOARD
+    {
+      Array<StringBuffer> clips = {};
+
+      // find start of group
+      UndoAction *a = &_undo_actions[_next_undo_action-1];
+      assert(a->type == ACTIONTYPE_GROUP_END);
+      while (a[-1].type != ACTIONTYPE_GROUP_BEGIN) --a;
+      assert(a->type == ACTIONTYPE_CURSOR_SNAPSHOT);
+
+      // only do clipboard if no inserts were done
+      for (UndoAction *act = a; act->type != ACTIONTYPE_GROUP_END; ++act)
+        if (act->type == ACTIONTYPE_INSERT || act->type == ACTIONTYPE_INSERT_BATCH)
+          goto clipboard_done;
+
+      // create stringbuffers
+      clips.resize(a->snapshot.num_cursors);
+      clips.zero();
+
+      // find every delete action, and if there is a cursor for that, add that delete that cursors 
+      {
+        bool clip_filled = false;
+        for (; a->type != ACTIONTYPE_GROUP_END; ++a) {
+          if (a->type != ACTIONTYPE_DELETE)
+            continue;
+          if (a->remove.cursor_idx == -1)
+            continue;
+
+          clips[a->remove.cursor_idx] += a->remove.s;
+          clip_filled = true;
+        }
+
+        if (clip_filled) {
+          StringBuffer clip = {};
+          for (int i = 0; i < clips.size; ++i) {
+            clip += clips[i];
+            if (i < clips.size-1)
+              clip += '\n';
+          }
+          clip += '\0';
+          SDL_SetClipboardText(clip.chars);
+          util_free(clip);
+        }
+      }
+
+      clipboard_done:
+      util_free(clips);
+    }
+
+    undo_limit();
+  }
+}
+
+void BufferData::undo(Array<Cursor> &cursors) {
+  util_free(blame);
+
+  if (undo_disabled)
+    return;
+  if (!undo_group(cursors))
+    return;
+  parse();
+  journal_record(*this, JOURNAL_UNDO);
+}
+
+// undoes the group before _next_undo_action, without parsing. Returns false if there was nothing to undo
+bool BufferData::undo_group(Array<Cursor> &cursors) {
+  if (!_next_undo_action)
+    undo_decompress();
+  if (!_next_undo_action)
+    return false;
+
+  ++undo_disabled;
+  raw_begin();
+  --_next_undo_action;
+  assert(_undo_actions[_next_undo_action].type == ACTIONTYPE_GROUP_END);
+  --_next_undo_action;
   for (; _undo_actions[_next_undo_action].type != ACTIONTYPE_GROUP_BEGIN; --_next_undo_action) {
     UndoAction a = _undo_actions[_next_undo_action];
     // printf("undo action: %i\n", a.type);
@@ -1282,13 +2232,17 @@ void BufferData::undo(Array<Cursor> &cursors) {
         // printf("Removing {%i %i}, {%i %i}\n", a.insert.a.x, a.insert.a.y, a.insert.b.x, a.insert.b.y);
         remove_range(cursors, a.insert.a, a.insert.b, -1, false);
         break;
+      case ACTIONTYPE_INSERT_BATCH:
+        // the later inserts don't move the earlier ones, so remove them from the back
+        for (int i = a.insert_batch.num_inserts-1; i >= 0; --i)
+          remove_range(cursors, a.insert_batch.inserts[i].new_a, a.insert_batch.inserts[i].new_b, -1, false);
+        break;
       case ACTIONTYPE_DELETE:
         // printf("Inserting '%.*s' at {%i %i}\n", a.remove.s.slice.length, a.remove.s.slice.chars, a.remove.a.x, a.remove.a.y);
-        insert(cursors, a.remove.a, a.remove.s.slice, -1, false);
+        insert(cursors, a.remove.a, a.remove.s, -1, false);
         break;
       case ACTIONTYPE_CURSOR_SNAPSHOT:
-        util_free(cursors);
-        cursors = a.cursors.copy_shallow();
+        undo_get_snapshot(_next_undo_action, &cursors);
         break;
       case ACTIONTYPE_GROUP_BEGIN:
       case ACTIONTYPE_GROUP_END:
@@ -1296,50 +2250,441 @@ void BufferData::undo(Array<Cursor> &cursors) {
     }
   }
   // printf("cursors: %i\n", cursors.size);
+  --_undo_group;
+  _undo_last_snapshot_valid = false;
+  raw_end();
+  --undo_disabled;
+  return true;
+}
+
+// does the change of an insert or delete action again, without adding it to the history
+void BufferData::redo_action(Array<Cursor> &cursors, const UndoAction &a) {
+  ++undo_disabled;
+  switch (a.type) {
+    case ACTIONTYPE_INSERT:
+      // printf("Inserting '%s' at {%i %i}\n", a.insert.s.slice.chars, a.insert.a.x, a.insert.a.y);
+      insert(cursors, a.insert.a, a.insert.s, -1, false);
+      break;
+    case ACTIONTYPE_INSERT_BATCH: {
+      Array<BatchInsert> inserts = {a.insert_batch.inserts, a.insert_batch.num_inserts, a.insert_batch.num_inserts};
+      insert_batch(cursors, inserts, false);
+      break;
+    }
+    case ACTIONTYPE_DELETE:
+      // printf("Removing {%i %i}, {%i %i}\n", a.remove.a.x, a.remove.a.y, a.remove.b.x, a.remove.b.y);
+      remove_range(cursors, a.remove.a, a.remove.b, -1, false);
+      break;
+    case ACTIONTYPE_CURSOR_SNAPSHOT:
+    case ACTIONTYPE_GROUP_BEGIN:
+    case ACTIONTYPE_GROUP_END:
+      break;
+  }
   --undo_disabled;
+}
+
+void BufferData::redo(Array<Cursor> &cursors) {
+  util_free(blame);
+
+  if (undo_disabled)
+    return;
+  if (!redo_group(cursors))
+    return;
   parse();
+  journal_record(*this, JOURNAL_REDO);
+}
+
+// redoes the group at _next_undo_action, without parsing. Returns false if there was nothing to redo
+bool BufferData::redo_group(Array<Cursor> &cursors) {
+  if (_next_undo_action == _undo_actions.size)
+    return false;
 
+  ++undo_disabled;
+  raw_begin();
+  assert(_undo_actions[_next_undo_action].type == ACTIONTYPE_GROUP_BEGIN);
+  ++_next_undo_action;
+  for (; _undo_actions[_next_undo_action].type != ACTIONTYPE_GROUP_END; ++_next_undo_action) {
+    UndoAction &a = _undo_actions[_next_undo_action];
+    // printf("redo action: %i\n", a.type);
+    if (a.type == ACTIONTYPE_CURSOR_SNAPSHOT)
+      undo_get_snapshot(_next_undo_action, &cursors);
+    else
+      redo_action(cursors, a);
+  }
+  ++_next_undo_action;
+  ++_undo_group;
+  _undo_last_snapshot_valid = false;
   raw_end();
+  --undo_disabled;
+  return true;
 }
 
-void BufferData::redo(Array<Cursor> &cursors) {
+// the newest state of the current history
+int BufferData::undo_last_group() {
+  int n = _undo_group;
+  for (int i = _next_undo_action; i < _undo_actions.size; ++i)
+    if (_undo_actions[i].type == ACTIONTYPE_GROUP_END)
+      ++n;
+  return n;
+}
+
+// Returns where a state of the current history starts in _undo_actions, decompressing blocks if it has to.
+// -1 if it has been forgotten
+int BufferData::undo_find_group(int group) {
+  int i = _next_undo_action;
+  for (int g = _undo_group; g < group; ++g) {
+    if (i == _undo_actions.size)
+      return -1;
+    while (_undo_actions[i++].type != ACTIONTYPE_GROUP_END) {}
+  }
+  for (int g = _undo_group; g > group; --g) {
+    if (!i) {
+      const int n = _undo_actions.size;
+      undo_decompress();
+      i += _undo_actions.size - n;
+      if (!i)
+        return -1;
+    }
+    --i;
+    while (_undo_actions[--i].type != ACTIONTYPE_GROUP_BEGIN) {}
+  }
+  return i;
+}
+
+// how many groups a checkpoint has to save us, for it to be worth replacing the whole text
+#define UNDO_CHECKPOINT_MIN_SKIP 16
+
+// Moves along the current history to a state, without parsing
+void BufferData::undo_move(Array<Cursor> &cursors, int group) {
+  // start from the closest checkpoint, if it's a lot closer than we are
+  const UndoCheckpoint *closest = 0;
+  int dist = abs(group - _undo_group) - UNDO_CHECKPOINT_MIN_SKIP;
+  for (const UndoCheckpoint &c : _undo_checkpoints) {
+    if (abs(group - c.group) < dist) {
+      closest = &c;
+      dist = abs(group - c.group);
+    }
+  }
+  if (closest) {
+    int i = undo_find_group(closest->group);
+    if (i != -1) {
+      undo_restore_checkpoint(*closest);
+      _next_undo_action = i;
+      _undo_group = closest->group;
+      _undo_last_snapshot_valid = false;
+    }
+  }
+
+  while (_undo_group > group && undo_group(cursors)) {}
+  while (_undo_group < group && redo_group(cursors)) {}
+}
+
+// where state s is, after branch i has been swapped with the redos of state fork
+static void undo_relabel(UndoState &s, int i, int fork, bool removed) {
+  if (s.branch == i)
+    s.branch = -1;
+  else if (s.branch == -1 && s.group > fork)
+    s.branch = i;
+  else if (removed && s.branch > i)
+    --s.branch;
+}
+
+// Goes to any state in the undo tree. The states in keep are updated, so that they still point to the same states
+void BufferData::undo_goto(Array<Cursor> &cursors, UndoState s, Array<UndoState> *keep) {
   util_free(blame);
+  if (undo_disabled || _action_group_depth)
+    return;
+
+  const UndoState target = s;
+  Array<UndoState> states = {};
+  if (keep)
+    states.push(keep->items, keep->size);
+  states += s;
+
+  // make its branch the current history, by swapping in every branch on the way to it
+  while (states.last().branch != -1) {
+    int i = states.last().branch;
+    while (_undo_branches[i].parent != -1)
+      i = _undo_branches[i].parent;
+    undo_move(cursors, _undo_branches[i].fork);
+    if (_undo_group != _undo_branches[i].fork)
+      break;
+    undo_swap_branch(i, &states);
+  }
+
+  s = states.last();
+  if (s.branch == -1)
+    undo_move(cursors, clamp(s.group, _undo_first_group, undo_last_group()));
+  if (keep)
+    memcpy(keep->items, states.items, keep->size * sizeof(*keep->items));
+  states.free_shallow();
+
+  // the cursors are where they were after the last group
+  if (_next_undo_action >= 2)
+    undo_get_snapshot(_next_undo_action-2, &cursors);
+  parse();
+  journal_goto(*this, target);
+}
+
+// takes the redos out of _undo_actions, and puts them in a branch off the current state
+void BufferData::undo_compress_redos(UndoBranch *branch) {
+  *branch = {};
+  branch->fork = _undo_group;
+  branch->parent = -1;
+  branch->save = UNDO_NO_SAVE;
+  if (_last_save_undo_action != UNDO_NO_SAVE && _last_save_undo_action > _next_undo_action) {
+    branch->save = _last_save_undo_action - _next_undo_action;
+    _last_save_undo_action = UNDO_NO_SAVE;
+  }
+  // not worth keeping track of in the branches, the buffer will just look modified there
+  if (_saving_undo_action > _next_undo_action)
+    _saving_undo_action = UNDO_NO_SAVE;
+  undo_make_keyframe(_next_undo_action);
+  undo_compress(_next_undo_action, _undo_actions.size - _next_undo_action, &branch->block);
+  _undo_branch_bytes += sizeof(*branch) + branch->block.data.cap;
+  undo_drop_checkpoints(_undo_group+1, INT_MAX);
+}
+
+// called when something changes after an undo
+void BufferData::undo_branch_redos() {
+  UndoBranch branch;
+  undo_compress_redos(&branch);
+
+  // the branches off the redos go with them
+  for (UndoBranch &b : _undo_branches)
+    if (b.parent == -1 && b.fork > _undo_group)
+      b.parent = _undo_branches.size;
+  _undo_branches += branch;
+}
+
+// Swaps branch i, which must branch off the current state, with the redos. The states in keep are updated to still point to the same states
+void BufferData::undo_swap_branch(int i, Array<UndoState> *keep) {
+  UndoBranch branch = _undo_branches[i];
+  const int fork = branch.fork;
+  assert(branch.parent == -1 && fork == _undo_group);
+
+  const bool removed = _next_undo_action == _undo_actions.size;
+  UndoBranch redos = {};
+  if (!removed)
+    undo_compress_redos(&redos);
+
+  const int n = branch.block.num_actions;
+  _undo_actions.resize(_next_undo_action + n);
+  undo_decompress_actions(_undo_arena, branch.block.data, _undo_actions.items + _next_undo_action, n);
+  for (int j = _next_undo_action; j < _undo_actions.size; ++j)
+    _undo_bytes += undo_action_size(_undo_actions[j]);
+  if (branch.save != UNDO_NO_SAVE)
+    _last_save_undo_action = _next_undo_action + branch.save;
+  _undo_branch_bytes -= sizeof(branch) + branch.block.data.cap;
+  util_free(branch);
+
+  for (UndoBranch &b : _undo_branches) {
+    UndoState parent = {b.parent, b.fork};
+    undo_relabel(parent, i, fork, removed);
+    b.parent = parent.branch;
+  }
+  for (UndoState &s : *keep)
+    undo_relabel(s, i, fork, removed);
+  if (removed)
+    _undo_branches.remove_slow(i);
+  else
+    _undo_branches[i] = redos;
+}
+
+// forgets branch i (unless it's -1), and the branches off states before group, and every branch off those
+void BufferData::undo_drop_branches(int i, int group) {
+  Array<int> index = {};
+  index.resize(_undo_branches.size);
+  for (int j = 0; j < index.size; ++j)
+    index[j] = j == i || _undo_branches[j].fork < group ? -1 : 0;
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int j = 0; j < index.size; ++j) {
+      if (index[j] != -1 && _undo_branches[j].parent != -1 && index[_undo_branches[j].parent] == -1) {
+        index[j] = -1;
+        changed = true;
+      }
+    }
+  }
+
+  int n = 0;
+  for (int j = 0; j < index.size; ++j) {
+    if (index[j] == -1) {
+      _undo_branch_bytes -= sizeof(_undo_branches[j]) + _undo_branches[j].block.data.cap;
+      util_free(_undo_branches[j]);
+    }
+    else {
+      index[j] = n;
+      _undo_branches[n++] = _undo_branches[j];
+    }
+  }
+  _undo_branches.size = n;
+  for (UndoBranch &b : _undo_branches)
+    if (b.parent != -1)
+      b.parent = index[b.parent];
+  util_free(index);
+}
+
+// how many bytes have to change before we take a checkpoint, at the least. Otherwise it's when as much as the whole text has changed
+#define UNDO_CHECKPOINT_MIN_DEBT (64*1024)
+
+// copies the whole text, if enough has changed since the last time
+void BufferData::undo_checkpoint() {
+  if (_undo_checkpoint_debt < UNDO_CHECKPOINT_MIN_DEBT)
+    return;
+  long size = 0;
+  for (StringBuffer &line : lines)
+    size += line.length + 1;
+  if (_undo_checkpoint_debt < size || size > G.undo_budget)
+    return;
+  _undo_checkpoint_debt = 0;
+
+  int pos = 0;
+  while (pos < _undo_checkpoints.size && _undo_checkpoints[pos].group < _undo_group)
+    ++pos;
+  if (pos < _undo_checkpoints.size && _undo_checkpoints[pos].group == _undo_group)
+    return;
+
+  // make room, by thinning out the ones that are closest together. With only two left, the oldest goes
+  while (_undo_checkpoint_bytes + size > G.undo_budget) {
+    int k = 0, gap = INT_MAX;
+    for (int i = 1; i+1 < _undo_checkpoints.size; ++i) {
+      if (_undo_checkpoints[i+1].group - _undo_checkpoints[i-1].group < gap) {
+        gap = _undo_checkpoints[i+1].group - _undo_checkpoints[i-1].group;
+        k = i;
+      }
+    }
+    _undo_checkpoint_bytes -= _undo_checkpoints[k].text.length;
+    util_free(_undo_checkpoints[k]);
+    _undo_checkpoints.remove_slow(k);
+    if (k < pos)
+      --pos;
+  }
+
+  StringBuffer text = StringBuffer::create((int)size);
+  for (int i = 0; i < lines.size; ++i) {
+    if (i)
+      text += '\n';
+    text += lines[i].slice;
+  }
+  _undo_checkpoints.insert(pos, UndoCheckpoint{_undo_group, text.string});
+  _undo_checkpoint_bytes += text.length;
+}
+
+// forgets the checkpoints of the states [from, to)
+void BufferData::undo_drop_checkpoints(int from, int to) {
+  int n = 0;
+  for (UndoCheckpoint &c : _undo_checkpoints) {
+    if (c.group >= from && c.group < to) {
+      _undo_checkpoint_bytes -= c.text.length;
+      util_free(c);
+    }
+    else
+      _undo_checkpoints[n++] = c;
+  }
+  _undo_checkpoints.size = n;
+}
+
+// describes the group that starts at a, for the history browser
+static void undo_describe_group(StringBuffer &out, const UndoAction *a) {
+  const UndoAction *first = 0;
+  int changes = 0;
+  for (; a->type != ACTIONTYPE_GROUP_END; ++a) {
+    if (a->type == ACTIONTYPE_INSERT || a->type == ACTIONTYPE_DELETE || a->type == ACTIONTYPE_INSERT_BATCH) {
+      if (!first)
+        first = a;
+      ++changes;
+    }
+  }
+  if (!first) {
+    out += "move cursors";
+    return;
+  }
+
+  Slice s;
+  Pos p;
+  if (first->type == ACTIONTYPE_INSERT_BATCH) {
+    s = first->insert_batch.inserts[0].s;
+    p = first->insert_batch.inserts[0].a;
+    out.appendf("insert x%i", first->insert_batch.num_inserts);
+  }
+  else {
+    s = first->insert.s;
+    p = first->insert.a;
+    out += first->type == ACTIONTYPE_INSERT ? "insert" : "delete";
+  }
 
-  if (undo_disabled)
-    return;
+  out += " \"";
+  for (int i = 0; i < s.length && i < 24; ++i) {
+    if (s[i] == '\n')
+      out += "\\n";
+    else if (s[i] == '\t')
+      out += "\\t";
+    else
+      out += s[i];
+  }
+  if (s.length > 24)
+    out += "...";
+  out.appendf("\" at %i:%i", p.y+1, p.x+1);
+  if (changes > 1)
+    out.appendf(" and %i more", changes-1);
+}
+
+// lists the states after each whole group in actions, newest first. s is the state before the first group
+static void undo_list_groups(const UndoAction *actions, int n, UndoState s, UndoState current, Array<UndoState> *states, Array<String> *labels) {
+  const int first = states->size;
+  for (int i = 0; i < n; ++i) {
+    if (actions[i].type != ACTIONTYPE_GROUP_BEGIN)
+      continue;
+    const int begin = i;
+    while (i < n && actions[i].type != ACTIONTYPE_GROUP_END)
+      ++i;
+    if (i == n)
+      break;
 
-  if (_next_undo_action == _undo_actions.size)
-    return;
+    ++s.group;
+    StringBuffer label = {};
+    label.appendf("%s%i%s ", s.branch == current.branch && s.group == current.group ? "* " : "  ", s.group, s.branch == -1 ? " " : "'");
+    undo_describe_group(label, actions + begin);
+    *states += s;
+    *labels += label.string;
+  }
 
-  ++undo_disabled;
-  raw_begin();
-  assert(_undo_actions[_next_undo_action].type == ACTIONTYPE_GROUP_BEGIN);
-  ++_next_undo_action;
-  for (; _undo_actions[_next_undo_action].type != ACTIONTYPE_GROUP_END; ++_next_undo_action) {
-    UndoAction a = _undo_actions[_next_undo_action];
-    // printf("redo action: %i\n", a.type);
-    switch (a.type) {
-      case ACTIONTYPE_INSERT:
-        // printf("Inserting '%s' at {%i %i}\n", a.insert.s.slice.chars, a.insert.a.x, a.insert.a.y);
-        insert(cursors, a.insert.a, a.insert.s.slice, -1, false);
-        break;
-      case ACTIONTYPE_DELETE:
-        // printf("Removing {%i %i}, {%i %i}\n", a.remove.a.x, a.remove.a.y, a.remove.b.x, a.remove.b.y);
-        remove_range(cursors, a.remove.a, a.remove.b, -1, false);
-        break;
-      case ACTIONTYPE_CURSOR_SNAPSHOT:
-        util_free(cursors);
-        cursors = a.cursors.copy_shallow();
-        break;
-      case ACTIONTYPE_GROUP_BEGIN:
-      case ACTIONTYPE_GROUP_END:
-        break;
-    }
+  for (int i = first, j = states->size-1; i < j; ++i, --j) {
+    swap((*states)[i], (*states)[j]);
+    swap((*labels)[i], (*labels)[j]);
   }
-  ++_next_undo_action;
-  parse();
-  --undo_disabled;
-  raw_end();
+}
+
+// Lists every state in the undo tree, with a description of the group that leads to it. The current history comes first,
+// and then the branches, newest first. Branches are marked with a '
+void BufferData::undo_list_states(Array<UndoState> *states, Array<String> *labels) {
+  BumpAllocator arena = {};
+  Array<UndoAction> actions = {};
+  const UndoState current = undo_state();
+
+  // the blocks go from oldest to newest, so list them backwards
+  int group = _undo_first_group;
+  for (UndoBlock &block : _undo_blocks)
+    group += block.num_groups;
+  undo_list_groups(_undo_actions.items, _undo_actions.size, {-1, group}, current, states, labels);
+  for (int i = _undo_blocks.size-1; i >= 0; --i) {
+    group -= _undo_blocks[i].num_groups;
+    actions.resize(_undo_blocks[i].num_actions);
+    undo_decompress_actions(arena, _undo_blocks[i].data, actions.items, actions.size);
+    undo_list_groups(actions.items, actions.size, {-1, group}, current, states, labels);
+  }
+  *states += UndoState{-1, _undo_first_group};
+  *labels += String::createf("%s%i  (oldest)", current.group == _undo_first_group ? "* " : "  ", _undo_first_group);
+
+  for (int i = 0; i < _undo_branches.size; ++i) {
+    UndoBranch &b = _undo_branches[i];
+    actions.resize(b.block.num_actions);
+    undo_decompress_actions(arena, b.block.data, actions.items, actions.size);
+    undo_list_groups(actions.items, actions.size, {i, b.fork}, current, states, labels);
+  }
+
+  actions.free_shallow();
+  util_free(arena);
 }
 
 void BufferData::print_undo_actions() {
@@ -1349,6 +2694,9 @@ void BufferData::print_undo_actions() {
       case ACTIONTYPE_INSERT:
         log_info("   INSERT\n");
         break;
+      case ACTIONTYPE_INSERT_BATCH:
+        log_info("   INSERT BATCH\n");
+        break;
       case ACTIONTYPE_DELETE:
         log_info("   DELETE\n");
         break;
@@ -1422,6 +2770,26 @@ void BufferView::update() {
     move(i, 0, 0);
 }
 
+// Does s, which contains endlines, match the end of line y and the lines after?
+bool BufferData::_matches_lines(int y, Slice s) {
+  int i;
+  if (!s.find('\n', &i))
+    return false;
+  const StringBuffer &first = lines[y];
+  if (first.length < i || memcmp(first.chars + first.length - i, s.chars, i))
+    return false;
+
+  while (1) {
+    s = s(i+1, -1);
+    if (!map_lines(++y))
+      return false;
+    if (!s.find('\n', &i))
+      return lines[y].begins_with(0, s);
+    if (!(lines[y].slice == s(0, i)))
+      return false;
+  }
+}
+
 bool BufferData::find_r(Slice s, int stay, Pos *p) {
   if (!s.length)
     return false;
@@ -1430,10 +2798,22 @@ bool BufferData::find_r(Slice s, int stay, Pos *p) {
   int y = p->y;
   if (!stay)
     --x;
-  y = p->y;
 
-  // first line
-  if (lines[y](0,x+1).find_r(s, &x)) {
+  // the match has to start where the part before the first endline ends a line
+  int first;
+  if (s.find('\n', &first)) {
+    for (; y >= 0; --y, x = INT_MAX) {
+      const int start = lines[y].length - first;
+      if (start >= 0 && start <= x && _matches_lines(y, s)) {
+        *p = {start, y};
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // first line, matches that start at or before x
+  if (x >= 0 && lines[y](0, at_most(x + s.length, lines[y].length)).find_r(s, &x)) {
     p->x = x;
     p->y = y;
     return true;
@@ -1509,7 +2889,27 @@ static bool search_pattern_matches(TokenInfo search, TokenInfo test) {
     return search.token == test.token && search.str == test.str;
 }
 
+// Mapped buffers are only tokenized on screen, so token searches are done as text searches there
+static String search_tokens_to_text(Array<TokenInfo> tokens) {
+  StringBuffer s = {};
+  for (int i = 0; i < tokens.size; ++i) {
+    if (i && tokens[i].a != tokens[i-1].b)
+      s += ' ';
+    s += tokens[i].str;
+  }
+  return s.string;
+}
+
 bool BufferData::find_r(Array<TokenInfo> tokens, bool stay, Pos *p, Range *result) {
+  if (is_mapped()) {
+    String text = search_tokens_to_text(tokens);
+    bool found = find_r(text.slice, stay, p);
+    if (found && result)
+      *result = Range{*p, {p->x + text.length, p->y}};
+    util_free(text);
+    return found;
+  }
+
   // TODO: implement stay
   TokenInfo *a = gettoken(*p);
   if (!stay)
@@ -1547,7 +2947,7 @@ bool BufferData::find(char s, bool stay, Pos *p) {
   }
 
   // following lines
-  for (++y; y < lines.size; ++y) {
+  for (++y; map_lines(y); ++y) {
     if (lines[y].find(0, s, &x)) {
       p->x = x;
       p->y = y;
@@ -1558,6 +2958,15 @@ bool BufferData::find(char s, bool stay, Pos *p) {
 }
 
 bool BufferData::find(Array<TokenInfo> tokens, bool stay, Pos *p, Range *result) {
+  if (is_mapped()) {
+    String text = search_tokens_to_text(tokens);
+    bool found = find(text.slice, stay, p);
+    if (found && result)
+      *result = Range{*p, {p->x + text.length, p->y}};
+    util_free(text);
+    return found;
+  }
+
   TokenInfo *a = gettoken(*p);
   if (!stay)
     ++a;
@@ -1586,6 +2995,19 @@ bool BufferData::find(Slice s, bool stay, Pos *p) {
     ++x;
   y = p->y;
 
+  // the match has to start where the part before the first endline ends a line
+  int first;
+  if (s.find('\n', &first)) {
+    for (; map_lines(y); ++y, x = 0) {
+      const int start = lines[y].length - first;
+      if (start >= x && _matches_lines(y, s)) {
+        *p = {start, y};
+        return true;
+      }
+    }
+    return false;
+  }
+
   // first line
   if (x < lines[y].length) {
     if (lines[y].find(x, s, &x)) {
@@ -1596,7 +3018,7 @@ bool BufferData::find(Slice s, bool stay, Pos *p) {
   }
 
   // following lines
-  for (++y; y < lines.size; ++y) {
+  for (++y; map_lines(y); ++y) {
     if (lines[y].find(0, s, &x)) {
       p->x = x;
       p->y = y;
@@ -1606,6 +3028,221 @@ bool BufferData::find(Slice s, bool stay, Pos *p) {
   return false;
 }
 
+View<TokenInfo> BufferData::line_tokens(int y) {
+  int a = 0, b = parser.tokens.size;
+  while (a < b) {
+    int mid = (a+b)/2;
+    if (parser.tokens[mid].a.y < y)
+      a = mid+1;
+    else
+      b = mid;
+  }
+  for (b = a; b < parser.tokens.size && parser.tokens[b].a.y == y; ++b);
+  return view(parser.tokens.items + a, b - a);
+}
+
+bool BufferData::find(Regex *r, bool stay, Pos *p, Range *result) {
+  int x = p->x;
+  if (!stay)
+    ++x;
+
+  for (int y = p->y; map_lines(y); ++y, x = 0) {
+    int a, b;
+    if (regex_find(r, lines[y].slice, x, r->has_tokens ? line_tokens(y) : View<TokenInfo>{}, &a, &b)) {
+      *p = {a, y};
+      if (result)
+        *result = Range{{a, y}, {b, y}};
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BufferData::find_r(Regex *r, bool stay, Pos *p, Range *result) {
+  int x = p->x;
+  if (!stay)
+    --x;
+
+  for (int y = p->y; y >= 0; --y, x = INT_MAX) {
+    View<TokenInfo> tokens = r->has_tokens ? line_tokens(y) : View<TokenInfo>{};
+    int a, b, last = -1, last_end = 0;
+    // the last match that starts at or before x
+    for (int from = 0; from <= x && regex_find(r, lines[y].slice, from, tokens, &a, &b) && a <= x; from = a+1)
+      last = a, last_end = b;
+    if (last >= 0) {
+      *p = {last, y};
+      if (result)
+        *result = Range{{last, y}, {last_end, y}};
+      return true;
+    }
+  }
+  return false;
+}
+
+Array<Range>& BufferData::search_matches() {
+  SearchMatches &s = _search;
+  if (s.generation != G.search_generation) {
+    s.generation = G.search_generation;
+    s.ranges.size = 0;
+    s.dirty_y0 = 0;
+    s.dirty_y1 = lines.size;
+  }
+  if (s.dirty_y0 >= s.dirty_y1)
+    return s.ranges;
+
+  // a match that starts above the dirty lines but reaches into them has to be found again too
+  int y0 = s.dirty_y0, y1 = at_most(s.dirty_y1, lines.size);
+  int i0 = search_match_lower_bound({0, y0});
+  while (i0 > 0 && s.ranges[i0-1].b.y >= y0) {
+    y0 = s.ranges[i0-1].a.y;
+    i0 = search_match_lower_bound({0, y0});
+  }
+  int i1 = search_match_lower_bound({0, y1});
+
+  Array<Range> found = {};
+  for (int y = y0; y < y1; ++y)
+    _search_line(y, &found);
+  s.ranges.replace(i0, i1 - i0, found.items, found.size);
+  found.free_shallow();
+  s.dirty_y0 = s.dirty_y1 = 0;
+  return s.ranges;
+}
+
+int BufferData::search_match_lower_bound(Pos p) {
+  int a = 0, b = _search.ranges.size;
+  while (a < b) {
+    int mid = (a+b)/2;
+    if (_search.ranges[mid].a < p)
+      a = mid+1;
+    else
+      b = mid;
+  }
+  return a;
+}
+
+static int search_range_cmp(const void *a, const void *b) {
+  Range x = *(Range*)a, y = *(Range*)b;
+  return x.a < y.a ? -1 : y.a < x.a ? 1 : 0;
+}
+
+// the matches that start on line y. Like n and N, that's the token matches and the plain text matches, or the regex matches
+void BufferData::_search_line(int y, Array<Range> *result) {
+  if (G.search_regex.prog.size) {
+    View<TokenInfo> tokens = G.search_regex.has_tokens ? line_tokens(y) : View<TokenInfo>{};
+    int a, b;
+    for (int x = 0; regex_find(&G.search_regex, lines[y].slice, x, tokens, &a, &b); x = b > a ? b : a+1)
+      *result += Range{{a, y}, {b, y}};
+    return;
+  }
+  if (!G.search_term.size)
+    return;
+
+  const int n = result->size;
+  const int num_tokens = G.search_term.size;
+  View<TokenInfo> tokens = line_tokens(y);
+  for (int i = 0; i < tokens.size; ++i) {
+    const TokenInfo *t = &tokens[i];
+    if (t + num_tokens >= parser.tokens.end())
+      break;
+    for (int j = 0; j < num_tokens; ++j)
+      if (!search_pattern_matches(G.search_term[j], t[j]))
+        goto next;
+    *result += Range{t[0].a, t[num_tokens-1].b};
+    next:;
+  }
+
+  const int num_token_matches = result->size;
+  Slice text = G.search_buffer.lines[0].slice;
+  for (int x = 0; lines[y].find(x, text, &x); x += text.length) {
+    for (int i = n; i < num_token_matches; ++i)
+      if ((*result)[i].a.x == x)
+        goto skip;
+    *result += Range{{x, y}, {x + text.length, y}};
+    skip:;
+  }
+  if (num_token_matches > n && result->size > num_token_matches)
+    qsort(result->items + n, result->size - n, sizeof(Range), search_range_cmp);
+}
+
+void BufferData::_search_changed(int y0, int old_y1, int new_y1) {
+  SearchMatches &s = _search;
+  if (!s.generation)
+    return;
+  const int dy = new_y1 - old_y1;
+
+  // drop the matches on the old lines, and the ones that reach into them
+  int i0 = search_match_lower_bound({0, y0});
+  while (i0 > 0 && s.ranges[i0-1].b.y >= y0) {
+    y0 = s.ranges[i0-1].a.y;
+    i0 = search_match_lower_bound({0, y0});
+  }
+  int i1 = search_match_lower_bound({0, old_y1+1});
+  s.ranges.remove_slow(i0, i1 - i0);
+  if (dy)
+    for (int i = i0; i < s.ranges.size; ++i)
+      s.ranges[i].a.y += dy, s.ranges[i].b.y += dy;
+
+  if (s.dirty_y0 < s.dirty_y1) {
+    if (s.dirty_y0 > old_y1)
+      s.dirty_y0 += dy;
+    if (s.dirty_y1 > old_y1)
+      s.dirty_y1 += dy;
+  }
+  _search_dirty(y0, new_y1+1);
+}
+
+void BufferData::_search_dirty(int y0, int y1) {
+  SearchMatches &s = _search;
+  if (!s.generation || y0 >= y1)
+    return;
+  if (s.dirty_y0 >= s.dirty_y1)
+    s.dirty_y0 = y0, s.dirty_y1 = y1;
+  else
+    s.dirty_y0 = at_most(s.dirty_y0, y0), s.dirty_y1 = at_least(s.dirty_y1, y1);
+}
+
+int BufferView::goto_search_match(bool backwards) {
+  Array<Range> &matches = data->search_matches();
+  int result = -1;
+  for (int i = 0; i < cursors.size; ++i) {
+    int m = data->search_match_lower_bound(cursors[i].pos);
+    if (backwards)
+      --m;
+    else if (m < matches.size && matches[m].a == cursors[i].pos)
+      ++m;
+    if (m < 0 || m >= matches.size)
+      continue;
+    move_to(i, matches[m].a);
+    if (i == 0)
+      result = m;
+  }
+  return result;
+}
+
+bool BufferView::find_and_move_r(Regex *r, bool stay) {
+  bool success = false;
+  for (int i = 0; i < cursors.size; ++i) {
+    Pos p = cursors[i].pos;
+    if (!data->find_r(r, stay, &p, 0))
+      continue;
+    success = true;
+    move_to(i, p);
+  }
+  return success;
+}
+
+bool BufferView::find_and_move(Regex *r, bool stay) {
+  bool success = false;
+  for (int i = 0; i < cursors.size; ++i) {
+    Pos p = cursors[i].pos;
+    if (!data->find(r, stay, &p, 0))
+      continue;
+    success = true;
+    move_to(i, p);
+  }
+  return success;
+}
+
 bool BufferView::find_and_move_r(char c, bool stay) {
   bool success = false;
   for (int i = 0; i < cursors.size; ++i) {
@@ -1708,71 +3345,416 @@ void BufferData::delete_line(Array<Cursor> &cursors) {
   action_end(cursors);
 }
 
-static bool lines_from_file(Slice filename, Array<StringBuffer> *result, const char **endline_string_result) {
+static void lines_from_contents(Slice contents, Array<StringBuffer> *result, const char **endline_string_result) {
   Array<StringBuffer> lines = {};
-  int num_lines;
+  Array<int> endlines = {};
+  const char *chars = contents.chars;
+  int x;
 
-  FILE* f = 0;
-  if (File::open(&f, filename.chars, "rb"))
-    goto err;
+  // find all endlines in one pass
+  endlines.reserve(contents.length / 32);
+  memchr_all(chars, contents.length, '\n', &endlines);
+  endlines += contents.length;
 
-  // get line count
-  num_lines = 0;
-  for (char c; (c = (char)fgetc(f)), !feof(f);)
-    num_lines += c == '\n';
-  if (ferror(f))
-    goto err;
-  fseek(f, 0, SEEK_SET);
-
-  // read content
-  if (num_lines > 0) {
-    lines.resize(num_lines+1);
-    lines.zero();
-
-    char c = 0;
-    for (int i = 0; i <= num_lines; ++i) {
-      while (1) {
-        c = (char)fgetc(f);
-        if (feof(f)) {
-          if (ferror(f))
-            goto err;
-          goto last_line;
-        }
-        if (c == '\r') {
-          c = (char)fgetc(f);
-          if (endline_string_result)
-            *endline_string_result = ENDLINE_WINDOWS;
-        }
-        if (c == '\n')
-          break;
-        lines[i] += c;
-      }
+  // now that we know the size of each line, create them
+  lines.resize(endlines.size);
+  lines.zero();
+  x = 0;
+  for (int i = 0; i < endlines.size; ++i) {
+    int end = endlines[i];
+    if (end > x && end < contents.length && chars[end-1] == '\r') {
+      --end;
+      if (endline_string_result)
+        *endline_string_result = ENDLINE_WINDOWS;
     }
-    last_line:;
-    assert(feof(f));
-  } else {
-    lines += {};
+    if (end > x) {
+      lines[i] = StringBuffer::create(end - x);
+      lines[i] += Slice{(char*)chars + x, end - x};
+    }
+    x = endlines[i] + 1;
   }
 
   *result = lines;
-  fclose(f);
+  util_free(endlines);
+}
+
+static bool lines_from_file(Slice filename, Array<StringBuffer> *result, const char **endline_string_result) {
+  Array<u8> contents = {};
+
+  // read the whole file in one go
+  if (!File::get_contents(filename.chars, &contents))
+    return false;
+
+  lines_from_contents(Slice::create((char*)contents.items, contents.size), result, endline_string_result);
+  contents.free_shallow();
   return true;
+}
 
-  err:
-  util_free(lines);
-  if (f)
-    fclose(f);
-  return false;
+// Joins the lines into one string, the way they are written to the file
+static void lines_to_contents(const Array<StringBuffer> &lines, const char *endline_string, String *result) {
+  const int endline_len = strlen(endline_string);
+  int size = 0;
+  for (const StringBuffer &line : lines)
+    size += line.length + endline_len;
+
+  StringBuffer s = StringBuffer::create(size);
+  for (int i = 0; i < lines.size; ++i) {
+    s += lines[i].slice;
+    if (i < lines.size-1)
+      s += Slice{endline_string, endline_len};
+  }
+  *result = s.string;
+}
+
+// Writes the contents to a temporary file next to the target, and renames it over the target once it's all on the disk,
+// so a failed save never leaves a half-written file behind. On failure, errno says why
+static bool contents_to_file(Slice filename, Slice contents) {
+  StringBuffer target = {}, tmp = {};
+  FILE *f = 0;
+  bool success = false;
+  int err = 0;
+
+  // write through symlinks instead of replacing them
+  if (!File::real_path(filename.chars, &target))
+    target = StringBuffer::create(filename);
+  {
+    Slice name = Path::name(target.slice);
+    tmp = StringBuffer::create(target.length + 16);
+    tmp += Slice{target.chars, target.length - name.length};
+    tmp += '.';
+    tmp += name;
+    tmp += ".cmantic-save";
+  }
+
+  if (File::open(&f, tmp.chars, "wb") || !File::copy_permissions(target.chars, f))
+    goto done;
+  if (contents.length && File::write(f, contents.chars, contents.length))
+    goto done;
+  if (!File::sync(f))
+    goto done;
+  fclose(f);
+  f = 0;
+  success = File::rename(tmp.chars, target.chars);
+
+  done:
+  if (!success) {
+    err = errno;
+    if (f)
+      fclose(f);
+    File::remove(tmp.chars);
+    errno = err;
+  }
+  util_free(target);
+  util_free(tmp);
+  return success;
+}
+
+#define LINE_BLOCK_LINES 512
+
+void BufferData::_line_tree_build() {
+  const int n = _line_blocks.size;
+  _line_tree.resize(n+1);
+  _line_tree[0] = {};
+  for (int i = 1; i <= n; ++i)
+    _line_tree[i] = _line_blocks[i-1];
+  // push each node into its parent, which builds the tree in linear time
+  for (int i = 1; i <= n; ++i) {
+    int j = i + (i & -i);
+    if (j <= n) {
+      _line_tree[j].bytes += _line_tree[i].bytes;
+      _line_tree[j].num_lines += _line_tree[i].num_lines;
+    }
+  }
+}
+
+void BufferData::_line_tree_add(int block, int num_lines, i64 bytes) {
+  _line_blocks[block].num_lines += num_lines;
+  _line_blocks[block].bytes += bytes;
+  for (int i = block+1; i < _line_tree.size; i += i & -i) {
+    _line_tree[i].num_lines += num_lines;
+    _line_tree[i].bytes += bytes;
+  }
+}
+
+void BufferData::_line_index_clear() {
+  _line_blocks.size = 0;
+  _line_tree.size = 0;
+  _line_index_lines = 0;
+  _line_index_unbalanced = false;
+}
+
+void BufferData::_line_index_build() {
+  _line_blocks.size = 0;
+  for (int y = 0; y < lines.size;) {
+    LineBlock b = {};
+    for (; y < lines.size && b.num_lines < LINE_BLOCK_LINES; ++y, ++b.num_lines)
+      b.bytes += lines[y].length + 1;
+    _line_blocks += b;
+  }
+  _line_index_lines = lines.size;
+  _line_index_unbalanced = false;
+  _line_tree_build();
+}
+
+// drops the empty blocks, merges the small ones into their neighbours, and splits the big ones
+void BufferData::_line_index_balance() {
+  Array<LineBlock> blocks = {};
+  blocks.reserve(_line_blocks.size);
+  int y = 0;
+  for (LineBlock b : _line_blocks) {
+    if (!b.num_lines)
+      continue;
+    if (blocks.size && (b.num_lines < LINE_BLOCK_LINES/4 || blocks.last().num_lines < LINE_BLOCK_LINES/4) && blocks.last().num_lines + b.num_lines <= 2*LINE_BLOCK_LINES) {
+      blocks.last().num_lines += b.num_lines;
+      blocks.last().bytes += b.bytes;
+    }
+    else if (b.num_lines > 2*LINE_BLOCK_LINES) {
+      for (int i = 0; i < b.num_lines;) {
+        LineBlock part = {};
+        for (; i < b.num_lines && part.num_lines < LINE_BLOCK_LINES; ++i, ++part.num_lines)
+          part.bytes += lines[y+i].length + 1;
+        blocks += part;
+      }
+    }
+    else
+      blocks += b;
+    y += b.num_lines;
+  }
+  _line_blocks.free_shallow();
+  _line_blocks = blocks;
+  _line_index_unbalanced = false;
+  _line_tree_build();
+}
+
+// brings the index up to date before a query
+void BufferData::_line_index_update() {
+  if (!_line_blocks.size || _line_index_lines != lines.size)
+    _line_index_build();
+  else if (_line_index_unbalanced)
+    _line_index_balance();
+}
+
+// The block that line y is in, and the first line and byte of it. Lines past the end are in the last block
+int BufferData::_line_index_block(int y, int *first_line, i64 *first_byte) {
+  const int n = _line_blocks.size;
+  int block = 0, num_lines = 0;
+  i64 bytes = 0;
+  int step = 1;
+  while (step*2 <= n)
+    step *= 2;
+  // the blocks that end at or before y
+  for (; step; step /= 2) {
+    if (block + step <= n && num_lines + _line_tree[block + step].num_lines <= y) {
+      block += step;
+      num_lines += _line_tree[block].num_lines;
+      bytes += _line_tree[block].bytes;
+    }
+  }
+  if (block == n) {
+    --block;
+    num_lines -= _line_blocks[block].num_lines;
+    bytes -= _line_blocks[block].bytes;
+  }
+  *first_line = num_lines;
+  *first_byte = bytes;
+  return block;
+}
+
+void BufferData::_line_index_add(int y, int n) {
+  if (!_line_blocks.size)
+    return;
+  int first_line;
+  i64 first_byte;
+  _line_tree_add(_line_index_block(y, &first_line, &first_byte), 0, n);
+}
+
+void BufferData::_line_index_insert(int y0, int y1) {
+  if (!_line_blocks.size)
+    return;
+  i64 bytes = 0;
+  for (int y = y0; y <= y1; ++y)
+    bytes += lines[y].length + 1;
+  int first_line;
+  i64 first_byte;
+  int block = _line_index_block(y0, &first_line, &first_byte);
+  _line_tree_add(block, y1 - y0 + 1, bytes);
+  _line_index_lines += y1 - y0 + 1;
+  if (_line_blocks[block].num_lines > 2*LINE_BLOCK_LINES)
+    _line_index_unbalanced = true;
+}
+
+void BufferData::_line_index_remove(int y0, int y1) {
+  if (!_line_blocks.size)
+    return;
+  int first_line;
+  i64 first_byte;
+  int block = _line_index_block(y0, &first_line, &first_byte);
+  int end = first_line + _line_blocks[block].num_lines;
+  int num_lines = 0;
+  i64 bytes = 0;
+  for (int y = y0;; ++y) {
+    // done with this block
+    if (y == end || y > y1) {
+      _line_tree_add(block, -num_lines, -bytes);
+      if (_line_blocks[block].num_lines < LINE_BLOCK_LINES/4)
+        _line_index_unbalanced = true;
+      if (y > y1 || ++block == _line_blocks.size)
+        break;
+      end += _line_blocks[block].num_lines;
+      num_lines = 0, bytes = 0;
+      --y;
+      continue;
+    }
+    ++num_lines;
+    bytes += lines[y].length + 1;
+  }
+  _line_index_lines -= y1 - y0 + 1;
+}
+
+i64 BufferData::offset_of(Pos p) {
+  _line_index_update();
+  int y;
+  i64 offset;
+  _line_index_block(p.y, &y, &offset);
+  for (; y < p.y; ++y)
+    offset += lines[y].length + 1;
+  return offset + p.x;
+}
+
+Pos BufferData::pos_of(i64 offset) {
+  _line_index_update();
+
+  // walk down the tree to the block that offset is in
+  const int n = _line_blocks.size;
+  int block = 0, y = 0;
+  int step = 1;
+  while (step*2 <= n)
+    step *= 2;
+  for (; step; step /= 2) {
+    if (block + step <= n && _line_tree[block + step].bytes <= offset) {
+      block += step;
+      y += _line_tree[block].num_lines;
+      offset -= _line_tree[block].bytes;
+    }
+  }
+  if (block == n)
+    return {lines.last().length, lines.size-1};
+  for (; offset > lines[y].length; ++y)
+    offset -= lines[y].length + 1;
+  return {(int)at_least(offset, (i64)0), y};
+}
+
+i64 BufferData::total_bytes() {
+  _line_index_update();
+  i64 bytes = 0;
+  for (int i = _line_blocks.size; i > 0; i -= i & -i)
+    bytes += _line_tree[i].bytes;
+  // the last line has no endline
+  return bytes - 1;
 }
 
 Pos BufferData::to_visual_pos(Pos p) {
-  p.x = lines[p.y].visual_offset(p.x, G.tab_width);
+  p.x = visual_x(p.y, p.x);
   return p;
 }
 
+// shorter lines are just scanned
+#define VISUAL_CACHE_MIN_LENGTH 256
+#define VISUAL_CACHE_STEP 64
+// the cache is thrown away when it grows past this many lines
+#define VISUAL_CACHE_MAX_LINES 1024
+
+VisualLineCache* BufferData::_visual_cache_get(int y) {
+  int a = 0, b = _visual_cache.size;
+  while (a < b) {
+    int mid = (a+b)/2;
+    if (_visual_cache[mid].y < y)
+      a = mid+1;
+    else
+      b = mid;
+  }
+  if (a < _visual_cache.size && _visual_cache[a].y == y && _visual_cache[a].tab_width == G.tab_width)
+    return &_visual_cache[a];
+
+  if (_visual_cache.size >= VISUAL_CACHE_MAX_LINES) {
+    util_free(_visual_cache);
+    a = 0;
+  }
+  else if (a < _visual_cache.size && _visual_cache[a].y == y)
+    util_free(_visual_cache[a]), _visual_cache.remove_slow(a);
+
+  VisualLineCache c = {y, G.tab_width, true};
+  const StringBuffer &line = lines[y];
+  for (int i = 0; i < line.length; ++i)
+    if (line[i] == '\t' || (line[i] & 0x80))
+      c.simple = false;
+  if (!c.simple) {
+    int col = 0;
+    c.columns.reserve(line.length / VISUAL_CACHE_STEP + 1);
+    for (int i = 0; i < line.length; i += VISUAL_CACHE_STEP) {
+      c.columns += col;
+      col += Slice::visual_offset(line.chars + i, at_most(VISUAL_CACHE_STEP, line.length - i), VISUAL_CACHE_STEP, G.tab_width);
+    }
+  }
+  _visual_cache.insert(a, c);
+  return &_visual_cache[a];
+}
+
+void BufferData::_visual_cache_changed(int y0, int old_y1, int new_y1) {
+  if (!_visual_cache.size)
+    return;
+  const int dy = new_y1 - old_y1;
+  for (int i = 0; i < _visual_cache.size; ++i) {
+    VisualLineCache &c = _visual_cache[i];
+    if (c.y >= y0 && c.y <= old_y1)
+      util_free(c), _visual_cache.remove_slow(i--);
+    else if (c.y > old_y1)
+      c.y += dy;
+  }
+}
+
+int BufferData::visual_x(int y, int x) {
+  const StringBuffer &line = lines[y];
+  if (line.length < VISUAL_CACHE_MIN_LENGTH)
+    return line.visual_offset(x, G.tab_width);
+
+  if (x <= 0)
+    return 0;
+  VisualLineCache *c = _visual_cache_get(y);
+  if (c->simple)
+    return x;
+  if (x > line.length)
+    return visual_x(y, line.length) + x - line.length;
+  const int i = at_most(x / VISUAL_CACHE_STEP, c->columns.size-1);
+  return c->columns[i] + Slice::visual_offset(line.chars + i*VISUAL_CACHE_STEP, x - i*VISUAL_CACHE_STEP, x - i*VISUAL_CACHE_STEP, G.tab_width);
+}
+
+int BufferData::from_visual_x(int y, int visual) {
+  const StringBuffer &line = lines[y];
+  if (line.length < VISUAL_CACHE_MIN_LENGTH)
+    return line.from_visual_offset(visual, G.tab_width);
+
+  VisualLineCache *c = _visual_cache_get(y);
+  if (c->simple)
+    return clamp(visual, 0, line.length);
+
+  // find the last step that starts at or before the column, and scan from there
+  int a = 0, b = c->columns.size-1;
+  while (a < b) {
+    int mid = (a+b+1)/2;
+    if (c->columns[mid] <= visual)
+      a = mid;
+    else
+      b = mid-1;
+  }
+  const int x0 = a*VISUAL_CACHE_STEP;
+  return x0 + Slice::from_visual_offset(line.chars + x0, line.length - x0, visual - c->columns[a], G.tab_width);
+}
+
 void BufferView::move_to_y(int marker_idx, int y) {
   G.flags.cursor_dirty = true;
 
+  data->map_lines(y);
   y = clamp(y, 0, data->lines.size-1);
   int x = cursors[marker_idx].ghost_x;
   if (x == GHOST_EOL)
@@ -1790,7 +3772,7 @@ void BufferView::move_to_x(int marker_idx, int x) {
 
   x = clamp(x, 0, data->lines[cursors[marker_idx].y].length);
   cursors[marker_idx].x = x;
-  cursors[marker_idx].ghost_x = data->lines[cursors[marker_idx].y].visual_offset(x, G.tab_width);
+  cursors[marker_idx].ghost_x = data->visual_x(cursors[marker_idx].y, x);
 }
 
 void BufferView::move_to(int x, int y) {
@@ -1820,6 +3802,7 @@ void BufferView::move_y(int marker_idx, int dy) {
   Pos &pos = cursors[marker_idx].pos;
   int ghost_x = cursors[marker_idx].ghost_x;
 
+  data->map_lines(pos.y + dy);
   pos.y = clamp(pos.y + dy, 0, data->lines.size - 1);
 
   if (ghost_x == GHOST_EOL)
@@ -1827,7 +3810,7 @@ void BufferView::move_y(int marker_idx, int dy) {
   else if (ghost_x == GHOST_BOL)
     pos.x = data->begin_of_line(pos.y);
   else
-    pos.x = data->lines[pos.y].from_visual_offset(ghost_x, G.tab_width);
+    pos.x = data->from_visual_x(pos.y, ghost_x);
 }
 
 void BufferView::move_x(int marker_idx, int dx) {
@@ -1843,7 +3826,7 @@ void BufferView::move_x(int marker_idx, int dx) {
     for (; dx < 0; ++dx)
       pos.x = data->lines[pos.y].prev(pos.x);
   pos.x = clamp(pos.x, 0, data->lines[pos.y].length);
-  cursors[marker_idx].ghost_x = data->lines[pos.y].visual_offset(pos.x, G.tab_width);
+  cursors[marker_idx].ghost_x = data->visual_x(pos.y, pos.x);
 }
 
 void BufferView::move_x(int dx) {
@@ -1857,10 +3840,32 @@ void BufferView::move_y(int dy) {
 }
 
 void util_free(BufferData &b) {
-  util_free(b.lines);
+  journal_close(b);
+  if (b.saving)
+    b.saving->buffer = 0;
+  b.saving = 0;
+  if (b.is_mapped()) {
+    b.lines.free_shallow();
+    b.lines = {};
+    util_free(b.mapping);
+  }
+  else
+    util_free(b.lines);
+  b._line_blocks.free_shallow();
+  b._line_tree.free_shallow();
+  util_free(b._visual_cache);
+  b._search.ranges.free_shallow();
   util_free(b.filename);
   util_free(b.parser);
-  util_free(b._undo_actions);
+  util_free(b.definitions_fuzzy_cache);
+  b._undo_actions.free_shallow();
+  b._undo_actions = {};
+  util_free(b._undo_arena);
+  util_free(b._undo_last_snapshot);
+  util_free(b._undo_blocks);
+  util_free(b._undo_branches);
+  util_free(b._undo_checkpoints);
+  b._undo_bytes = b._undo_block_bytes = b._undo_branch_bytes = b._undo_checkpoint_bytes = 0;
   b.highlights.free_shallow();
 }
 
@@ -1914,6 +3919,8 @@ bool BufferData::reload(BufferData *b) {
   util_free(*b);
   bool succ = BufferData::from_file(filename.slice, b);
   util_free(filename);
+  if (succ)
+    journal_open(*b, false);
 
   _clamp_cursor_current_buffer = b;
   clamp_cursors(b, {}, {});
@@ -1921,6 +3928,26 @@ bool BufferData::reload(BufferData *b) {
   return succ;
 }
 
+// replaces the text with the one in the checkpoint
+void BufferData::undo_restore_checkpoint(const UndoCheckpoint &c) {
+  util_free(lines);
+  _line_index_clear();
+  util_free(_visual_cache);
+  _search.generation = 0;
+  for (const char *s = c.text.chars, *end = s + c.text.length;;) {
+    const char *e = (const char*)memchr(s, '\n', end - s);
+    if (!e)
+      e = end;
+    lines += StringBuffer::create(Slice{(char*)s, (int)(e - s)});
+    if (e == end)
+      break;
+    s = e+1;
+  }
+
+  _clamp_cursor_current_buffer = this;
+  clamp_cursors(this, {}, {});
+}
+
 void BufferData::highlight_range(Pos a, Pos b) {
   if (b < a)
     swap_range(*this, a,b);
@@ -6,7 +6,6 @@
  * fix tab-completion in ctrl-p (doesn't work properly with relative paths)
  * Oversample font
  * Multiple #if 0 is broken
- * Lazy tokenization
  * Project-wide search
  * Project-wide goto definition
  * Differentiate raw-text search and syntactic search
@@ -32,14 +31,11 @@
  * language-dependent autoindent
  * use autoindent to figure out indentation
  * when a long line is under selection, show expansion of that one line
- * Optimize tokenization
  * project file
  * Show current class/function/method/namespace
  * create new file
  * dp on empty ()
  * json language support, and auto formatting (requires language-dependent autoindent)
- * gd for multiple definitions with the same name
- * If a file is only 1 line long, the line will never be read
  * Code folding
  * always distinguish block selection on inner and outer?
  * Goto definition should show entire function parameter list
@@ -47,7 +43,6 @@
  * Fix git blame parsing (git blame doesn't re-output author etc for hashes it's already output)
  * Support for multiple languages
  * Have a global unified list of Locations/cursors
- * listen on file changes and automatically reload (or show a warning?)
  * Search on word only
  * Create an easy-to-use token iterator
  * make 'dp' use tokens instead of chars
@@ -59,11 +54,9 @@
  * recursive panes
  * Build system
  * parse BOM
- * Size limit on undo/redo
  * Fix memory leak occuring between frames
  * Index entire file tree
  * Syntactical Regex engine (regex with extensions for lexical tokens like identifiers, numbers, and maybe even functions, expressions etc.)
- * Compress undo history?
  * Multiuser editing
  */
 
@@ -77,14 +70,24 @@
 #include "graphics.hpp"
 #include "algorithm.hpp"
 #include "git.hpp"
+#include "filetree.hpp"
 #include "parse.hpp"
+#include "regex.hpp"
+#include "trigram.hpp"
 #include "buffer.hpp"
+#include "journal.hpp"
 #include "text_render_utils.hpp"
 #include "pane.hpp"
 #include <ctime>
 
 #define UTIL_IMPL
 #include "util.hpp"
+#define FILETREE_IMPL
+#include "filetree.hpp"
+#define REGEX_IMPL
+#include "regex.hpp"
+#define TRIGRAM_IMPL
+#include "trigram.hpp"
 
 typedef int Key;
 enum SpecialKey {
@@ -151,17 +154,75 @@ enum Mode {
   MODE_FILESEARCH,
   MODE_GOTO_DEFINITION,
   MODE_GOTO_ALL_DEFINITIONS,
+  MODE_HISTORY,
   MODE_CWD,
   MODE_PROMPT,
+  MODE_GREP,
   MODE_COUNT
 };
 
 struct ProjectDefinitionToFile {
   int end_idx;
   Path file;
+  u64 modify_time, size, hash; // what the file looked like when it was indexed
 };
 void util_free(ProjectDefinitionToFile) {}
 
+// the definitions found in one file by a project indexing thread
+struct ProjectIndexResult {
+  Path file; // points into G.files
+  u64 modify_time, size, hash;
+  Array<String> definitions;
+};
+void util_free(ProjectIndexResult &r) {
+  util_free(r.definitions);
+}
+
+// a line found by a project grep thread
+struct GrepMatch {
+  Path file; // points into G.files
+  Pos pos; // of the first match on the line
+  String line; // cut off at GREP_MAX_LINE_LENGTH
+};
+void util_free(GrepMatch &m) {
+  util_free(m.line);
+}
+
+// the trigrams of one file, found by a trigram index thread
+struct TrigramResult {
+  Path file; // points into G.files
+  bool indexed;
+  Array<u32> trigrams;
+};
+void util_free(TrigramResult &r) {
+  r.trigrams.free_shallow();
+}
+
+// a file in the on-disk project index, pointing into the contents of the index file
+struct ProjectIndexCacheEntry {
+  Slice path; // relative to the project root
+  u64 modify_time, size, hash;
+  int num_definitions;
+  const u8 *definitions; // num_definitions of (u32 length, chars)
+};
+void util_free(ProjectIndexCacheEntry) {}
+
+// a save running on a thread of its own. It writes a copy of the text, so that the buffer can be edited meanwhile
+struct SaveJob {
+  BufferData *buffer; // 0 if the buffer was closed or reloaded before the save finished
+  Thread thread;
+  bool threaded; // false if the thread couldn't be created, and the save was done right away
+  String filename;
+  String contents;
+  int num_lines;
+  u64 start_time;
+
+  // set by the thread, protected by G.saves.mutex
+  bool done;
+  bool success;
+  int error; // errno, if it failed
+};
+
 struct State {
   /* @renderer rendering state */
   SDL_Window *window;
@@ -198,6 +259,9 @@ struct State {
   Array<BufferData*> buffers;
   Array<ProjectDefinitionToFile> project_definitions_to_file;
   Array<String> project_definitions;
+  FuzzyMenuCache project_definitions_fuzzy_cache;
+  DefinitionTable project_definitions_table; // see project_definition_find
+  bool project_definitions_table_valid; // set this to false whenever project_definitions change
 
   Pane menu_pane;
   BufferData menu_buffer;
@@ -209,6 +273,7 @@ struct State {
   BufferData dropdown_buffer;
   BufferData null_buffer;
   BufferData build_result_buffer;
+  BufferData grep_buffer; // one line per match, as path:line:column: text
 
   float activation_meter;
 
@@ -240,14 +305,92 @@ struct State {
   /* goto_definition state */
   Pos goto_definition_begin_pos;
   Array<Pos> definition_positions;
+  Array<int> project_definition_matches; // indices into G.project_definitions of the suggestions
+
+  /* history browser state */
+  Array<UndoState> history_states; // the states of the suggestions in the menu
+  UndoState history_begin_state; // where we were when the browser was opened
 
   /* search state */
   bool search_failed;
   Pos search_begin_pos;
   Array<TokenInfo> search_term;
+  Regex search_regex; // searches that start with / are regexes
+  int search_generation; // changes with every new search
 
   /* file tree state */
   Array<Path> files;
+  FileWatcher file_watcher; // watches every directory in the file tree, and the colorscheme
+  FuzzyMenuCache files_fuzzy_cache; // for the names in G.files
+  Array<Path> files_to_reindex; // changed files in the tree, waiting for the project index threads to finish
+  Array<int> files_to_reindex_table; // see path_table_insert
+
+  /* project index state. The indexing threads only read G.files, and everything below the mutex is protected by it */
+  struct {
+    bool active;
+    Array<Thread> threads;
+    int num_files; // number of files that we know how to parse
+    Mutex mutex;
+    bool cancel;
+    int next_file; // index into G.files
+    int num_running;
+    int num_indexed;
+    Array<ProjectIndexResult> results; // picked up by the main thread in do_update
+    int num_parsed; // files that were not up to date in the cache
+    int num_stale; // files whose cache entry has to be written again, which includes the ones that were only touched
+    int root_length; // length of the project root path, including the trailing separator
+    Array<u8> cache_file;
+    Array<ProjectIndexCacheEntry> cache; // sorted by path
+  } project_index;
+
+  /* trigram index state. The build threads only read G.files, and everything below the mutex is protected by it */
+  TrigramIndex trigram_index; // tells grep which files can't have a match, once it's ready
+  bool trigram_index_ready;
+  bool trigram_index_disabled;
+  struct {
+    bool active;
+    Array<Thread> threads;
+    u64 start_time;
+    Mutex mutex;
+    bool cancel;
+    int next_file; // index into G.files
+    int num_running;
+    Array<TrigramResult> results; // picked up by the main thread in do_update
+  } trigram_build;
+
+  /* project grep state. The grep threads only read the files and the query, and everything below the mutex is protected by it */
+  struct {
+    bool active;
+    Array<Thread> threads;
+    String query; // starts with / for regexes, like searches
+    Array<Path> files; // the files that may have a match, pointing into G.files
+    u64 start_time;
+    Mutex mutex;
+    bool cancel;
+    int next_file; // index into files
+    int num_running;
+    int num_searched;
+    int num_matches;
+    Array<GrepMatch> results; // picked up by the main thread in do_update
+  } grep;
+
+  /* journal state. Everything below the mutex is protected by it. See journal.hpp */
+  struct {
+    bool active;
+    Path dir;
+    Thread thread;
+    Mutex mutex;
+    Condition cond;
+    bool quit;
+    Array<Journal*> journals;
+  } journal;
+  Array<Path> files_to_recover; // files with unsaved changes from the last session, that the user is asked about on startup
+
+  /* background save state */
+  struct {
+    Mutex mutex;
+    Array<SaveJob*> jobs;
+  } saves;
   
   /* visual mode state */
   Location visual_start; // starting position of visual mode
@@ -256,6 +399,7 @@ struct State {
   /* some settings */
   int tab_width; /* how wide are tabs when rendered */
   int default_tab_type; /* 0 for tabs, 1+ for spaces */
+  long undo_budget; /* max bytes of undo history per buffer */
 
   /* build state */
   Array<String> build_command;
@@ -275,6 +419,8 @@ static char visual_jump_highlight_keys[] = {'a', 's', 'd', 'f', 'h', 'j', 'k', '
 
 #define BUFFER_IMPL
 #include "buffer.hpp"
+#define JOURNAL_IMPL
+#include "journal.hpp"
 #define TEXT_RENDER_UTIL_IMPL
 #include "text_render_utils.hpp"
 #define PANE_IMPL
@@ -399,47 +545,130 @@ static const char* cman_strerror(int e) {
   #endif
 }
 
-static void save_buffer(BufferData *b) {
-  FILE* f;
-  int i;
+static void save_thread(void *data) {
+  SaveJob *job = (SaveJob*)data;
+  bool success = contents_to_file(job->filename.slice, job->contents.slice);
+  int error = errno;
 
-  if (!b->is_bound_to_file())
-    return;
+  G.saves.mutex.lock();
+  job->success = success;
+  job->error = error;
+  job->done = true;
+  G.saves.mutex.unlock();
+}
 
-  if (File::open(&f, b->filename.chars, "wb")) {
-    status_message_set("Could not open file {} for writing: %s", (Slice)b->filename.slice, cman_strerror(errno));
-    return;
+// waits for the save to finish, and marks the buffer as saved
+static void save_finish(SaveJob *job) {
+  if (job->threaded)
+    job->thread.join();
+  double seconds = (double)(SDL_GetPerformanceCounter() - job->start_time) / (double)SDL_GetPerformanceFrequency();
+
+  BufferData *b = job->buffer;
+  if (!job->success)
+    status_message_set("Failed to write to {}: %s", (Slice)job->filename.slice, cman_strerror(job->error));
+  else {
+    if (b) {
+      b->_last_save_undo_action = b->_saving_undo_action;
+      // remember what we wrote, so that the file watcher doesn't think someone else changed it
+      File::info(b->filename.chars, &b->file_modify_time, &b->file_size);
+      journal_saved(*b);
+    }
+    status_message_set("Wrote %i lines to {} (%i MB/s)", job->num_lines, (Slice)job->filename.slice, (int)(job->contents.length / (seconds + 1e-9) / (1024*1024)));
   }
 
-  const int endline_len = strlen(b->endline_string);
+  if (b)
+    b->saving = 0;
+  G.saves.jobs.remove_item_slow(job);
+  util_free(job->filename);
+  util_free(job->contents);
+  delete job;
+}
 
-  /* TODO: actually write to a temporary file, and when we have succeeded, rename it over the old file */
-  for (i = 0; i < b->num_lines(); ++i) {
-    unsigned int num_to_write = b->lines[i].length;
+// finishes the saves that are done
+static void save_update() {
+  for (int i = 0; i < G.saves.jobs.size; ++i) {
+    G.saves.mutex.lock();
+    bool done = G.saves.jobs[i]->done;
+    G.saves.mutex.unlock();
+    if (done)
+      save_finish(G.saves.jobs[i--]);
+  }
+}
 
-    if (num_to_write && File::write(f, b->lines[i].chars, num_to_write)) {
-      status_message_set("Failed to write to {}: %s", (Slice)b->filename.slice, cman_strerror(errno));
-      goto err;
-    }
+static void save_wait_all() {
+  while (G.saves.jobs.size)
+    save_finish(G.saves.jobs[0]);
+}
 
-    // endline
-    if (i < b->num_lines()-1) {
-      if (File::write(f, b->endline_string, endline_len)) {
-        status_message_set("Failed to write to {}: %s", (Slice)b->filename.slice, cman_strerror(errno));
-        goto err;
-      }
-    }
+// Starts writing the buffer to its file on another thread. It's marked as saved when that's done, see save_update
+static void save_buffer(BufferData *b) {
+  if (!b->is_bound_to_file())
+    return;
+  if (b->is_mapped()) {
+    status_message_set("{} is too big to be changed", (Slice)b->name());
+    return;
   }
 
-  status_message_set("Wrote %i lines to {}", b->num_lines(), (Slice)b->filename.slice);
+  // two saves of the same file would write the same temporary file
+  if (b->saving)
+    save_finish(b->saving);
+
+  status_message_set("Saving {}..", (Slice)b->name());
+  SaveJob *job = new SaveJob{};
+  job->buffer = b;
+  job->filename = String::create(b->filename.slice);
+  job->num_lines = b->num_lines();
+  job->start_time = SDL_GetPerformanceCounter();
+  lines_to_contents(b->lines, b->endline_string, &job->contents);
+  b->_saving_undo_action = b->_next_undo_action;
+  b->saving = job;
+  G.saves.jobs += job;
+
+  job->threaded = Thread::create(&job->thread, save_thread, job);
+  // no thread, so just do it here
+  if (!job->threaded)
+    save_thread(job);
+}
 
-  b->_last_save_undo_action = b->_next_undo_action;
+static void save_all_buffers() {
+  int count = 0;
+  for (BufferData *b : G.buffers)
+    if (b->modified())
+      save_buffer(b), ++count;
+  if (count)
+    status_message_set("Saving %i files..", count);
+  else
+    status_message_set("No unsaved changes");
+}
 
-  err:
-  fclose(f);
+// Switches to the buffer of the file, and opens it if it isn't already. If recover is set, the unsaved changes in its journal are applied
+static bool open_buffer(Path path, bool recover) {
+  for (BufferData *b : G.buffers) {
+    if (path.string.slice == b->filename.slice) {
+      status_message_set("Switched to {}", (Slice)b->filename.slice);
+      G.editing_pane->switch_buffer(b);
+      return true;
+    }
+  }
+
+  BufferData *b = new BufferData{};
+  if (!BufferData::from_file(path.string.slice, b)) {
+    status_message_set("Failed to load file {}", (Slice)path.name());
+    free(b);
+    return false;
+  }
+  journal_open(*b, recover);
+  G.buffers += b;
+  G.editing_pane->switch_buffer(b);
+  status_message_set("Loaded file {} ({}) (%s)", (Slice)path.name(), language_settings[b->language].name, b->endline_string == ENDLINE_UNIX ? "Unix" : "Windows");
+  return true;
 }
 
 void editor_exit(int exitcode) {
+  save_wait_all();
+  for (BufferData *b : G.buffers)
+    journal_close(*b);
+  journal_quit();
   SDL_Quit();
   exit(exitcode);
 }
@@ -468,51 +697,1067 @@ static bool dropdown_autocomplete_or_insert_tab(Pane &p) {
 
 #define CONTROL(c) ((c)|KEY_CONTROL)
 
-static void _filetree_fill(Path path) {
-  Array<Path> files = {};
-  if (!File::list_files(path, &files))
-    goto err;
+// walks the tree under dir, adds the files to G.files and watches the directories
+static void filetree_add(Path dir) {
+  Array<Path> files = {}, dirs = {};
+  filetree_walk(G.current_working_directory, dir, &files, &dirs);
+  G.files.push(files.items, files.size);
+  G.files_fuzzy_cache.valid = false;
+  for (Path d : dirs)
+    G.file_watcher.watch(d);
+  files.free_shallow();
+  util_free(dirs);
+}
+
+static bool lines_from_file(Slice filename, Array<StringBuffer> *result, const char **endline_string_result);
+
+/* The project index is cached in a file in the project root, so that we only have to parse the files that changed since last time.
+ * Everything is stored in native byte order, and the entries point straight into the file contents, so loading it is mostly just reading the file
+ *
+ * header: u32 magic, u32 version, u32 num_entries
+ * entry:  u64 modify_time, u64 size, u64 hash, u32 path_length, u32 num_definitions, path chars, num_definitions of (u32 length, chars)
+ */
+#define PROJECT_INDEX_CACHE_FILENAME ".cmantic_index"
+#define PROJECT_INDEX_CACHE_MAGIC 0x58494d43
+// bump this whenever the parser starts producing different definitions
+#define PROJECT_INDEX_CACHE_VERSION 1
+#define PROJECT_INDEX_MAX_FILE_SIZE (4*1024*1024)
+
+static bool project_index_cache_read(const u8 **p, const u8 *end, void *result, int n) {
+  if (end - *p < n)
+    return false;
+  memcpy(result, *p, n);
+  *p += n;
+  return true;
+}
+
+static int project_index_cache_cmp(const void *a, const void *b) {
+  Slice x = ((const ProjectIndexCacheEntry*)a)->path;
+  Slice y = ((const ProjectIndexCacheEntry*)b)->path;
+  int c = memcmp(x.chars, y.chars, at_most(x.length, y.length));
+  return c ? c : x.length - y.length;
+}
+
+static Path project_index_cache_path() {
+  Path p = G.current_working_directory.copy();
+  p.push(PROJECT_INDEX_CACHE_FILENAME);
+  return p;
+}
+
+static void project_index_cache_load() {
+  Path path = project_index_cache_path();
+  Array<u8> &file = G.project_index.cache_file;
+  Array<ProjectIndexCacheEntry> &cache = G.project_index.cache;
+  const u8 *p, *end;
+  u32 magic, version, num_entries;
+
+  if (!File::get_contents(path, &file))
+    goto err;
+  p = file.items;
+  end = file.items + file.size;
+  if (!project_index_cache_read(&p, end, &magic, 4) || magic != PROJECT_INDEX_CACHE_MAGIC)
+    goto err;
+  if (!project_index_cache_read(&p, end, &version, 4) || version != PROJECT_INDEX_CACHE_VERSION)
+    goto err;
+  if (!project_index_cache_read(&p, end, &num_entries, 4) || num_entries > (u32)file.size)
+    goto err;
+
+  cache.reserve(num_entries);
+  for (u32 i = 0; i < num_entries; ++i) {
+    ProjectIndexCacheEntry e;
+    u32 path_length, num_definitions;
+    if (!project_index_cache_read(&p, end, &e.modify_time, 8) ||
+        !project_index_cache_read(&p, end, &e.size, 8) ||
+        !project_index_cache_read(&p, end, &e.hash, 8) ||
+        !project_index_cache_read(&p, end, &path_length, 4) ||
+        !project_index_cache_read(&p, end, &num_definitions, 4) ||
+        end - p < (ptrdiff_t)path_length)
+      goto err;
+    e.path = Slice::create((const char*)p, path_length);
+    p += path_length;
+
+    e.num_definitions = num_definitions;
+    e.definitions = p;
+    for (u32 j = 0; j < num_definitions; ++j) {
+      u32 length;
+      if (!project_index_cache_read(&p, end, &length, 4) || end - p < (ptrdiff_t)length)
+        goto err;
+      p += length;
+    }
+    cache += e;
+  }
+
+  qsort(cache.items, cache.size, sizeof(cache[0]), project_index_cache_cmp);
+  util_free(path);
+  return;
+
+  err:
+  if (file.size)
+    log_warn("Project index cache %s is invalid, ignoring it\n", path.string.chars);
+  util_free(path);
+  file.free_shallow();
+  file = {};
+  cache.free_shallow();
+  cache = {};
+}
+
+static ProjectIndexCacheEntry* project_index_cache_find(Slice path) {
+  ProjectIndexCacheEntry key;
+  key.path = path;
+  return (ProjectIndexCacheEntry*)bsearch(&key, G.project_index.cache.items, G.project_index.cache.size, sizeof(key), project_index_cache_cmp);
+}
+
+static void project_index_cache_definitions(ProjectIndexCacheEntry *e, Array<String> *result) {
+  const u8 *p = e->definitions;
+  result->reserve(e->num_definitions);
+  for (int i = 0; i < e->num_definitions; ++i) {
+    u32 length;
+    memcpy(&length, p, 4);
+    p += 4;
+    *result += String::create((const char*)p, length);
+    p += length;
+  }
+}
+
+// written to a temporary file and renamed over the old one, so another instance never reads a half-written cache
+static void project_index_cache_save() {
+  Array<u8> out = {};
+  u32 magic = PROJECT_INDEX_CACHE_MAGIC, version = PROJECT_INDEX_CACHE_VERSION, num_entries = G.project_definitions_to_file.size;
+  Path path = project_index_cache_path();
+
+  out.push((u8*)&magic, 4);
+  out.push((u8*)&version, 4);
+  out.push((u8*)&num_entries, 4);
+  for (int i = 0; i < G.project_definitions_to_file.size; ++i) {
+    ProjectDefinitionToFile d = G.project_definitions_to_file[i];
+    int begin = i ? G.project_definitions_to_file[i-1].end_idx : 0;
+    Slice rel = d.file.string.slice(G.project_index.root_length, -1);
+    u32 path_length = rel.length, num_definitions = d.end_idx - begin;
+    out.push((u8*)&d.modify_time, 8);
+    out.push((u8*)&d.size, 8);
+    out.push((u8*)&d.hash, 8);
+    out.push((u8*)&path_length, 4);
+    out.push((u8*)&num_definitions, 4);
+    out.push((u8*)rel.chars, rel.length);
+    for (int j = begin; j < d.end_idx; ++j) {
+      String s = G.project_definitions[j];
+      u32 length = s.length;
+      out.push((u8*)&length, 4);
+      out.push((u8*)s.chars, s.length);
+    }
+  }
+
+  if (!contents_to_file(path.string.slice, Slice{(char*)out.items, out.size}))
+    log_warn("Failed to write project index cache %s: %s\n", path.string.chars, cman_strerror(errno));
+  out.free_shallow();
+  util_free(path);
+}
+
+static void project_index_cache_free() {
+  G.project_index.cache_file.free_shallow();
+  G.project_index.cache_file = {};
+  G.project_index.cache.free_shallow();
+  G.project_index.cache = {};
+}
+
+// finds the definitions in a file, either from the cache or by parsing it. Returns false if it's not a file we know how to parse.
+// stale is set if the cache entry doesn't match the file's time and size anymore, even if the contents turn out to be the same
+static bool project_index_file(Path p, ProjectIndexResult *result, bool *parsed, bool *stale) {
+  Language l = language_from_filename(p.string.slice);
+  if (l == LANGUAGE_NULL)
+    return false;
+
+  *result = {p};
+  *parsed = false;
+  *stale = false;
+  if (!File::info(p.string.chars, &result->modify_time, &result->size))
+    return false;
+
+  // if the file hasn't changed since it was cached, we can skip reading it completely
+  ProjectIndexCacheEntry *e = project_index_cache_find(p.string.slice(G.project_index.root_length, -1));
+  if (e && e->modify_time == result->modify_time && e->size == result->size) {
+    result->hash = e->hash;
+    project_index_cache_definitions(e, &result->definitions);
+    return true;
+  }
+  *stale = true;
+
+  // don't bother with huge files, they are most likely generated
+  if (result->size > PROJECT_INDEX_MAX_FILE_SIZE)
+    return false;
+  Array<u8> contents;
+  if (!File::get_contents(p.string.chars, &contents))
+    return false;
+  // nor with binary files that happen to have a source file extension
+  if (memchr(contents.items, 0, at_most(contents.size, 8000))) {
+    contents.free_shallow();
+    return false;
+  }
+  result->hash = hash_bytes(contents.items, contents.size);
+
+  // it was touched, but the contents are the same
+  if (e && e->hash == result->hash)
+    project_index_cache_definitions(e, &result->definitions);
+  else {
+    Array<StringBuffer> lines;
+    lines_from_contents(Slice::create((char*)contents.items, contents.size), &lines, 0);
+    ParseResult pr = parse(lines, l);
+    for (Range r : pr.definitions)
+      result->definitions += lines[r.a.y](r.a.x, r.b.x).copy();
+    util_free(pr);
+    util_free(lines);
+    *parsed = true;
+  }
+  contents.free_shallow();
+  return true;
+}
+
+static void project_index_thread(void*) {
+  for (;;) {
+    G.project_index.mutex.lock();
+    if (G.project_index.cancel || G.project_index.next_file >= G.files.size) {
+      --G.project_index.num_running;
+      G.project_index.mutex.unlock();
+      return;
+    }
+    Path p = G.files[G.project_index.next_file++];
+    G.project_index.mutex.unlock();
+
+    ProjectIndexResult result;
+    bool parsed, stale;
+    if (!project_index_file(p, &result, &parsed, &stale))
+      continue;
+
+    G.project_index.mutex.lock();
+    G.project_index.results += result;
+    ++G.project_index.num_indexed;
+    G.project_index.num_parsed += parsed;
+    G.project_index.num_stale += stale;
+    G.project_index.mutex.unlock();
+  }
+}
+
+// tells the indexing threads to stop, and waits for them
+static void project_index_stop() {
+  if (!G.project_index.active)
+    return;
+
+  G.project_index.mutex.lock();
+  G.project_index.cancel = true;
+  G.project_index.mutex.unlock();
+  for (Thread &t : G.project_index.threads)
+    t.join();
+  G.project_index.threads.free_shallow();
+  G.project_index.threads = {};
+  util_free(G.project_index.results);
+  util_free(G.project_index.mutex);
+  project_index_cache_free();
+  G.project_index.active = false;
+}
+
+// moves finished results from the indexing threads into G.project_definitions
+static void project_index_update() {
+  if (!G.project_index.active)
+    return;
+
+  G.project_index.mutex.lock();
+  Array<ProjectIndexResult> results = G.project_index.results;
+  G.project_index.results = {};
+  int num_indexed = G.project_index.num_indexed;
+  int num_parsed = G.project_index.num_parsed;
+  int num_stale = G.project_index.num_stale;
+  bool done = G.project_index.num_running == 0;
+  G.project_index.mutex.unlock();
+
+  if (results.size) {
+    G.project_definitions_fuzzy_cache.valid = false;
+    G.project_definitions_table_valid = false;
+  }
+  for (ProjectIndexResult &r : results) {
+    G.project_definitions.push(r.definitions.items, r.definitions.size);
+    G.project_definitions_to_file += ProjectDefinitionToFile{G.project_definitions.size, r.file, r.modify_time, r.size, r.hash};
+    r.definitions.free_shallow();
+  }
+  results.free_shallow();
+
+  if (done) {
+    for (Thread &t : G.project_index.threads)
+      t.join();
+    G.project_index.threads.free_shallow();
+    G.project_index.threads = {};
+    util_free(G.project_index.mutex);
+    G.project_index.active = false;
+    if (num_stale || G.project_definitions_to_file.size != G.project_index.cache.size)
+      project_index_cache_save();
+    project_index_cache_free();
+    log_info("Indexed %i files (%i parsed), with %i definitions\n", num_indexed, num_parsed, G.project_definitions.size);
+    if (G.bottom_pane == &G.status_message_pane)
+      status_message_set("Indexed %i files, with %i definitions", num_indexed, G.project_definitions.size);
+    return;
+  }
+
+  static int prev_num_indexed = -1;
+  if (num_indexed != prev_num_indexed && G.bottom_pane == &G.status_message_pane)
+    status_message_set("Indexing project.. %i/%i files", num_indexed, G.project_index.num_files);
+  prev_num_indexed = num_indexed;
+}
+
+// adds the definitions of G.files[file_idx] to the project index. Any old ones must have been removed already
+static void project_index_add(int file_idx) {
+  ProjectIndexResult r;
+  bool parsed, stale;
+  if (!project_index_file(G.files[file_idx], &r, &parsed, &stale))
+    return;
+  G.project_definitions.push(r.definitions.items, r.definitions.size);
+  G.project_definitions_to_file += ProjectDefinitionToFile{G.project_definitions.size, r.file, r.modify_time, r.size, r.hash};
+  G.project_definitions_fuzzy_cache.valid = false;
+  G.project_definitions_table_valid = false;
+  r.definitions.free_shallow();
+}
+
+// returns the file that G.project_definitions[idx] was found in
+static Path project_definition_file(int idx) {
+  // the first file that ends after idx
+  Array<ProjectDefinitionToFile> &to_file = G.project_definitions_to_file;
+  int a = 0, b = to_file.size-1;
+  while (a < b) {
+    int mid = (a+b)/2;
+    if (to_file[mid].end_idx > idx)
+      b = mid;
+    else
+      a = mid+1;
+  }
+  return to_file[a].file;
+}
+
+// Returns the index in G.project_definitions of the first definition named name, or the one after prev. -1 if there are no more
+static int project_definition_find(Slice name, int prev = -1) {
+  DefinitionTable &t = G.project_definitions_table;
+  if (!G.project_definitions_table_valid) {
+    t.hashes.size = 0;
+    for (String s : G.project_definitions)
+      t.hashes += hash_bytes(s.chars, s.length);
+    definition_table_rebuild(t);
+    G.project_definitions_table_valid = true;
+  }
+  int i = prev == -1 ? definition_table_find(t, name) : definition_table_next(t, prev);
+  for (; i != -1; i = definition_table_next(t, i))
+    if (G.project_definitions[i].slice == name)
+      return i;
+  return -1;
+}
+
+// opens the file of G.project_definitions[idx], and moves to the definition
+static bool goto_project_definition(int idx) {
+  if (idx >= G.project_definitions.size)
+    return false;
+  Slice name = G.project_definitions[idx].slice;
+  if (!open_buffer(project_definition_file(idx), false))
+    return false;
+  BufferView &buffer = G.editing_pane->buffer;
+  Range *def = buffer.data->getdefinition(name);
+  buffer.jumplist_push();
+  if (def)
+    buffer.move_to(def->a);
+  buffer.jumplist_push();
+  return true;
+}
+
+#define TRIGRAM_INDEX_MAX_FILE_SIZE (16*1024*1024)
+
+// Files that can't be read, or are too big, are left unindexed, which means that grep always searches them
+static void trigram_index_file(Path p, Array<u64> *bits, TrigramResult *result) {
+  *result = {p};
+  u64 modify_time, size;
+  if (!File::info(p.string.chars, &modify_time, &size) || size > TRIGRAM_INDEX_MAX_FILE_SIZE)
+    return;
+  Array<u8> contents;
+  if (!File::get_contents(p.string.chars, &contents))
+    return;
+  result->indexed = true;
+  // grep skips binary files, so they don't get any trigrams
+  if (!memchr(contents.items, 0, at_most(contents.size, 8000)))
+    trigram_extract((char*)contents.items, contents.size, &result->trigrams, bits);
+  contents.free_shallow();
+}
+
+static void trigram_index_thread(void*) {
+  Array<u64> bits = {};
+  for (;;) {
+    G.trigram_build.mutex.lock();
+    if (G.trigram_build.cancel || G.trigram_build.next_file >= G.files.size) {
+      --G.trigram_build.num_running;
+      G.trigram_build.mutex.unlock();
+      break;
+    }
+    Path p = G.files[G.trigram_build.next_file++];
+    G.trigram_build.mutex.unlock();
+
+    TrigramResult result;
+    trigram_index_file(p, &bits, &result);
+
+    G.trigram_build.mutex.lock();
+    G.trigram_build.results += result;
+    G.trigram_build.mutex.unlock();
+  }
+  bits.free_shallow();
+}
+
+// tells the trigram index threads to stop, and waits for them. The index is left unfinished
+static void trigram_index_stop() {
+  if (!G.trigram_build.active)
+    return;
+
+  G.trigram_build.mutex.lock();
+  G.trigram_build.cancel = true;
+  G.trigram_build.mutex.unlock();
+  for (Thread &t : G.trigram_build.threads)
+    t.join();
+  G.trigram_build.threads.free_shallow();
+  G.trigram_build.threads = {};
+  util_free(G.trigram_build.results);
+  util_free(G.trigram_build.mutex);
+  G.trigram_build.active = false;
+}
+
+// throws away the trigram index, and starts building a new one of G.files
+static void trigram_index_start() {
+  trigram_index_stop();
+  util_free(G.trigram_index);
+  G.trigram_index_ready = false;
+  if (G.trigram_index_disabled)
+    return;
+  if (!G.files.size) {
+    G.trigram_index_ready = true;
+    return;
+  }
+
+  int num_threads = clamp(Thread::num_cpus(), 1, G.files.size);
+  G.trigram_build.mutex.init();
+  G.trigram_build.cancel = false;
+  G.trigram_build.next_file = 0;
+  G.trigram_build.num_running = num_threads;
+  G.trigram_build.start_time = SDL_GetPerformanceCounter();
+  G.trigram_build.active = true;
+  for (int i = 0; i < num_threads; ++i) {
+    Thread t;
+    if (!Thread::create(&t, trigram_index_thread, 0)) {
+      log_err("Failed to create trigram index thread\n");
+      G.trigram_build.mutex.lock();
+      G.trigram_build.num_running -= num_threads - i;
+      G.trigram_build.mutex.unlock();
+      break;
+    }
+    G.trigram_build.threads += t;
+  }
+
+  // no threads, so just do it here
+  if (!G.trigram_build.threads.size) {
+    G.trigram_build.num_running = 1;
+    trigram_index_thread(0);
+  }
+}
+
+// moves finished files from the trigram index threads into G.trigram_index
+static void trigram_index_update() {
+  if (!G.trigram_build.active)
+    return;
+
+  G.trigram_build.mutex.lock();
+  Array<TrigramResult> results = G.trigram_build.results;
+  G.trigram_build.results = {};
+  bool done = G.trigram_build.num_running == 0;
+  G.trigram_build.mutex.unlock();
+
+  for (TrigramResult &r : results)
+    G.trigram_index.add(r.file.string.slice, r.indexed, view(r.trigrams));
+  util_free(results);
+
+  if (done) {
+    for (Thread &t : G.trigram_build.threads)
+      t.join();
+    G.trigram_build.threads.free_shallow();
+    G.trigram_build.threads = {};
+    util_free(G.trigram_build.mutex);
+    G.trigram_build.active = false;
+    G.trigram_index_ready = true;
+    double seconds = (double)(SDL_GetPerformanceCounter() - G.trigram_build.start_time) / (double)SDL_GetPerformanceFrequency();
+    log_info("Built trigram index of %i files, with %i postings, in %f seconds\n", G.trigram_index.num_live, G.trigram_index.num_postings, seconds);
+  }
+}
+
+// (re-)adds G.files[file_idx] to the trigram index
+static void trigram_index_add(int file_idx) {
+  if (!G.trigram_index_ready)
+    return;
+  static Array<u64> bits;
+  TrigramResult r;
+  trigram_index_file(G.files[file_idx], &bits, &r);
+  G.trigram_index.add(r.file.string.slice, r.indexed, view(r.trigrams));
+  util_free(r);
+}
+
+// The outermost path in G.files_to_reindex that f is, or is inside of, or -1.
+// inside is set if f is inside of it, rather than the path itself
+static int project_index_changed_find(Slice f, bool *inside) {
+  for (int k = 1; k <= f.length; ++k) {
+    if (k < f.length && f[k] != Path::separator)
+      continue;
+    int i = path_table_find(G.files_to_reindex_table, G.files_to_reindex, f(0, k));
+    if (i >= 0) {
+      *inside = k < f.length;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Re-indexes the files and directories in G.files_to_reindex, which were changed, created or removed.
+// It's all done in one pass over the files and the definitions, since a checkout can change thousands of files at once
+static void project_index_changed() {
+  Array<Path> &paths = G.files_to_reindex;
+  Array<FileType> types = {};
+  Array<int> file_idx = {}; // where each changed file is in G.files, or -1
+  for (Path p : paths) {
+    types += File::filetype(p);
+    file_idx += -1;
+  }
+  bool inside;
+
+  // drop the definitions of every file that changed, they are found again below
+  Array<ProjectDefinitionToFile> &to_file = G.project_definitions_to_file;
+  int num_definitions = 0, num_files = 0;
+  for (int i = 0, begin = 0; i < to_file.size; ++i) {
+    ProjectDefinitionToFile d = to_file[i];
+    const int end = d.end_idx;
+    if (project_index_changed_find(d.file.string.slice, &inside) >= 0) {
+      for (int j = begin; j < end; ++j)
+        util_free(G.project_definitions[j]);
+    }
+    else {
+      for (int j = begin; j < end; ++j)
+        G.project_definitions[num_definitions++] = G.project_definitions[j];
+      d.end_idx = num_definitions;
+      to_file[num_files++] = d;
+    }
+    begin = end;
+  }
+  if (num_files != to_file.size) {
+    G.project_definitions_fuzzy_cache.valid = false;
+    G.project_definitions_table_valid = false;
+  }
+  G.project_definitions.size = num_definitions;
+  to_file.size = num_files;
+
+  // remove the files that are gone, and anything inside a changed directory. The changed files keep their place
+  int n = 0;
+  for (int k = 0; k < G.files.size; ++k) {
+    Path f = G.files[k];
+    int i = project_index_changed_find(f.string.slice, &inside);
+    if (i >= 0 && (inside || types[i] != FILETYPE_FILE)) {
+      G.trigram_index.remove(f.string.slice);
+      util_free(f);
+      continue;
+    }
+    if (i >= 0)
+      file_idx[i] = n;
+    G.files[n++] = f;
+  }
+  if (n != G.files.size)
+    G.files_fuzzy_cache.valid = false;
+  G.files.size = n;
+
+  for (int i = 0; i < paths.size; ++i) {
+    Path p = paths[i];
+    if (types[i] != FILETYPE_FILE && types[i] != FILETYPE_DIR)
+      continue;
+    // anything inside of a changed directory is found when that is walked
+    if (project_index_changed_find(p.string.slice, &inside) != i)
+      continue;
+    if (filetree_is_ignored(G.current_working_directory, p, types[i] == FILETYPE_DIR))
+      continue;
+
+    if (types[i] == FILETYPE_DIR) {
+      int first = G.files.size;
+      filetree_add(p);
+      for (int j = first; j < G.files.size; ++j) {
+        project_index_add(j);
+        trigram_index_add(j);
+      }
+      continue;
+    }
+    if (file_idx[i] == -1) {
+      file_idx[i] = G.files.size;
+      G.files += p.copy();
+      G.files_fuzzy_cache.valid = false;
+    }
+    project_index_add(file_idx[i]);
+    trigram_index_add(file_idx[i]);
+  }
+  types.free_shallow();
+  file_idx.free_shallow();
+}
+
+/***************************************************************
+***************************************************************
+*                                                            **
+*                                                            **
+*                         PROJECT GREP                       **
+*                                                            **
+*                                                            **
+***************************************************************
+***************************************************************/
+
+#define GREP_CHUNK_SIZE (4*1024*1024)
+#define GREP_MAX_MATCHES 100000
+#define GREP_MAX_LINE_LENGTH 256
+#define GREP_NUM_SUGGESTIONS 15
+
+static bool grep_cancelled() {
+  G.grep.mutex.lock();
+  bool cancel = G.grep.cancel;
+  G.grep.mutex.unlock();
+  return cancel;
+}
+
+static void grep_add_match(Path file, Slice line, int x, int y, Array<GrepMatch> *matches) {
+  if (line.length && line[line.length-1] == '\r')
+    --line.length;
+  if (line.length > GREP_MAX_LINE_LENGTH) {
+    line.length = GREP_MAX_LINE_LENGTH;
+    // don't cut a character in half
+    while (line.length && ((u8)line[line.length] & 0xC0) == 0x80)
+      --line.length;
+  }
+  *matches += GrepMatch{file, {x, y}, String::create(line)};
+}
+
+// Searches the complete lines in text, the first of which is line y. Every line with a match is added to matches.
+// Lines that don't contain the literal part of the query are skipped with memmem, so we only look at a line at a time
+// when there is no literal part
+static void grep_lines(Path file, Slice text, int y, Slice literal, Regex *regex, Array<GrepMatch> *matches) {
+  const char *p = text.chars, *end = text.chars + text.length;
+  while (p < end) {
+    const char *hit = p;
+    if (literal.length) {
+      hit = (const char*)memmem(literal.chars, literal.length, p, end - p);
+      if (!hit)
+        return;
+    }
+    y += memcount(p, hit - p, '\n');
+    const char *line_begin = hit;
+    while (line_begin > text.chars && line_begin[-1] != '\n')
+      --line_begin;
+    const char *line_end = (const char*)memchr(hit, '\n', end - hit);
+    if (!line_end)
+      line_end = end;
+    Slice line = {(char*)line_begin, (int)(line_end - line_begin)};
+
+    int x = hit - line_begin, b;
+    if (!regex || regex_find(regex, line.length && line[line.length-1] == '\r' ? line(0, -2) : line, 0, {}, &x, &b))
+      grep_add_match(file, line, x, y, matches);
+    p = line_end + 1;
+    ++y;
+  }
+}
+
+// regexes with token classes need the file to be tokenized, so it's loaded and parsed like a buffer
+static void grep_file_tokens(Path file, Regex *regex, Array<GrepMatch> *matches) {
+  Array<u8> contents;
+  if (!File::get_contents(file.string.chars, &contents))
+    return;
+  if (memchr(contents.items, 0, at_most(contents.size, 8000))) {
+    contents.free_shallow();
+    return;
+  }
+  Array<StringBuffer> lines;
+  lines_from_contents(Slice::create((char*)contents.items, contents.size), &lines, 0);
+  contents.free_shallow();
+  ParseResult pr = parse(lines, language_from_filename(file.string.slice));
+  int t0 = 0;
+  for (int y = 0; y < lines.size; ++y) {
+    int t1 = t0;
+    while (t1 < pr.tokens.size && pr.tokens[t1].a.y == y)
+      ++t1;
+    int a, b;
+    if (regex_find(regex, lines[y].slice, 0, view(pr.tokens.items + t0, t1 - t0), &a, &b))
+      grep_add_match(file, lines[y].slice, a, y, matches);
+    t0 = t1;
+  }
+  util_free(pr);
+  util_free(lines);
+}
+
+// Reads the file in large chunks, and searches the complete lines of each chunk.
+// buf is kept between files so that we don't have to allocate for each one
+static void grep_file(Path file, Slice literal, Regex *regex, Array<char> *buf, Array<GrepMatch> *matches) {
+  if (regex && regex->has_tokens) {
+    grep_file_tokens(file, regex, matches);
+    return;
+  }
+
+  FILE *f;
+  if (File::open(&f, file.string.chars, "rb"))
+    return;
+  buf->resize(GREP_CHUNK_SIZE);
+  int size = 0; // bytes in buf, the start of an unfinished line from the last chunk and the new chunk
+  int y = 0;
+  for (bool first = true;; first = false) {
+    // lines longer than a chunk make the buffer grow
+    if (size == buf->size)
+      buf->resize(buf->size*2);
+    int n = (int)fread(buf->items + size, 1, buf->size - size, f);
+    // binary files are skipped
+    if (first && memchr(buf->items, 0, at_most(n, 8000)))
+      break;
+    size += n;
+    const bool eof = n == 0;
+    if (eof && !size)
+      break;
+
+    // search the complete lines, and keep the rest for the next round
+    int end = size;
+    if (!eof) {
+      while (end > 0 && buf->items[end-1] != '\n')
+        --end;
+    }
+    grep_lines(file, Slice{buf->items, end}, y, literal, regex, matches);
+    if (eof)
+      break;
+    y += memcount(buf->items, end, '\n');
+    memmove(buf->items, buf->items + end, size - end);
+    size -= end;
+
+    if (grep_cancelled())
+      break;
+  }
+  fclose(f);
+}
+
+static void grep_thread(void*) {
+  Regex regex = {};
+  Slice literal = G.grep.query.slice;
+  if (literal[0] == '/') {
+    // the main thread has already checked that it compiles
+    StringBuffer error = {};
+    regex_compile(literal(1, -1), &regex, &error);
+    util_free(error);
+    literal = regex.prefix.slice;
+  }
+  Regex *r = regex.prog.size ? &regex : 0;
+
+  Array<char> buf = {};
+  Array<GrepMatch> matches = {};
+  for (;;) {
+    G.grep.mutex.lock();
+    if (G.grep.cancel || G.grep.next_file >= G.grep.files.size) {
+      --G.grep.num_running;
+      G.grep.mutex.unlock();
+      break;
+    }
+    Path p = G.grep.files[G.grep.next_file++];
+    G.grep.mutex.unlock();
+
+    matches.size = 0;
+    grep_file(p, literal, r, &buf, &matches);
+
+    G.grep.mutex.lock();
+    G.grep.results.push(matches.items, matches.size);
+    G.grep.num_matches += matches.size;
+    ++G.grep.num_searched;
+    if (G.grep.num_matches >= GREP_MAX_MATCHES)
+      G.grep.cancel = true;
+    G.grep.mutex.unlock();
+  }
+  buf.free_shallow();
+  matches.free_shallow();
+  util_free(regex);
+}
+
+// appends text to the end of a buffer, keeping the cursors of the panes that show it where they are
+static void buffer_append(BufferData &b, Slice text) {
+  Array<Cursor> prev = {};
+  for (Pane *p : G.editing_panes)
+    if (p->buffer.data == &b)
+      prev += p->buffer.cursors[0];
+  Array<Cursor> cursors = {};
+  b.insert(cursors, {b.lines.last().length, b.lines.size-1}, text, -1);
+
+  int prev_idx = 0;
+  for (Pane *p : G.editing_panes) {
+    if (p->buffer.data == &b) {
+      p->buffer.collapse_cursors();
+      p->buffer.cursors[0] = prev[prev_idx++];
+    }
+  }
+  util_free(prev);
+}
+
+// tells the grep threads to stop, and waits for them. The results found so far are kept
+static void grep_stop() {
+  if (!G.grep.active)
+    return;
+
+  G.grep.mutex.lock();
+  G.grep.cancel = true;
+  G.grep.mutex.unlock();
+  for (Thread &t : G.grep.threads)
+    t.join();
+  G.grep.threads.free_shallow();
+  G.grep.threads = {};
+  util_free(G.grep.results);
+  util_free(G.grep.mutex);
+  G.grep.active = false;
+  G.grep_buffer.description = Slice::create("[Grep Cancelled]");
+}
+
+// Picks the files that the grep threads will search. Once the trigram index is ready, it rules out the files that
+// don't have every trigram of the literal part of the query, so they are never opened
+static void grep_narrow(Slice literal) {
+  G.grep.files.size = 0;
+  const bool narrowed = G.trigram_index_ready && G.trigram_index.narrow(literal);
+  for (Path p : G.files) {
+    if (narrowed && !G.trigram_index.may_contain(p.string.slice)) {
+      // the index doesn't know about changes that are still waiting to be picked up
+      bool changed = false;
+      for (Path q : G.files_to_reindex)
+        changed |= p.string.slice.begins_with(q.string.slice);
+      if (!changed)
+        continue;
+    }
+    G.grep.files += p;
+  }
+}
+
+// Starts searching every file in the project for the query, cancelling the last search.
+// The matches are streamed into G.grep_buffer by grep_update
+static void grep_start(Slice query) {
+  grep_stop();
+  util_free(G.grep.query);
+  G.grep.query = String::create(query);
+  G.grep_buffer.init(false, Slice::create("[Grep]"));
+  G.grep_buffer.disable_undo();
+  for (Pane *p : G.editing_panes) {
+    if (p->buffer.data != &G.grep_buffer)
+      continue;
+    p->buffer.collapse_cursors();
+    p->buffer.cursors[0] = Cursor::create(Pos{});
+  }
+  if (!query.length || !G.files.size)
+    return;
+
+  Regex r = {};
+  Slice literal = query;
+  if (query[0] == '/') {
+    StringBuffer error = {};
+    bool ok = regex_compile(query(1, -1), &r, &error);
+    if (!ok)
+      status_message_set("bad regex: {}", (Slice)error.slice);
+    util_free(error);
+    if (!ok) {
+      util_free(r);
+      return;
+    }
+    literal = r.prefix.slice;
+  }
+  grep_narrow(literal);
+  util_free(r);
+  if (!G.grep.files.size) {
+    G.grep_buffer.description = Slice::create("[Grep Done]");
+    return;
+  }
+
+  int num_threads = clamp(Thread::num_cpus(), 1, G.grep.files.size);
+  G.grep.mutex.init();
+  G.grep.cancel = false;
+  G.grep.next_file = 0;
+  G.grep.num_running = num_threads;
+  G.grep.num_searched = 0;
+  G.grep.num_matches = 0;
+  G.grep.start_time = SDL_GetPerformanceCounter();
+  G.grep.active = true;
+  G.grep_buffer.description = Slice::create("[Grep Running..]");
+  for (int i = 0; i < num_threads; ++i) {
+    Thread t;
+    if (!Thread::create(&t, grep_thread, 0)) {
+      log_err("Failed to create grep thread\n");
+      G.grep.mutex.lock();
+      G.grep.num_running -= num_threads - i;
+      G.grep.mutex.unlock();
+      break;
+    }
+    G.grep.threads += t;
+  }
+
+  // no threads, so just do it here
+  if (!G.grep.threads.size) {
+    G.grep.num_running = 1;
+    grep_thread(0);
+  }
+}
+
+// moves the matches found by the grep threads into G.grep_buffer
+static void grep_update() {
+  if (!G.grep.active)
+    return;
 
-  for (Path f : files) {
-    if (File::filetype(f) == FILETYPE_DIR)
-      _filetree_fill(f);
-    else {
-      G.files += f.copy();
+  G.grep.mutex.lock();
+  Array<GrepMatch> results = G.grep.results;
+  G.grep.results = {};
+  int num_searched = G.grep.num_searched;
+  int num_matches = G.grep.num_matches;
+  bool done = G.grep.num_running == 0;
+  G.grep.mutex.unlock();
+
+  if (results.size) {
+    StringBuffer text = {};
+    const int root_length = G.current_working_directory.string.length + 1;
+    for (GrepMatch &m : results) {
+      text += m.file.string.slice(root_length, -1);
+      text.appendf(":%i:%i: ", m.pos.y+1, m.pos.x+1);
+      text += m.line.slice;
+      text += '\n';
     }
+    buffer_append(G.grep_buffer, text.slice);
+    util_free(text);
+
+    // fill up the dropdown, without moving the selection
+    if (G.mode == MODE_GREP && G.menu_pane.menu.suggestions.size < GREP_NUM_SUGGESTIONS) {
+      int current = G.menu_pane.menu.current_suggestion;
+      util_free(G.menu_pane.menu.suggestions);
+      G.menu_pane.menu.suggestions = G.menu_pane.menu.get_suggestions();
+      G.menu_pane.menu.current_suggestion = current;
+    }
+  }
+  util_free(results);
+
+  if (done) {
+    for (Thread &t : G.grep.threads)
+      t.join();
+    G.grep.threads.free_shallow();
+    G.grep.threads = {};
+    util_free(G.grep.mutex);
+    G.grep.active = false;
+    G.grep_buffer.description = Slice::create("[Grep Done]");
+    double seconds = (double)(SDL_GetPerformanceCounter() - G.grep.start_time) / (double)SDL_GetPerformanceFrequency();
+    log_info("Grep for %s found %i matches in %i files in %f seconds\n", G.grep.query.chars, num_matches, num_searched, seconds);
+    if (G.bottom_pane != &G.status_message_pane)
+      return;
+    if (num_matches >= GREP_MAX_MATCHES)
+      status_message_set("Stopped after %i matches", num_matches);
+    else
+      status_message_set("%i matches in %i files", num_matches, num_searched);
   }
+}
 
-  err:
-  util_free(files);
+// Opens the file of a grep result in the editing pane and moves to the match.
+// The line looks like path:line:column: text, with the path relative to the project root
+static bool grep_goto(Slice line) {
+  for (int i = 0; i < line.length; ++i) {
+    if (line[i] != ':')
+      continue;
+    int j = i+1, y = 0, x = 0;
+    for (; j < line.length && isdigit(line[j]); ++j)
+      y = y*10 + line[j] - '0';
+    if (j == i+1 || j == line.length || line[j] != ':')
+      continue;
+    int k = ++j;
+    for (; j < line.length && isdigit(line[j]); ++j)
+      x = x*10 + line[j] - '0';
+    if (j == k || j == line.length || line[j] != ':')
+      continue;
+
+    // the results pane is a subpane, so open it in the one below
+    if (G.editing_pane->buffer.data == &G.grep_buffer && G.editing_pane->parent)
+      G.editing_pane = G.selected_pane = G.editing_pane->parent;
+    Path path = G.current_working_directory.copy();
+    path.push(line(0, i));
+    bool success = open_buffer(path, false);
+    util_free(path);
+    if (!success)
+      return false;
+    BufferView &buffer = G.editing_pane->buffer;
+    buffer.jumplist_push();
+    buffer.move_to(at_least(x-1, 0), at_least(y-1, 0));
+    buffer.jumplist_push();
+    return true;
+  }
+  return false;
 }
 
-static bool lines_from_file(Slice filename, Array<StringBuffer> *result, const char **endline_string_result);
+static Path get_colorscheme_path();
 
 static void filetree_init() {
+  // the indexing and grep threads read G.files, so they must be stopped before we touch it
+  project_index_stop();
+  trigram_index_stop();
+  grep_stop();
+
   util_free(G.files);
-  _filetree_fill(G.current_working_directory);
+  util_free(G.files_to_reindex);
+  G.files_to_reindex_table.free_shallow();
+  G.files_to_reindex_table = {};
+  util_free(G.file_watcher);
+  G.file_watcher.init();
+  filetree_add(G.current_working_directory);
+
+  // the colorscheme and open buffers may live outside of the tree
+  Path p = get_colorscheme_path();
+  p.pop();
+  G.file_watcher.watch(p);
+  util_free(p);
+  for (BufferData *b : G.buffers) {
+    if (!b->is_bound_to_file())
+      continue;
+    p = Path::create(b->filename.slice);
+    p.pop();
+    G.file_watcher.watch(p);
+    util_free(p);
+  }
+
+  trigram_index_start();
 
   // parse tree
   util_free(G.project_definitions);
   util_free(G.project_definitions_to_file);
-  int num_indexed = 0;
-  for (Path p : G.files) {
-    Language l = language_from_filename(p.string.slice);
-    if (l == LANGUAGE_NULL)
-      continue;
+  G.project_definitions_fuzzy_cache.valid = false;
+  G.project_definitions_table_valid = false;
+  G.project_index.num_files = 0;
+  for (Path p : G.files)
+    if (language_from_filename(p.string.slice) != LANGUAGE_NULL)
+      ++G.project_index.num_files;
+  if (!G.project_index.num_files)
+    return;
 
-    Array<StringBuffer> lines;
-    if (!lines_from_file(p.string.slice, &lines, 0))
-      continue;
-    ParseResult pr = parse(lines, l);
-    for (Range r : pr.definitions)
-      G.project_definitions += lines[r.a.y](r.a.x, r.b.x).copy();
-    G.project_definitions_to_file += ProjectDefinitionToFile{G.project_definitions.size, p};
-    pr.definitions = {};
-    util_free(pr);
-    util_free(lines);
-    ++num_indexed;
+  G.project_index.root_length = G.current_working_directory.string.length + 1;
+  project_index_cache_load();
+
+  int num_threads = clamp(Thread::num_cpus(), 1, G.project_index.num_files);
+  G.project_index.mutex.init();
+  G.project_index.cancel = false;
+  G.project_index.next_file = 0;
+  G.project_index.num_running = num_threads;
+  G.project_index.num_indexed = 0;
+  G.project_index.num_parsed = 0;
+  G.project_index.num_stale = 0;
+  G.project_index.active = true;
+  for (int i = 0; i < num_threads; ++i) {
+    Thread t;
+    if (!Thread::create(&t, project_index_thread, 0)) {
+      log_err("Failed to create indexing thread\n");
+      G.project_index.mutex.lock();
+      G.project_index.num_running -= num_threads - i;
+      G.project_index.mutex.unlock();
+      break;
+    }
+    G.project_index.threads += t;
+  }
+
+  // no threads, so just do it here
+  if (!G.project_index.threads.size) {
+    G.project_index.num_running = 1;
+    project_index_thread(0);
   }
-  log_info("Indexed %i files, with %i definitions\n", num_indexed, G.project_definitions.size);
 }
 
 static void read_colorscheme_file(const char *path, bool quiet = true) {
@@ -634,6 +1879,57 @@ static Path get_colorscheme_path() {
   return p;
 }
 
+// picks up changes to files from the file watcher
+static void file_watcher_update() {
+  Array<Path> changed = {};
+  if (!G.file_watcher.poll(&changed)) {
+    // we don't know what changed, so look at the whole tree again, and at every open file
+    log_warn("The file watcher lost events, rescanning %s\n", G.current_working_directory.string.chars);
+    path_table_insert(G.files_to_reindex_table, G.files_to_reindex, G.current_working_directory.copy());
+    for (BufferData *b : G.buffers)
+      if (b->is_bound_to_file())
+        changed += Path::create(b->filename.slice);
+  }
+
+  Path colorscheme_path = get_colorscheme_path();
+  for (Path p : changed) {
+    if (p.string.slice == colorscheme_path.string.slice) {
+      read_colorscheme_file(colorscheme_path.string.chars, true);
+      continue;
+    }
+
+    // reload open buffers, unless they have changes that would be lost
+    for (BufferData *b : G.buffers) {
+      if (!b->is_bound_to_file() || b->filename.slice != p.string.slice || b->saving)
+        continue;
+      u64 modify_time, size;
+      if (!File::info(b->filename.chars, &modify_time, &size))
+        status_message_set("{} was removed", (Slice)b->name());
+      else if (modify_time == b->file_modify_time && size == b->file_size)
+        ; // we wrote it ourselves
+      else if (b->modified())
+        status_message_set("{} was changed on disk, but has unsaved changes. Use reload to discard them", (Slice)b->name());
+      else if (BufferData::reload(b))
+        status_message_set("Reloaded {}", (Slice)b->name());
+    }
+
+    // hidden files are not part of the tree
+    if (!p.string.slice.begins_with(G.current_working_directory.string.slice) || p.name()[0] == '.')
+      continue;
+    path_table_insert(G.files_to_reindex_table, G.files_to_reindex, p.copy());
+  }
+  util_free(colorscheme_path);
+  util_free(changed);
+
+  // the indexing, trigram and grep threads read G.files, so wait for them before touching it
+  if (G.project_index.active || G.trigram_build.active || G.grep.active || !G.files_to_reindex.size)
+    return;
+  project_index_changed();
+  util_free(G.files_to_reindex);
+  G.files_to_reindex_table.free_shallow();
+  G.files_to_reindex_table = {};
+}
+
 static void move_to_left_brace(const BufferView &buffer, char leftbrace, char rightbrace, Pos *pos) {
   Pos p = *pos;
   int depth = 0;
@@ -704,6 +2000,32 @@ static void move_to_right_brace(BufferView &buffer, char leftbrace, char rightbr
   }
 }
 
+// shows which of the matches of the current search the cursor is on
+static void search_status(BufferView &buffer) {
+  if (buffer.data->is_mapped())
+    return;
+  Array<Range> &matches = buffer.data->search_matches();
+  int i = buffer.data->search_match_lower_bound(buffer.cursors[0].pos);
+  if (i < matches.size && matches[i].a == buffer.cursors[0].pos)
+    status_message_set("match %i of %i", i+1, matches.size);
+}
+
+static bool search_next(BufferView &buffer, bool backwards) {
+  if (!buffer.data->is_mapped()) {
+    if (buffer.goto_search_match(backwards) < 0)
+      return false;
+    search_status(buffer);
+    return true;
+  }
+
+  // mapped buffers are too big to search all at once, so just look for the next one
+  if (G.search_regex.prog.size)
+    return backwards ? buffer.find_and_move_r(&G.search_regex, false) : buffer.find_and_move(&G.search_regex, false);
+  if (backwards)
+    return buffer.find_and_move_r(G.search_term, false) || buffer.find_and_move_r(G.search_buffer.lines[0].slice, false);
+  return buffer.find_and_move(G.search_term, false) || buffer.find_and_move(G.search_buffer.lines[0].slice, false);
+}
+
 static bool movement_default(BufferView &buffer, int key) {
   switch (key) {
     case 'b': {
@@ -765,29 +2087,14 @@ static bool movement_default(BufferView &buffer, int key) {
       break;}
 
     case 'n':
-      if (!G.search_term.size)
-        break;
-      G.search_term_background_color.reset();
-      buffer.jumplist_push();
-      if (!buffer.find_and_move(G.search_term, false)) {
-        if (!buffer.find_and_move(G.search_buffer.lines[0].slice, false)) {
-          status_message_set("not found");
-          break;
-        }
-      }
-      buffer.jumplist_push();
-      break;
-
     case 'N':
-      if (!G.search_term.size)
+      if (!G.search_regex.prog.size && !G.search_term.size)
         break;
       G.search_term_background_color.reset();
       buffer.jumplist_push();
-      if (!buffer.find_and_move_r(G.search_term, false)) {
-        if (!buffer.find_and_move_r(G.search_buffer.lines[0].slice, false)) {
-          status_message_set("not found");
-          break;
-        }
+      if (!search_next(buffer, key == 'N')) {
+        status_message_set("not found");
+        break;
       }
       buffer.jumplist_push();
       break;
@@ -885,6 +2192,8 @@ static bool movement_default(BufferView &buffer, int key) {
       G.search_term_background_color.reset();
       G.search_pane.buffer.empty();
       G.search_pane.buffer.insert(t->str);
+      util_free(G.search_regex);
+      ++G.search_generation;
       buffer.find_and_move(G.search_term, false);
       break;}
 
@@ -897,6 +2206,8 @@ static bool movement_default(BufferView &buffer, int key) {
       G.search_term_background_color.reset();
       G.search_pane.buffer.empty();
       G.search_pane.buffer.insert(t->str);
+      util_free(G.search_regex);
+      ++G.search_generation;
       buffer.find_and_move_r(G.search_term, false);
       break;}
 
@@ -919,12 +2230,15 @@ static bool movement_default(BufferView &buffer, int key) {
 static void mode_cleanup() {
   G.flags.cursor_dirty = true;
 
-  if (G.mode == MODE_FILESEARCH || G.mode == MODE_CWD)
+  if (G.mode == MODE_FILESEARCH || G.mode == MODE_CWD || G.mode == MODE_GREP)
     G.menu_pane.buffer.empty();
 
   if (G.mode == MODE_GOTO_DEFINITION)
     util_free(G.definition_positions);
 
+  if (G.mode == MODE_GOTO_ALL_DEFINITIONS)
+    util_free(G.project_definition_matches);
+
   if (G.mode == MODE_INSERT)
     G.editing_pane->buffer.action_end();
 }
@@ -950,6 +2264,8 @@ static void mode_search() {
   G.search_pane.menu_init(Slice::create("search"), get_search_suggestions);
   G.search_buffer.language = G.editing_pane->buffer.data->language;
   util_free(G.search_term);
+  util_free(G.search_regex);
+  ++G.search_generation;
 
   G.search_pane.buffer.empty();
 }
@@ -1048,19 +2364,25 @@ static void mode_prompt(Slice msg, void (*callback)(void), PromptType type) {
 
 static Array<String> get_goto_definition_suggestions() {
   BufferData &b = *G.editing_pane->buffer.data;
-  Array<Slice> defs = {};
-  defs.reserve(b.parser.definitions.size);
-  for (Range r : b.parser.definitions)
-    defs += b.getslice(r);
+  if (!b.definitions_fuzzy_cache.valid) {
+    Array<Slice> defs = {};
+    defs.reserve(b.parser.definitions.size);
+    for (Range r : b.parser.definitions)
+      defs += b.getslice(r);
+    fuzzy_cache_init(&b.definitions_fuzzy_cache, view(defs));
+    defs.free_shallow();
+  }
 
-  Array<int> matches;
-  easy_fuzzy_match(G.menu_buffer.lines[0].slice, view(defs), false, &matches);
-  util_free(defs);
+  StackArray<FuzzyMatch, 15> matches = {};
+  int n = fuzzy_match(G.menu_buffer.lines[0].slice, &b.definitions_fuzzy_cache, view(matches), false);
 
   Array<String> result = {};
-  for (int i : matches) {
+  G.definition_positions.size = 0;
+  for (int i = 0; i < n; ++i) {
+    Range start = b.parser.definitions[matches[i].idx];
+    G.definition_positions += start.a;
+
     // find entire function definition
-    Range start = b.parser.definitions[i];
     TokenInfo *t = b.gettoken(start.b);
     if (t->token != '(') {
       result += b.get_merged_range(start);
@@ -1080,12 +2402,6 @@ static Array<String> get_goto_definition_suggestions() {
     }
     result += b.get_merged_range({start.a, t->b});
   }
-
-  G.definition_positions.size = 0;
-  for (int i : matches)
-    G.definition_positions += b.parser.definitions[i].a;
-
-  util_free(matches);
   return result;
 }
 
@@ -1093,19 +2409,17 @@ static Array<String> get_goto_all_definitions_suggestions() {
   if (!G.project_definitions_to_file.size)
     return {};
 
+  if (!G.project_definitions_fuzzy_cache.valid)
+    fuzzy_cache_init(&G.project_definitions_fuzzy_cache, VIEW(G.project_definitions, slice));
+
   StackArray<FuzzyMatch, 15> matches = {};
-  int n = fuzzy_match(G.menu_buffer.lines[0].slice, VIEW(G.project_definitions, slice), view(matches), false);
+  int n = fuzzy_match(G.menu_buffer.lines[0].slice, &G.project_definitions_fuzzy_cache, view(matches), false);
   Array<String> result = {};
+  G.project_definition_matches.size = 0;
   for (int i = 0; i < n; ++i) {
-    // find the corresponding filename
-    Path path = G.project_definitions_to_file[G.project_definitions_to_file.size-1].file;
-    for (int j = 0; j < G.project_definitions_to_file.size-1; ++j) {
-      if (G.project_definitions_to_file[j].end_idx > matches[i].idx) {
-        path = G.project_definitions_to_file[j].file;
-        break;
-      }
-    }
+    Path path = project_definition_file(matches[i].idx);
     result += String::createf("{}    [{}]", (Slice)matches[i].str, (Slice)path.name());
+    G.project_definition_matches += matches[i].idx;
   }
   return result;
 }
@@ -1120,8 +2434,6 @@ static void mode_goto_all_definitions() {
 
   G.menu_pane.menu_init(Slice::create("goto def"), get_goto_all_definitions_suggestions);
   G.menu_pane.update_suggestions();
-  if (G.definition_positions.size)
-    G.editing_pane->buffer.move_to(G.definition_positions[0]);
 }
 
 static void mode_goto_definition() {
@@ -1138,21 +2450,71 @@ static void mode_goto_definition() {
     G.editing_pane->buffer.move_to(G.definition_positions[0]);
 }
 
+static Array<String> get_history_suggestions() {
+  BufferData &b = *G.editing_pane->buffer.data;
+  Array<UndoState> states = {};
+  Array<String> labels = {};
+  b.undo_list_states(&states, &labels);
+
+  G.history_states.size = 0;
+  if (!G.menu_buffer[0].length) {
+    G.history_states.push(states.items, states.size);
+    states.free_shallow();
+    return labels;
+  }
+
+  Array<int> matches;
+  easy_fuzzy_match(G.menu_buffer[0].slice, VIEW(labels, slice), false, &matches);
+  Array<String> result = {};
+  for (int i : matches) {
+    result += String::create(labels[i].slice);
+    G.history_states += states[i];
+  }
+  util_free(matches);
+  util_free(labels);
+  states.free_shallow();
+  return result;
+}
+
+// goes to a state in the history browser, and keeps the states of the browser pointing to the same places
+static void history_goto(UndoState s) {
+  G.history_states += G.history_begin_state;
+  G.editing_pane->buffer.undo_goto(s, &G.history_states);
+  G.history_begin_state = G.history_states.last();
+  --G.history_states.size;
+}
+
+static void mode_history() {
+  mode_cleanup();
+  G.mode = MODE_HISTORY;
+  G.selected_pane = &G.menu_pane;
+  G.history_begin_state = G.editing_pane->buffer.data->undo_state();
+
+  G.menu_pane.menu_init(Slice::create("history"), get_history_suggestions);
+  G.menu_pane.update_suggestions();
+  for (int i = 0; i < G.history_states.size; ++i)
+    if (G.history_states[i].branch == -1 && G.history_states[i].group == G.history_begin_state.group)
+      G.menu_pane.menu.current_suggestion = i;
+}
+
 static Array<String> get_filesearch_suggestions() {
-  Array<Slice> filenames = {};
-  filenames.reserve(G.files.size);
-  for (Path p : G.files)
-    filenames += p.name();
-  Array<int> match;
-  easy_fuzzy_match(G.menu_buffer.lines[0].slice, view(filenames), false, &match);
-  util_free(filenames);
+  if (!G.files_fuzzy_cache.valid) {
+    Array<Slice> filenames = {};
+    filenames.reserve(G.files.size);
+    for (Path p : G.files)
+      filenames += p.name();
+    fuzzy_cache_init(&G.files_fuzzy_cache, view(filenames));
+    filenames.free_shallow();
+  }
+
+  StackArray<FuzzyMatch, 15> matches = {};
+  int n = fuzzy_match(G.menu_buffer.lines[0].slice, &G.files_fuzzy_cache, view(matches), false);
 
   Array<String> result = {};
-  result.reserve(match.size);
-  for (int i : match)
-    result += String::create(G.files[i].string.slice(G.current_working_directory.string.length+1, -1));
+  result.reserve(n);
+  for (int i = 0; i < n; ++i)
+    result += String::create(G.files[matches[i].idx].string.slice(G.current_working_directory.string.length+1, -1));
 
-  util_free(match);
   return result;
 }
 
@@ -1164,6 +2526,27 @@ static void mode_filesearch() {
   G.menu_pane.update_suggestions();
 }
 
+static Array<String> get_grep_suggestions() {
+  Array<String> result = {};
+  for (int y = 0; y < G.grep_buffer.lines.size && result.size < GREP_NUM_SUGGESTIONS; ++y)
+    if (G.grep_buffer.lines[y].length)
+      result += String::create(G.grep_buffer.lines[y].slice);
+  return result;
+}
+
+static void mode_grep() {
+  mode_cleanup();
+  G.mode = MODE_GREP;
+  G.selected_pane = &G.menu_pane;
+  G.menu_pane.menu_init(Slice::create("grep"), get_grep_suggestions);
+  G.menu_pane.update_suggestions();
+
+  bool exists;
+  ARRAY_EXISTS(G.editing_panes, &exists, it->buffer.data == &G.grep_buffer);
+  if (!exists)
+    G.editing_pane->add_subpane(&G.grep_buffer, {});
+}
+
 static void mode_yank() {
   mode_cleanup();
   G.mode = MODE_YANK;
@@ -1195,7 +2578,10 @@ static void mode_insert() {
 
   G.editing_pane->buffer.action_begin();
 
-  status_message_set("insert");
+  if (G.editing_pane->buffer.data->is_mapped())
+    status_message_set("{} is too big to be changed", (Slice)G.editing_pane->buffer.data->name());
+  else
+    status_message_set("insert");
 }
 
 static Array<String> get_menu_suggestions();
@@ -1207,6 +2593,38 @@ static void mode_menu() {
   G.menu_pane.update_suggestions();
 }
 
+// asks about each file that had unsaved changes when the last session ended
+static void recover_unsaved_files() {
+  COROUTINE_BEGIN;
+
+  while (G.files_to_recover.size) {
+    {
+      static String message;
+      util_free(message);
+      message = String::createf("{} has unsaved changes from the last session. Recover them? [y/n]", (Slice)G.files_to_recover.last().string.slice);
+      mode_prompt(message.slice, recover_unsaved_files, PROMPT_BOOLEAN);
+    }
+    yield(check_prompt_result);
+
+    // if the prompt was cancelled we leave the rest of the journals alone
+    if (!G.prompt_success)
+      break;
+    {
+      Path path = G.files_to_recover.last();
+      --G.files_to_recover.size;
+      if (G.prompt_result.boolean)
+        open_buffer(path, true);
+      else
+        journal_discard_unsaved(path.string.slice);
+      util_free(path);
+    }
+  }
+
+  util_free(G.files_to_recover);
+  mode_normal();
+  COROUTINE_END;
+}
+
 static void state_init() {
   srand((uint)time(NULL));
   rand(); rand(); rand();
@@ -1238,6 +2656,7 @@ static void state_init() {
   G.font_width = graphics_get_font_advance(G.font_height);
   G.tab_width = 4;
   G.default_tab_type = 4;
+  G.undo_budget = 16*1024*1024;
   G.line_margin = 0;
   G.line_height = G.font_height + G.line_margin;
 
@@ -1301,69 +2720,600 @@ static void state_init() {
   G.search_term_background_color.min = 0.4f;
   G.search_term_background_color.max = 1.0f;
 
-  // @panes
+  // @panes
+
+  // default buffer, and initial pane
+  G.null_buffer.init(false, Slice::create("[Scratch]"));
+  G.buffers += &G.null_buffer;
+  Pane *main_pane = new Pane{};
+  Pane::init_edit(*main_pane, &G.null_buffer, &G.color_scheme.background, &G.color_scheme.syntax_text, &G.active_highlight_background_color.color, &G.color_scheme.line_highlight_inactive, true);
+
+  G.build_result_buffer.init(false, Slice::create("[Build Result]"));
+  G.build_result_buffer.disable_undo();
+  G.buffers += &G.build_result_buffer;
+
+  G.grep_buffer.init(false, Slice::create("[Grep]"));
+  G.grep_buffer.disable_undo();
+  G.buffers += &G.grep_buffer;
+
+  // menu pane
+  G.menu_pane.type = PANETYPE_MENU;
+  G.menu_pane.buffer = BufferView::create(&G.menu_buffer);
+  G.menu_pane.buffer.empty();
+  G.menu_pane.background_color = &G.bottom_pane_color.color;
+  G.menu_pane.text_color = &G.color_scheme.syntax_text;
+  G.menu_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
+  G.menu_pane.margin = 5;
+  G.menu_buffer.disable_undo();
+
+  // search pane
+  G.search_pane.type = PANETYPE_MENU;
+  G.search_pane.buffer = BufferView::create(&G.search_buffer);
+  G.search_pane.buffer.empty();
+  G.search_pane.background_color = &G.bottom_pane_color.color;
+  G.search_pane.text_color = &G.color_scheme.syntax_text;
+  G.search_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
+  G.search_pane.margin = 5;
+  G.search_buffer.disable_undo();
+
+  // dropdown pane
+  G.dropdown_pane.type = PANETYPE_DROPDOWN;
+  G.dropdown_pane.buffer = BufferView::create(&G.dropdown_buffer);
+  G.dropdown_pane.buffer.empty();
+  G.dropdown_pane.background_color = &G.color_scheme.autocomplete_background;
+  G.dropdown_pane.text_color = &G.color_scheme.syntax_text;
+  G.dropdown_pane.margin = 5;
+  G.dropdown_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
+
+  // status message pane
+  G.status_message_pane.type = PANETYPE_STATUSMESSAGE;
+  G.status_message_pane.buffer = BufferView::create(&G.status_message_buffer);
+  G.status_message_pane.buffer.empty();
+  G.status_message_pane.background_color = &G.bottom_pane_color.color;
+  G.status_message_pane.text_color = &G.color_scheme.syntax_text;
+  G.status_message_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
+  G.status_message_pane.margin = 5;
+  G.status_message_pane.menu.prefix = Slice::create("status");
+
+  G.editing_pane = main_pane;
+  G.bottom_pane = &G.status_message_pane;
+  G.selected_pane = main_pane;
+  G.editing_pane = main_pane;
+
+  G.editing_panes += main_pane;
+
+  filetree_init();
+  status_message_set("Welcome!");
+
+  G.saves.mutex.init();
+
+  journal_init();
+  journal_find_unsaved(&G.files_to_recover);
+  if (G.files_to_recover.size)
+    recover_unsaved_files();
+}
+
+static Stream test_async_command_output;
+// an incremental parse after changing a line has to find the same tokens and definitions as a full parse
+static void test_parse_incremental() {
+  const char *text[] = {
+    "static int",
+    "foo(int a,",
+    "    int b,",
+    "    int c)",
+    "{",
+    "  return a;",
+    "}",
+    "",
+    "int bar(int a) { return a; }",
+  };
+  struct {int y; const char *line;} edits[] = {
+    {1, "fooo(int a,"}, // the '{' is further down than the context lines
+    {0, "static long"},
+    {3, "    int cc)"}, // the return type is further up
+    {4, ""},
+    {5, "  return b;"},
+    {7, "void baz(void) {}"},
+  };
+  for (auto edit : edits) {
+    Array<StringBuffer> lines = {};
+    for (const char *s : text)
+      lines += StringBuffer::create(s);
+    ParseResult p = parse(lines, LANGUAGE_C);
+    lines[edit.y].clear();
+    lines[edit.y] += Slice::create(edit.line);
+    assert(parse_incremental(p, lines, LANGUAGE_C, edit.y, edit.y, edit.y));
+
+    ParseResult full = parse(lines, LANGUAGE_C);
+    assert(p.tokens.size == full.tokens.size);
+    for (int i = 0; i < p.tokens.size; ++i)
+      assert(p.tokens[i].token == full.tokens[i].token && p.tokens[i].a == full.tokens[i].a && p.tokens[i].b == full.tokens[i].b);
+    assert(p.definitions.size == full.definitions.size);
+    for (int i = 0; i < p.definitions.size; ++i)
+      assert(p.definitions[i].a == full.definitions[i].a && p.definitions[i].b == full.definitions[i].b);
+    util_free(full);
+    util_free(p);
+    util_free(lines);
+  }
+}
+
+static String test_buffer_text(BufferData &b) {
+  String s;
+  lines_to_contents(b.lines, "\n", &s);
+  return s;
+}
+
+// a random change to the text, at two random cursors
+static void test_undo_edit(BufferData &b, Array<Cursor> &cursors) {
+  for (Cursor &c : cursors) {
+    int y = rand() % b.lines.size;
+    c = Cursor::create(rand() % (b.lines[y].length + 1), y);
+  }
+  if (cursors[0].pos == cursors[1].pos)
+    cursors[1] = Cursor::create(0, (cursors[0].y + 1) % b.lines.size);
+
+  Pos a = cursors[0].pos, e = a;
+  e.x = at_most(a.x + 3, b.lines[a.y].length);
+  if (rand() % 4 == 0 && a.y+1 < b.lines.size)
+    e = {0, a.y+1};
+
+  switch (rand() % 4) {
+    case 0:
+      // typing, which is merged into one insert per cursor
+      b.action_begin(cursors);
+      for (int i = rand() % 20; i >= 0; --i)
+        b.insert(cursors, Utf8char::create('a' + rand() % 26));
+      b.action_end(cursors);
+      break;
+    case 1: {
+      // big enough that checkpoints of the text are made
+      StringBuffer s = {};
+      for (int i = 0; i < 100; ++i)
+        s += Slice::create("some text\n");
+      b.insert(cursors, a, s.slice, 0);
+      util_free(s);
+      break;
+    }
+    case 2:
+      if (a != e) {
+        b.remove_range(cursors, a, e);
+        break;
+      }
+      // fallthrough
+    default:
+      b.insert(cursors, Slice::create("x\ny"));
+      break;
+  }
+  // the paste highlights would have faded out by the next change
+  b.highlights.size = 0;
+}
+
+// Random edits, undos, redos and jumps around the undo tree, checked against the text that each state had.
+// The budgets are small enough that the history gets compressed and forgotten
+static void test_undo() {
+  const long undo_budget = G.undo_budget;
+  const long budgets[] = {2*1024, 8*1024, 64*1024, 1024*1024};
+  for (long budget : budgets) {
+    G.undo_budget = budget;
+    srand((uint)budget);
+    BufferData b = {};
+    b.init(false);
+    for (int i = 0; i < 20; ++i)
+      b.lines += StringBuffer::createf("line %i", i);
+    Array<Cursor> cursors = {};
+    cursors += Cursor{};
+    cursors += Cursor{};
+
+    // a straight line of changes, and back
+    Array<String> texts = {};
+    texts += test_buffer_text(b);
+    int save = -1;
+    for (int i = 0; i < 100; ++i) {
+      test_undo_edit(b, cursors);
+      texts += test_buffer_text(b);
+      if (i == 80) {
+        b._last_save_undo_action = b._next_undo_action;
+        save = texts.size-1;
+      }
+    }
+    assert(b.undo_memory() <= budget || (!b._undo_blocks.size && !b._undo_branches.size));
+    assert(budget > 8*1024 || b._undo_blocks.size || b._undo_first_group);
+    int n = texts.size-1;
+    for (;; --n) {
+      String text = test_buffer_text(b);
+      assert(text.slice == texts[n].slice);
+      assert((b._next_undo_action == b._last_save_undo_action) == (n == save));
+      util_free(text);
+      if (!n)
+        break;
+      b.undo(cursors);
+      text = test_buffer_text(b);
+      bool forgotten = text.slice == texts[n].slice;
+      util_free(text);
+      if (forgotten)
+        break;
+    }
+    assert(budget < 1024*1024 || n == 0);
+    for (; n < texts.size-1; ++n) {
+      b.redo(cursors);
+      String text = test_buffer_text(b);
+      assert(text.slice == texts[n+1].slice);
+      util_free(text);
+    }
+
+    // branch off in random places, then go to the states of the tree in one order, and back in the other
+    for (int i = 0; i < 60; ++i) {
+      int r = rand() % 4;
+      if (r == 0)
+        for (int j = rand() % 4; j >= 0; --j)
+          b.undo(cursors);
+      else if (r == 1)
+        b.redo(cursors);
+      else
+        test_undo_edit(b, cursors);
+    }
+    Array<UndoState> states = {};
+    Array<String> labels = {};
+    b.undo_list_states(&states, &labels);
+    util_free(labels);
+    for (int i = 0; i < states.size; ++i)
+      if (rand() % 4)
+        states.remove_slow(i--);
+    // the last one is where we are now
+    states += b.undo_state();
+    String now = test_buffer_text(b);
+    Array<String> seen = {};
+    for (int i = 0; i < states.size; ++i) {
+      b.undo_goto(cursors, states[i], &states);
+      seen += test_buffer_text(b);
+    }
+    assert(seen.last().slice == now.slice);
+    for (int i = states.size-1; i >= 0; --i) {
+      b.undo_goto(cursors, states[i], &states);
+      String text = test_buffer_text(b);
+      assert(text.slice == seen[i].slice);
+      util_free(text);
+    }
+
+    util_free(now);
+    util_free(seen);
+    states.free_shallow();
+    util_free(texts);
+    util_free(cursors);
+    util_free(b);
+  }
+  G.undo_budget = undo_budget;
+}
+
+// The line index is patched on each edit, so it should agree with a walk over the lines. It's only rebuilt when the whole text is replaced
+static void test_line_index_check(BufferData &b) {
+  assert(!b._line_blocks.size || b._line_index_lines == b.lines.size);
+  // a few hundred of the lines, since every one of them would be slow on big buffers
+  const int step = at_least(b.lines.size / 300, 1);
+  i64 offset = 0;
+  for (int y = 0; y < b.lines.size; ++y) {
+    const int x = b.lines[y].length / 2;
+    if (y % step == 0 || y == b.lines.size-1) {
+      assert(b.offset_of({x, y}) == offset + x);
+      assert((b.pos_of(offset + x) == Pos{x, y}));
+      assert((b.pos_of(offset + b.lines[y].length) == Pos{b.lines[y].length, y}));
+    }
+    offset += b.lines[y].length + 1;
+  }
+  assert(b.total_bytes() == offset - 1);
+  assert((b.pos_of(offset + 10) == Pos{b.lines.last().length, b.lines.size-1}));
+}
+
+static void test_line_index() {
+  srand(3);
+  BufferData b = {};
+  b.init(false);
+  for (int i = 0; i < 3000; ++i)
+    b.lines += StringBuffer::createf("line %i", i);
+  b.offset_of({});
+  Array<Cursor> cursors = {};
+  cursors += Cursor{};
+  cursors += Cursor{};
+  StringBuffer big = {};
+  for (int i = 0; i < 1500; ++i)
+    big += Slice::create("big\n");
+  for (int i = 0; i < 100; ++i) {
+    const int y = rand() % b.lines.size;
+    switch (rand() % 6) {
+      case 0:
+        b.undo(cursors);
+        break;
+      case 1:
+        // enough lines in one place that the block has to be split
+        b.insert(cursors, Pos{0, y}, big.slice, 0);
+        break;
+      case 2:
+        // and enough removed that blocks are emptied, or have to be merged
+        b.remove_range(cursors, Pos{0, y}, Pos{0, at_most(y + rand() % 1500, b.lines.size-1)});
+        break;
+      case 3:
+        // newlines at two cursors at once
+        cursors[0] = Cursor::create(0, y);
+        cursors[1] = Cursor::create(0, (y + 1 + rand() % 100) % b.lines.size);
+        b.insert(cursors, Slice::create("a\nbc\n"));
+        break;
+      default:
+        test_undo_edit(b, cursors);
+        break;
+    }
+    b.highlights.size = 0;
+    if (i % 10 == 0)
+      test_line_index_check(b);
+  }
+  test_line_index_check(b);
+  util_free(big);
+  util_free(b);
+  cursors.free_shallow();
+}
+
+// Finds pattern in a line of C, with the tokens the parser gives that line. m gets the match, and then group 1
+static bool test_regex_tokens(const char *pattern, const char *line, int m[4]) {
+  Regex r = {};
+  assert(regex_compile(Slice::create(pattern), &r, 0));
+  Array<StringBuffer> lines = {};
+  lines += StringBuffer::create(Slice::create(line));
+  ParseResult p = parse(lines, LANGUAGE_C);
+  int n = 0;
+  while (n < p.tokens.size && p.tokens[n].a.y == 0)
+    ++n;
+  bool found = regex_find(&r, lines[0].slice, 0, view(p.tokens.items, n), &m[0], &m[1]);
+  if (found) {
+    m[2] = r.num_groups > 1 ? r.groups[2] : -1;
+    m[3] = r.num_groups > 1 ? r.groups[3] : -1;
+  }
+  util_free(p);
+  util_free(lines);
+  util_free(r);
+  return found;
+}
 
-  // default buffer, and initial pane
-  G.null_buffer.init(false, Slice::create("[Scratch]"));
-  G.buffers += &G.null_buffer;
-  Pane *main_pane = new Pane{};
-  Pane::init_edit(*main_pane, &G.null_buffer, &G.color_scheme.background, &G.color_scheme.syntax_text, &G.active_highlight_background_color.color, &G.color_scheme.line_highlight_inactive, true);
+// The search matches are patched on each edit instead of found again, so they should be the same as a search of every line
+static void test_search_check(BufferData &b) {
+  Array<Range> &matches = b.search_matches();
+  Array<Range> all = {};
+  for (int y = 0; y < b.lines.size; ++y)
+    b._search_line(y, &all);
+  assert(matches.size == all.size);
+  for (int i = 0; i < all.size; ++i)
+    assert(matches[i].a == all[i].a && matches[i].b == all[i].b);
+  all.free_shallow();
+}
 
-  G.build_result_buffer.init(false, Slice::create("[Build Result]"));
-  G.build_result_buffer.disable_undo();
-  G.buffers += &G.build_result_buffer;
+static void test_search() {
+  util_free(G.search_regex);
+  util_free(G.search_term);
+  assert(regex_compile(Slice::create("e+x?t"), &G.search_regex, 0));
+  // first a regex search, then a token search
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      util_free(G.search_regex);
+      G.search_pane.buffer.empty();
+      G.search_pane.buffer.insert(Slice::create("text"));
+      G.search_term = G.search_buffer.parser.tokens;
+      G.search_buffer.parser.tokens = {};
+      --G.search_term.size;
+    }
+    ++G.search_generation;
+    srand(pass);
+    BufferData b = {};
+    b.init(false);
+    Array<Cursor> cursors = {};
+    cursors += Cursor{};
+    for (int i = 0; i < 20; ++i)
+      b.insert(cursors, Slice::create("a line of text\n"));
+    cursors += Cursor{};
+    for (int i = 0; i < 100; ++i) {
+      if (rand() % 4 == 0)
+        b.undo(cursors);
+      else {
+        test_undo_edit(b, cursors);
+        // the same text on both cursors' lines
+        if (rand() % 2)
+          b.insert(cursors, Slice::create("ext"));
+      }
+      if (i % 4 == 0)
+        test_search_check(b);
+    }
+    test_search_check(b);
+    util_free(b);
+    cursors.free_shallow();
+  }
+  util_free(G.search_term);
+  G.search_pane.buffer.empty();
+  ++G.search_generation;
+}
 
-  // menu pane
-  G.menu_pane.type = PANETYPE_MENU;
-  G.menu_pane.buffer = BufferView::create(&G.menu_buffer);
-  G.menu_pane.buffer.empty();
-  G.menu_pane.background_color = &G.bottom_pane_color.color;
-  G.menu_pane.text_color = &G.color_scheme.syntax_text;
-  G.menu_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
-  G.menu_pane.margin = 5;
-  G.menu_buffer.disable_undo();
+// Random files and queries over a few letters, so that most queries are in some of the files but not the others.
+// The index may keep a file that doesn't have the query, but never drop one that does
+static void test_trigram() {
+  const int num_paths = 50;
+  StringBuffer contents[num_paths] = {};
+  TrigramIndex t = {};
+  Array<u32> trigrams = {};
+  Array<u64> bits = {};
+  char path[16];
+  int dropped = 0;
+  srand(1);
+  for (int round = 0; round < 60; ++round) {
+    // replacing a file leaves a dead id behind, until there are enough of them to compact
+    for (int i = 0; i < num_paths; ++i) {
+      const int f = rand() % num_paths;
+      contents[f].clear();
+      for (int n = rand() % 200; n > 0; --n)
+        contents[f] += (char)(rand() % 8 ? 'a' + rand() % 6 : '\n');
+      snprintf(path, sizeof(path), "f%i", f);
+      trigrams.size = 0;
+      trigram_extract(contents[f].chars, contents[f].length, &trigrams, &bits);
+      t.add(Slice::create(path), f % 10 != 0, view(trigrams));
+    }
+    assert(t.files.size - t.num_live <= at_least(t.num_live, 1024));
+
+    char query[8];
+    const int len = 3 + rand() % 4;
+    for (int i = 0; i < len; ++i)
+      query[i] = 'a' + rand() % 6;
+    assert(t.narrow(Slice{query, len}));
+    for (int f = 0; f < num_paths; ++f) {
+      snprintf(path, sizeof(path), "f%i", f);
+      int x;
+      if (contents[f].slice.find(0, Slice{query, len}, &x) || f % 10 == 0)
+        assert(t.may_contain(Slice::create(path)));
+      else if (!t.may_contain(Slice::create(path)))
+        ++dropped;
+    }
+  }
+  assert(dropped > 0);
+  assert(!t.narrow(Slice::create("ab")));
+  assert(t.narrow(Slice::create("abc")));
+  t.remove(Slice::create("f1"));
+  assert(t.may_contain(Slice::create("f1")));
+
+  util_free(t);
+  trigrams.free_shallow();
+  bits.free_shallow();
+  for (StringBuffer &s : contents)
+    util_free(s);
+}
 
-  // search pane
-  G.search_pane.type = PANETYPE_MENU;
-  G.search_pane.buffer = BufferView::create(&G.search_buffer);
-  G.search_pane.buffer.empty();
-  G.search_pane.background_color = &G.bottom_pane_color.color;
-  G.search_pane.text_color = &G.color_scheme.syntax_text;
-  G.search_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
-  G.search_pane.margin = 5;
-  G.search_buffer.disable_undo();
+static Path test_dir_create() {
+  Path dir = File::temp_dir();
+  char name[64];
+  snprintf(name, sizeof(name), "cmantic_test_%llu", (unsigned long long)SDL_GetPerformanceCounter());
+  dir.push(name);
+  assert(File::make_dir(dir));
+  return dir;
+}
 
-  // dropdown pane
-  G.dropdown_pane.type = PANETYPE_DROPDOWN;
-  G.dropdown_pane.buffer = BufferView::create(&G.dropdown_buffer);
-  G.dropdown_pane.buffer.empty();
-  G.dropdown_pane.background_color = &G.color_scheme.autocomplete_background;
-  G.dropdown_pane.text_color = &G.color_scheme.syntax_text;
-  G.dropdown_pane.margin = 5;
-  G.dropdown_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
+static void test_dir_remove(Path dir) {
+  Array<Path> files;
+  if (File::list_files(dir, &files)) {
+    for (Path &p : files)
+      File::remove(p.string.chars);
+    util_free(files);
+  }
+  File::remove(dir.string.chars);
+  util_free(dir);
+}
 
-  // status message pane
-  G.status_message_pane.type = PANETYPE_STATUSMESSAGE;
-  G.status_message_pane.buffer = BufferView::create(&G.status_message_buffer);
-  G.status_message_pane.buffer.empty();
-  G.status_message_pane.background_color = &G.bottom_pane_color.color;
-  G.status_message_pane.text_color = &G.color_scheme.syntax_text;
-  G.status_message_pane.active_highlight_background_color = &G.color_scheme.autocomplete_highlight;
-  G.status_message_pane.margin = 5;
-  G.status_message_pane.menu.prefix = Slice::create("status");
+// waits for the journal thread to be done with the closed journals
+static void test_journal_wait() {
+  for (bool busy = true; busy;) {
+    G.journal.mutex.lock();
+    busy = false;
+    for (Journal *j : G.journal.journals)
+      busy |= j->closed;
+    G.journal.mutex.unlock();
+  }
+}
 
-  G.editing_pane = main_pane;
-  G.bottom_pane = &G.status_message_pane;
-  G.selected_pane = main_pane;
-  G.editing_pane = main_pane;
+static void test_journal() {
+  if (!G.journal.active)
+    return;
+  Path dir = test_dir_create();
+  Path journal_dir = G.journal.dir;
+  G.journal.dir = dir.copy();
+
+  // edits that come in while the file is being saved are replayed on top of what was saved
+  for (int open_group = 0; open_group < 2; ++open_group) {
+    Path file = dir.copy();
+    file.push(open_group ? "b.txt" : "a.txt");
+    assert(contents_to_file(file.string.slice, Slice::create("a\nb\n")));
+    BufferData b = {};
+    assert(BufferData::from_file(file.string.slice, &b));
+    journal_open(b, false);
+    Array<Cursor> cursors = {};
+    cursors += Cursor{};
+    if (open_group)
+      b.action_begin(cursors);
+    b.insert(cursors, Slice::create("x"));
+    save_buffer(&b);
+    b.insert(cursors, Slice::create("y"));
+    save_wait_all();
+    if (open_group)
+      b.action_end(cursors);
+    String text = test_buffer_text(b);
+    util_free(b);
+    test_journal_wait();
+
+    Array<Path> unsaved = {};
+    journal_find_unsaved(&unsaved);
+    bool found = false;
+    for (Path &p : unsaved)
+      found |= p.string.slice == file.string.slice;
+    assert(found);
+    util_free(unsaved);
+
+    b = {};
+    assert(BufferData::from_file(file.string.slice, &b));
+    journal_open(b, true);
+    String recovered = test_buffer_text(b);
+    assert(recovered.slice == text.slice && b.modified());
+    // in an open group, the insert after the save can only be undone along with the one before it
+    b.undo(cursors);
+    String undone = test_buffer_text(b);
+    assert(undone.slice == (open_group ? "a\nb\n" : "xa\nb\n") && b.modified() == !!open_group);
+    util_free(b);
+    test_journal_wait();
+    util_free(text);
+    util_free(recovered);
+    util_free(undone);
+    util_free(cursors);
+    util_free(file);
+  }
 
-  G.editing_panes += main_pane;
+  // a crash in the middle of a group, then recovering it and editing on top of that, then recovering again
+  {
+    Path file = dir.copy();
+    file.push("c.txt");
+    assert(contents_to_file(file.string.slice, Slice::create("a\nb\n")));
+    BufferData b = {};
+    assert(BufferData::from_file(file.string.slice, &b));
+    journal_open(b, false);
+    Array<Cursor> cursors = {};
+    cursors += Cursor{};
+    b.action_begin(cursors);
+    b.insert(cursors, Slice::create("x"));
+    // the journal never sees the end of the group
+    journal_close(b);
+    b.action_end(cursors);
+    util_free(b);
+    test_journal_wait();
+
+    for (int i = 0; i < 2; ++i) {
+      b = {};
+      assert(BufferData::from_file(file.string.slice, &b));
+      journal_open(b, true);
+      String text = test_buffer_text(b);
+      assert(text.slice == (i == 0 ? "xa\nb\n" : "zxa\nb\n") && b.modified());
+      util_free(text);
+      if (i == 0) {
+        cursors[0] = {};
+        b.insert(cursors, Slice::create("z"));
+      }
+      else {
+        b.undo(cursors);
+        b.undo(cursors);
+        text = test_buffer_text(b);
+        assert(text.slice == "a\nb\n" && !b.modified());
+        util_free(text);
+      }
+      util_free(b);
+      test_journal_wait();
+    }
+    util_free(cursors);
+    util_free(file);
+  }
 
-  filetree_init();
-  status_message_set("Welcome!");
+  util_free(G.journal.dir);
+  G.journal.dir = journal_dir;
+  test_dir_remove(dir);
 }
 
-static Stream test_async_command_output;
 static void test() {
   assert(memmem("a", 1, "a", 1));
   assert(!memmem("", 0, "", 0));
@@ -1375,6 +3325,44 @@ static void test() {
   assert(!memmem("aa", 2, "a", 1));
   assert(memmem("abcd", 4, "abcd", 4));
   assert(memmem("abcd", 4, "xabcdy", 6));
+  assert(memmem("ab", 2, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxab", 34));
+  assert(!memrmem("ab", 2, "ba", 2));
+  {
+    assert((const char*)memrmem("a", 1, "bab", 3) != 0);
+    const char *h = "xabxxxxxxxxxxxxxxxxxxxxxabxxxxxxxxxxxxxxxxxxxxab";
+    assert((const char*)memrmem("ab", 2, h, strlen(h)) == h + strlen(h) - 2);
+    assert((const char*)memrmem("ab", 2, h, strlen(h) - 1) == h + 24);
+    assert((const char*)memrmem("xab", 3, h, 3) == h);
+  }
+  {
+    Regex r = {};
+    int ra, rb;
+    assert(regex_compile(Slice::create("(a|bc)+d$"), &r, 0));
+    assert(regex_find(&r, Slice::create("xxbcad"), 0, {}, &ra, &rb) && ra == 2 && rb == 6);
+    assert(r.groups[2] == 4 && r.groups[3] == 5);
+    assert(!regex_find(&r, Slice::create("xxbcadx"), 0, {}, &ra, &rb));
+    util_free(r);
+    assert(regex_compile(Slice::create("^\\w+?=[^;]*"), &r, 0));
+    assert(regex_find(&r, Slice::create("ab=c;d"), 0, {}, &ra, &rb) && ra == 0 && rb == 4);
+    assert(!regex_find(&r, Slice::create("ab=c;d"), 1, {}, &ra, &rb));
+    util_free(r);
+    assert(!regex_compile(Slice::create("a)"), &r, 0));
+    assert(!regex_compile(Slice::create("[ab"), &r, 0));
+    assert(!regex_compile(Slice::create("*"), &r, 0));
+  }
+  {
+    // token atoms, and the leftmost match even when a later start gets past its token first
+    int m[4];
+    assert(test_regex_tokens("(\\i|b)=", "ab=", m) && m[0] == 0 && m[1] == 3 && m[2] == 0 && m[3] == 2);
+    assert(test_regex_tokens("\\i=|b=", "ab=", m) && m[0] == 0 && m[1] == 3);
+    assert(test_regex_tokens("(\\i)\\(", "x = foo(1)", m) && m[0] == 4 && m[1] == 8 && m[2] == 4 && m[3] == 7);
+    assert(!test_regex_tokens("\\io\\(", "x = foo(1)", m));
+    assert(test_regex_tokens("=\\s*(\\#);", "x = 42;", m) && m[0] == 2 && m[1] == 7 && m[2] == 4 && m[3] == 6);
+    assert(test_regex_tokens("(\\#|2);", "x = 42;", m) && m[0] == 4 && m[1] == 7 && m[2] == 4 && m[3] == 6);
+    assert(!test_regex_tokens("\\#", "abc42", m));
+    assert(test_regex_tokens("(\\T)\\T*;", "ab=42;", m) && m[0] == 0 && m[1] == 6 && m[2] == 0 && m[3] == 2);
+    assert(test_regex_tokens("\\T+?(\\T)$", "a+bc", m) && m[0] == 0 && m[1] == 4 && m[2] == 2 && m[3] == 4);
+  }
   Slice a = Slice::create("hello world");
   Slice b = Slice::create("hello");
   assert(a.begins_with(0, b));
@@ -1388,6 +3376,13 @@ static void test() {
   assert(a.find(0, b, &x));
   assert(x == 2);
 
+  test_undo();
+  test_parse_incremental();
+  test_search();
+  test_line_index();
+  test_trigram();
+  test_journal();
+
   #ifdef OS_WINDOWS
   Path p = Path::create(Slice::create("hello"));
   p.push("..");
@@ -1425,6 +3420,329 @@ static void test_update() {
   #endif
 }
 
+/***************************************************************
+***************************************************************
+*                                                            **
+*                                                            **
+*                         BENCHMARKS                         **
+*                                                            **
+*                                                            **
+***************************************************************
+***************************************************************/
+
+// Benchmarks are run from the menu, and the results are written to the log
+
+static double benchmark_seconds_since(u64 t0) {
+  return (double)(SDL_GetPerformanceCounter() - t0) / (double)SDL_GetPerformanceFrequency();
+}
+
+static void benchmark_buffer_edits() {
+  const int num_lines = 400000;
+  const int num_edits = 1000;
+
+  BufferData b = {};
+  b.init(false);
+  b.disable_undo();
+  Array<Cursor> cursors = {};
+  cursors += Cursor{};
+  for (int i = 1; i < num_lines; ++i)
+    b.lines += StringBuffer::createf("  int line_%i = some_function(%i, \"a string\"); // comment", i, i);
+
+  StringBuffer paste = {};
+  for (int i = 0; i < 10; ++i)
+    paste.appendf("  pasted_line(%i);\n", i);
+
+  u64 t;
+
+  // multiline paste at random positions
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits; ++i)
+    b.insert(cursors, Pos{0, rand() % b.lines.size}, paste.slice, -1, false);
+  double insert_time = benchmark_seconds_since(t);
+
+  // removal of multiple lines at random positions
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits; ++i) {
+    int y = rand() % (b.lines.size - 10);
+    b.remove_range(cursors, Pos{0, y}, Pos{0, y+10}, -1, false);
+  }
+  double remove_time = benchmark_seconds_since(t);
+
+  // typing
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits; ++i) {
+    int y = rand() % b.lines.size;
+    b.insert(cursors, Pos{at_most(2, b.lines[y].length), y}, Slice::create("x"), -1, false);
+  }
+  double char_time = benchmark_seconds_since(t);
+
+  // typing with a cursor on every 80th line
+  Array<Cursor> multi = {};
+  Array<BatchInsert> inserts = {};
+  for (int y = 0; y < b.lines.size; y += 80)
+    multi += Cursor::create(at_most(2, b.lines[y].length), y);
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits/10; ++i) {
+    inserts.size = 0;
+    for (int j = 0; j < multi.size; ++j)
+      inserts += BatchInsert{multi[j].pos, Slice::create("x"), j};
+    b.insert_batch(multi, inserts, false);
+    // the paste highlights would have faded out by the next keystroke
+    b.highlights.size = 0;
+  }
+  double multi_time = benchmark_seconds_since(t);
+
+  // a big paste, where it's building the new lines that costs and not moving the old ones
+  StringBuffer big_paste = {};
+  for (int i = 0; i < 100000; ++i)
+    big_paste.appendf("  pasted_line(%i);\n", i);
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < 10; ++i)
+    b.insert(cursors, Pos{0, rand() % b.lines.size}, big_paste.slice, -1, false);
+  double big_insert_time = benchmark_seconds_since(t);
+
+  log_info("buffer edits (%i lines): multiline insert %fus, multiline remove %fus, char insert %fus, char insert with %i cursors %fus, 100000 line insert %fms\n",
+           num_lines,
+           insert_time / num_edits * 1e6,
+           remove_time / num_edits * 1e6,
+           char_time / num_edits * 1e6,
+           multi.size,
+           multi_time / (num_edits/10) * 1e6,
+           big_insert_time / 10 * 1e3);
+
+  util_free(paste);
+  util_free(big_paste);
+  util_free(cursors);
+  util_free(multi);
+  inserts.free_shallow();
+  util_free(b);
+}
+
+static void benchmark_parse() {
+  const int num_functions = 20000;
+  const int num_edits = 1000;
+
+  BufferData b = {};
+  b.init(false);
+  b.disable_undo();
+  b.language = LANGUAGE_C;
+  Array<Cursor> cursors = {};
+  cursors += Cursor{};
+  for (int i = 0; i < num_functions; ++i) {
+    b.lines += StringBuffer::createf("/* function number %i */", i);
+    b.lines += StringBuffer::createf("static int function_%i(int a, const char *b) {", i);
+    b.lines += StringBuffer::createf("  return a + %i + (int)strlen(\"some string\");", i);
+    b.lines += StringBuffer::create("}");
+  }
+
+  u64 t;
+
+  t = SDL_GetPerformanceCounter();
+  b.parse();
+  double full_time = benchmark_seconds_since(t);
+
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits; ++i) {
+    int y = rand() % b.lines.size;
+    b.insert(cursors, Pos{at_most(2, b.lines[y].length), y}, Slice::create("x"), -1, true);
+  }
+  double char_time = benchmark_seconds_since(t);
+
+  t = SDL_GetPerformanceCounter();
+  for (int i = 0; i < num_edits; ++i)
+    b.insert(cursors, Pos{0, rand() % b.lines.size}, Slice::create("/* a\n comment */\n"), -1, true);
+  double comment_time = benchmark_seconds_since(t);
+
+  log_info("parse (%i lines): full parse %fms, char insert with reparse %fus, multiline insert with reparse %fus\n",
+           b.lines.size,
+           full_time * 1e3,
+           char_time / num_edits * 1e6,
+           comment_time / num_edits * 1e6);
+
+  util_free(cursors);
+  util_free(b);
+}
+
+static void benchmark_load_file() {
+  Path path = File::temp_dir();
+  path.push("cmantic_benchmark.tmp");
+  const char *filename = path.string.chars;
+  const int num_lines = 2000000;
+
+  FILE *f;
+  if (File::open(&f, filename, "wb")) {
+    log_err("Could not create %s: %s\n", filename, cman_strerror(errno));
+    util_free(path);
+    return;
+  }
+  StringBuffer line = {};
+  for (int i = 0; i < num_lines; ++i) {
+    line.clear();
+    line.appendf("  int line_%i = some_function(%i, \"a string\"); // comment\n", i, i);
+    File::write(f, line.chars, line.length);
+  }
+  util_free(line);
+  double size = (double)ftell(f);
+  fclose(f);
+
+  Array<StringBuffer> lines = {};
+  u64 t = SDL_GetPerformanceCounter();
+  bool success = lines_from_file(path.string.slice, &lines, 0);
+  double load_time = benchmark_seconds_since(t);
+  remove(filename);
+  util_free(path);
+
+  if (!success || lines.size != num_lines+1)
+    log_err("Failed to load file, got %i lines\n", lines.size);
+  else
+    log_info("load file (%fMB): %fms, %fMB/s\n",
+             size / 1e6,
+             load_time * 1e3,
+             size / 1e6 / load_time);
+  util_free(lines);
+}
+
+static void benchmark_fuzzy_match() {
+  const int num_strings = 200000;
+  const char *queries[] = {"b", "bu", "buf", "buff", "buffer", "bufhpp", "xyzzy"};
+
+  // something that looks like the file names in a big project
+  Array<String> strings = {};
+  const char *words[] = {"buffer", "parse", "render", "util", "pane", "git", "font", "texture", "shader", "menu", "search", "index"};
+  const char *extensions[] = {".cpp", ".hpp", ".c", ".h", ".txt", ".md"};
+  for (int i = 0; i < num_strings; ++i)
+    strings += String::createf("%s_%s%i%s", words[rand() % ARRAY_LEN(words)], words[rand() % ARRAY_LEN(words)], i, extensions[rand() % ARRAY_LEN(extensions)]);
+
+  u64 t = SDL_GetPerformanceCounter();
+  FuzzyIndex index = {};
+  fuzzy_index_init(&index, VIEW(strings, slice));
+  double index_time = benchmark_seconds_since(t);
+
+  StackArray<FuzzyMatch, 15> matches = {};
+  t = SDL_GetPerformanceCounter();
+  for (const char *q : queries)
+    fuzzy_match(Slice::create(q), VIEW(strings, slice), index, view(matches), false);
+  double match_time = benchmark_seconds_since(t);
+
+  // typing a query one character at a time, narrowing down the previous matches
+  FuzzyMenuCache cache = {};
+  fuzzy_cache_init(&cache, VIEW(strings, slice));
+  const char *typed = "bufferhpp";
+  const int num_typed = strlen(typed);
+  t = SDL_GetPerformanceCounter();
+  for (int i = 1; i <= num_typed; ++i)
+    fuzzy_match(Slice::create(typed, i), &cache, view(matches), false);
+  double typing_time = benchmark_seconds_since(t);
+
+  log_info("fuzzy match (%i strings): build index %fms, %fms per query, %f million candidates/s, %fms per typed character\n",
+           num_strings,
+           index_time * 1e3,
+           match_time / ARRAY_LEN(queries) * 1e3,
+           (double)num_strings * ARRAY_LEN(queries) / match_time / 1e6,
+           typing_time / num_typed * 1e3);
+
+  util_free(cache);
+  util_free(index);
+  util_free(strings);
+}
+
+static void benchmark_search() {
+  const int num_bytes = 64*1024*1024;
+  const int num_runs = 5;
+  const char *needles[] = {"e", "if", "return", "BufferData::find_r", "this string is not in the text"};
+
+  // source code-ish text, with a needle at the very end
+  StringBuffer text = {};
+  const char *words[] = {"int", "return", "if", "for", "while", "(x)", "{", "}", ";", "buffer", "lines[y]", "\n", "  ", "const", "BufferData::find"};
+  while (text.length < num_bytes) {
+    text += Slice::create(words[rand() % ARRAY_LEN(words)]);
+    text += ' ';
+  }
+  text += Slice::create("BufferData::find_r this string is not in the text");
+
+  for (const char *needle : needles) {
+    const int n = strlen(needle);
+    const void *p = 0, *q = 0;
+    int count = 0;
+
+    // count the occurrences
+    u64 t = SDL_GetPerformanceCounter();
+    for (int run = 0; run < num_runs; ++run)
+      for (const char *h = text.chars, *end = text.chars + text.length; (p = memmem(needle, n, h, end - h)); h = (const char*)p + 1)
+        ++count;
+    double find_time = benchmark_seconds_since(t);
+
+    t = SDL_GetPerformanceCounter();
+    for (int run = 0; run < num_runs; ++run)
+      for (int len = text.length; (q = memrmem(needle, n, text.chars, len)); len = (const char*)q - text.chars + n - 1)
+        ;
+    double find_r_time = benchmark_seconds_since(t);
+
+    #ifdef OS_LINUX
+    t = SDL_GetPerformanceCounter();
+    for (int run = 0; run < num_runs; ++run)
+      for (const char *h = text.chars, *end = text.chars + text.length; (p = ::memmem(h, (size_t)(end - h), needle, (size_t)n)); h = (const char*)p + 1)
+        ;
+    double libc_time = benchmark_seconds_since(t);
+    #else
+    double libc_time = 0;
+    #endif
+
+    const double mb = (double)text.length * num_runs / 1e6;
+    log_info("search for \"%s\" (%i matches in %iMB): find %fMB/s, find_r %fMB/s, libc memmem %fMB/s\n",
+             needle, count / num_runs, text.length / 1000000,
+             mb / find_time, mb / find_r_time, libc_time ? mb / libc_time : 0.0);
+  }
+
+  util_free(text);
+}
+
+static void benchmark_regex() {
+  const int num_functions = 500000;
+  const char *patterns[] = {"not_in_the_buffer", "function_4999\\d\\d\\(", "^\\s*return a \\+ 12345 ", "[A-Z][a-z]+ing", "(\\w+)_(\\d+)\\(int x", "\\i \\+ \\# \\+ \\i"};
+
+  BufferData b = {};
+  b.init(false);
+  b.disable_undo();
+  b.language = LANGUAGE_C;
+  for (int i = 0; i < num_functions; ++i) {
+    b.lines += StringBuffer::createf("/* function number %i */", i);
+    b.lines += StringBuffer::createf("static int function_%i(int a, const char *b) {", i);
+    b.lines += StringBuffer::createf("  return a + %i + (int)strlen(\"some string\");", i);
+    b.lines += StringBuffer::create("}");
+  }
+  i64 num_bytes = 0;
+  for (const StringBuffer &line : b.lines)
+    num_bytes += line.length + 1;
+  b.parse();
+
+  for (const char *pattern : patterns) {
+    Regex r = {};
+    if (!regex_compile(Slice::create(pattern), &r, 0))
+      continue;
+    int count = 0;
+    u64 t = SDL_GetPerformanceCounter();
+    Pos p = {};
+    for (bool stay = true; b.find(&r, stay, &p, 0); stay = false)
+      ++count;
+    double time = benchmark_seconds_since(t);
+    log_info("regex '%s' (%i lines, %i matches): %fms, %fMB/s, %i DFA states\n",
+             pattern, b.lines.size, count, time * 1e3, num_bytes / time / 1e6, r._dfa.size);
+    util_free(r);
+  }
+
+  util_free(b);
+}
+
+static void benchmark() {
+  benchmark_buffer_edits();
+  benchmark_parse();
+  benchmark_load_file();
+  benchmark_fuzzy_match();
+  benchmark_search();
+  benchmark_regex();
+}
+
 static Key get_input(bool *window_active) {
   if (!*window_active)
     SDL_WaitEvent(NULL);
@@ -1619,6 +3937,7 @@ static void do_goto() {
       break;
     case 'b':
       buffer.jumplist_push();
+      buffer.data->map_lines(INT_MAX);
       buffer.move_to(0, buffer.data->num_lines()-1);
       buffer.jumplist_push();
       break;
@@ -1630,10 +3949,27 @@ static void do_goto() {
       if (t->token != TOKEN_IDENTIFIER)
         break;
 
-      // TODO: what if we have multiple matches?
+      // if we're on one of several definitions with the same name, go to the next one
       Range *def = buffer.data->getdefinition(t->str);
-      if (!def)
+      for (Range *d = def; d; d = buffer.data->getdefinition(t->str, d)) {
+        if (d->a != t->a)
+          continue;
+        def = buffer.data->getdefinition(t->str, d);
+        if (!def)
+          def = buffer.data->getdefinition(t->str);
+        break;
+      }
+
+      // otherwise look in the rest of the project
+      if (!def) {
+        int idx = project_definition_find(t->str);
+        // the current file may not have been reindexed yet
+        while (idx != -1 && buffer.data->filename.slice == project_definition_file(idx).string.slice)
+          idx = project_definition_find(t->str, idx);
+        if (idx != -1)
+          goto_project_definition(idx);
         break;
+      }
 
       // G.editing_pane->add_subpane(buffer.data, def->a);
       buffer.jumplist_push();
@@ -1770,15 +4106,19 @@ static bool do_paste() {
 
   // split clipboard among cursors
   if (num_endlines == buffer.cursors.size-1) {
+    Array<BatchInsert> inserts = {};
+    inserts.reserve(buffer.cursors.size);
     char *start = s;
     char *end = start;
     for (int i = 0; i < buffer.cursors.size; ++i) {
       start = end;
       while (*end && *end != '\n')
         ++end;
-      buffer.insert(Slice::create(start, end-start), i);
+      inserts += BatchInsert{buffer.cursors[i].pos, Slice::create(start, end-start), i};
       ++end;
     }
+    buffer.data->insert_batch(buffer.cursors, inserts);
+    inserts.free_shallow();
   }
   // otherwise just paste out the whole thing for all cursors
   else {
@@ -2078,6 +4418,10 @@ static void menu_option_save() {
   save_buffer(G.editing_pane->buffer.data);
 }
 
+static void menu_option_saveall() {
+  save_all_buffers();
+}
+
 static void menu_option_quit() {
   editor_exit(0);
 }
@@ -2093,6 +4437,20 @@ static void menu_option_chdir() {
   mode_cwd();
 }
 
+static void menu_option_history() {
+  mode_history();
+}
+
+static void menu_option_grep() {
+  mode_grep();
+}
+
+static void menu_option_toggle_search_index() {
+  G.trigram_index_disabled = !G.trigram_index_disabled;
+  trigram_index_start();
+  status_message_set(G.trigram_index_disabled ? "Grep searches every file" : "Building search index..");
+}
+
 static void menu_option_reload() {
   BufferData *b = G.editing_pane->buffer.data;
   if (!b->is_bound_to_file())
@@ -2200,8 +4558,11 @@ static void menu_option_blame() {
   }
   util_free(b.blame);
 
+  // git reads the file, so wait for it to be written
   if (b.modified())
     save_buffer(&b);
+  if (b.saving)
+    save_finish(b.saving);
 
   // call git
   const char* cmd[] = {"git", "blame", b.filename.chars, "--porcelain", NULL};
@@ -2254,6 +4615,11 @@ static void menu_option_expand_columns() {
   mode_normal();
 }
 
+static void menu_option_benchmark() {
+  benchmark();
+  status_message_set("Benchmark results have been written to the log");
+}
+
 struct MenuOption {
   Slice name;
   Slice description;
@@ -2270,6 +4636,11 @@ static struct {MenuOption opt; void(*fun)();} menu_options[] = {
     Slice::create("Save file"),
     menu_option_save
   },
+  {
+    Slice::create("save all"),
+    Slice::create("Save all modified buffers"),
+    menu_option_saveall
+  },
   {
     Slice::create("show indentation"),
     Slice::create("Show if tab type is spaces or tab"),
@@ -2300,6 +4671,21 @@ static struct {MenuOption opt; void(*fun)();} menu_options[] = {
     Slice::create("Close all open buffers"),
     menu_option_closeall
   },
+  {
+    Slice::create("undo history"),
+    Slice::create("Browse every state of the current buffer, including the ones that were undone and then changed"),
+    menu_option_history
+  },
+  {
+    Slice::create("grep"),
+    Slice::create("Search every file in the project. Start with / for a regex"),
+    menu_option_grep
+  },
+  {
+    Slice::create("toggle search index"),
+    Slice::create("Turn the trigram index that narrows down which files grep has to read on or off"),
+    menu_option_toggle_search_index
+  },
   {
     Slice::create("git blame"),
     Slice::create("git blame on current file"),
@@ -2325,6 +4711,11 @@ static struct {MenuOption opt; void(*fun)();} menu_options[] = {
     Slice::create("Set the number of pixels of empty space between lines"),
     menu_option_line_margin
   },
+  {
+    Slice::create("benchmark"),
+    Slice::create("Run the editor benchmarks and write the results to the log"),
+    menu_option_benchmark
+  },
 };
 
 static Array<String> get_menu_suggestions() {
@@ -2620,20 +5011,16 @@ static void handle_input(Key key) {
     }
 
     if (key == KEY_RETURN) {
-      #if 0
       int opt = G.menu_pane.menu_get_selection_idx();
       if (opt == -1) {
-        status_message_set("\"{}\": No such file", (Slice)G.menu_buffer[0].slice);
+        status_message_set("\"{}\": No such definition", (Slice)G.menu_buffer[0].slice);
         mode_normal();
         break;
       }
 
-      // G.editing_pane->add_subpane(buffer.data, def->a);
-      buffer.jumplist_push();
-      buffer.move_to(G.definition_positions[opt]);
-      buffer.jumplist_push();
-      #endif
+      int idx = G.project_definition_matches[opt];
       mode_normal(true);
+      goto_project_definition(idx);
       break;
     }
 
@@ -2648,6 +5035,66 @@ static void handle_input(Key key) {
 
     break;}
 
+  case MODE_HISTORY: {
+    if (key == KEY_ESCAPE) {
+      history_goto(G.history_begin_state);
+      mode_normal(true);
+      break;
+    }
+
+    if (key == KEY_RETURN) {
+      mode_normal(true);
+      break;
+    }
+
+    handle_menu_insert(&G.menu_pane, key);
+
+    // go to the selected state right away
+    int i = G.menu_pane.menu_get_selection_idx();
+    if (i >= 0 && i < G.history_states.size) {
+      UndoState s = G.history_states[i];
+      UndoState current = buffer.data->undo_state();
+      if (s.branch != current.branch || s.group != current.group)
+        history_goto(s);
+    }
+    break;}
+
+  case MODE_GREP: {
+    if (key == KEY_ESCAPE) {
+      if (G.grep.active) {
+        G.grep.mutex.lock();
+        int num_searched = G.grep.num_searched;
+        G.grep.mutex.unlock();
+        grep_stop();
+        status_message_set("Cancelled grep after %i of %i files", num_searched, G.grep.files.size);
+        mode_normal();
+        break;
+      }
+      mode_normal(true);
+      break;
+    }
+
+    if (key == KEY_RETURN) {
+      Slice *opt = G.menu_pane.menu_get_selection();
+      if (opt && !grep_goto(*opt)) {
+        status_message_set("Failed to open {}", (Slice)*opt);
+        mode_normal();
+        break;
+      }
+      // the search goes on, and the rest of the matches can be found in the results pane
+      mode_normal(true);
+      break;
+    }
+
+    handle_menu_insert(&G.menu_pane, key);
+
+    // search again when the query changes
+    if (G.menu_buffer[0].slice != G.grep.query.slice) {
+      grep_start(G.menu_buffer[0].slice);
+      G.menu_pane.update_suggestions();
+    }
+    break;}
+
   case MODE_FILESEARCH:
     if (key == KEY_RETURN) {
       Slice *opt = G.menu_pane.menu_get_selection();
@@ -2661,30 +5108,7 @@ static void handle_input(Key key) {
       Path full_path = G.current_working_directory.copy();
       full_path.push(selection);
 
-      // check if buffer is already open
-      for (BufferData *b: G.buffers) {
-        if (full_path.string.slice == b->filename.slice) {
-          status_message_set("Switched to {}", (Slice)b->filename.slice);
-          G.editing_pane->switch_buffer(b);
-          goto filesearch_done;
-        }
-      }
-
-      // otherwise open new file
-      {
-        BufferData *b = new BufferData{};
-        if (BufferData::from_file(full_path.string.slice, b)) {
-          G.buffers += b;
-          G.editing_pane->switch_buffer(b);
-          status_message_set("Loaded file {} ({}) (%s)", (Slice)full_path.name(), language_settings[b->language].name, b->endline_string == ENDLINE_UNIX ? "Unix" : "Windows");
-        }
-        else {
-          status_message_set("Failed to load file {}", (Slice)full_path.name());
-          free(b);
-        }
-      }
-
-      filesearch_done:
+      open_buffer(full_path, false);
       util_free(full_path);
       G.menu_pane.buffer.empty();
       mode_normal();
@@ -2714,6 +5138,26 @@ static void handle_input(Key key) {
         util_free(G.search_term);
         mode_normal(true);
       }
+      else if (G.search_buffer.lines[0][0] == '/') {
+        StringBuffer error = {};
+        ++G.search_generation;
+        if (!regex_compile(G.search_buffer.lines[0](1, -1), &G.search_regex, &error)) {
+          status_message_set("bad regex: {}", (Slice)error.slice);
+          util_free(error);
+          mode_normal();
+          break;
+        }
+        buffer.jumplist_push();
+        G.search_failed = !buffer.find_and_move(&G.search_regex, true);
+        if (G.search_failed) {
+          status_message_set("'{}' not found", (Slice)G.search_buffer.lines[0].slice);
+          mode_normal();
+          break;
+        }
+        buffer.jumplist_push();
+        mode_normal(true);
+        search_status(buffer);
+      }
       else {
         buffer.jumplist_push();
 
@@ -2726,6 +5170,7 @@ static void handle_input(Key key) {
         assert(G.search_term.size);
         assert(G.search_term.last().token == TOKEN_EOF);
         --G.search_term.size;
+        ++G.search_generation;
 
         G.search_failed = !buffer.find_and_move(G.search_term, true);
         if (G.search_failed) {
@@ -2740,6 +5185,7 @@ static void handle_input(Key key) {
         }
         buffer.jumplist_push();
         mode_normal(true);
+        search_status(buffer);
       }
     }
     // insert
@@ -3154,6 +5600,15 @@ static void handle_input(Key key) {
       mode_filesearch();
       break;
 
+    case CONTROL('f'):
+      mode_grep();
+      break;
+
+    case KEY_RETURN:
+      if (buffer.data == &G.grep_buffer && !grep_goto(buffer.data->lines[buffer.cursors[0].y].slice))
+        status_message_set("No match on this line");
+      break;
+
     case 'g':
       do_goto();
       break;
@@ -3272,6 +5727,15 @@ static void do_update(float dt) {
   G.visual_jump_color.tick(dt);
   G.visual_jump_background_color.tick(dt);
 
+  // pick up definitions from the project indexing threads
+  project_index_update();
+
+  // pick up trigrams from the trigram index threads
+  trigram_index_update();
+
+  // pick up matches from the grep threads
+  grep_update();
+
   // update paste highlights
   for (BufferData *b : G.buffers) {
     for (int i = 0; i < b->highlights.size; ++i) {
@@ -3300,32 +5764,15 @@ static void do_update(float dt) {
       }
       if (n == 0)
         break;
-
-      Array<Cursor> prev = {};
-      for (Pane *p : G.editing_panes)
-        if (p->buffer.data == &G.build_result_buffer)
-          prev += p->buffer.cursors[0];
-      Array<Cursor> cursors = {};
-      b.insert(cursors, {b.lines.last().length, b.lines.size-1}, Slice::create(buf, n), -1);
-
-      int prev_idx = 0;
-      for (Pane *p : G.editing_panes) {
-        if (p->buffer.data == &G.build_result_buffer) {
-          p->buffer.collapse_cursors();
-          p->buffer.cursors[0] = prev[prev_idx++];
-        }
-      }
-      util_free(prev);
+      buffer_append(b, Slice::create(buf, n));
     }
   }
 
-  static u64 last_modified;
-  if (update_idx%50 == 0) {
-    Path colorscheme_path = get_colorscheme_path();
-    if (File::was_modified(colorscheme_path.string.chars, &last_modified))
-      read_colorscheme_file(colorscheme_path.string.chars, true);
-    util_free(colorscheme_path);
-  }
+  // mark buffers as saved, before the file watcher sees the writes
+  save_update();
+
+  // reload the colorscheme, buffers and project files that changed on disk
+  file_watcher_update();
 
   G.activation_meter = at_least(G.activation_meter - dt / 500.0f, 0.0f);
 }
@@ -0,0 +1,313 @@
+#ifndef FILETREE_HEADER
+#define FILETREE_HEADER
+
+// A single line in a .gitignore file
+struct IgnoreRule {
+  String pattern;
+  bool negate; // !pattern
+  bool dir_only; // pattern/
+  bool anchored; // the pattern has a separator in it, so it is matched against the path relative to the .gitignore instead of just the name
+};
+
+// The rules from one .gitignore file. Deeper directories point to the rules of the directories above them
+struct IgnoreRules {
+  IgnoreRules *parent;
+  int dir_length; // the rules apply to the paths that start with the first dir_length chars
+  Array<IgnoreRule> rules;
+};
+
+static bool glob_match(Slice pattern, Slice str);
+static void filetree_walk(Path root, Path dir, Array<Path> *files, Array<Path> *dirs);
+static bool filetree_is_ignored(Path root, Path path, bool is_dir);
+
+#endif /* FILETREE_HEADER */
+
+
+
+
+#ifdef FILETREE_IMPL
+
+// Editor and version control leftovers, on top of what the project .gitignore files say. Build output is left
+// to the .gitignore, since a project may well have sources in a dir called build/ or bin/.
+// Hidden files (.git, .hg, vim swap files) are never listed in the first place
+static const char *filetree_ignore_list[] = {
+  "*~", "#*#", "*.orig", "*.rej",
+};
+
+static void util_free(IgnoreRule &r) {
+  util_free(r.pattern);
+}
+
+static void util_free(IgnoreRules *&r) {
+  util_free(r->rules);
+  delete r;
+  r = 0;
+}
+
+static char _glob_char(char c) {
+  return c == Path::separator ? '/' : c;
+}
+
+// * and ? never match a separator, but ** matches anything. Separators in str can be either / or Path::separator
+static bool _glob_match(const char *p, const char *pend, const char *s, const char *send) {
+  for (; p < pend; ++p, ++s) {
+    if (*p == '*') {
+      bool any = p+1 < pend && p[1] == '*';
+      const char *rest = p + (any ? 2 : 1);
+
+      // '**/' can also match nothing at all
+      if (any && rest < pend && *rest == '/' && _glob_match(rest+1, pend, s, send))
+        return true;
+      for (const char *t = s;; ++t) {
+        if (_glob_match(rest, pend, t, send))
+          return true;
+        if (t == send || (!any && _glob_char(*t) == '/'))
+          return false;
+      }
+    }
+
+    if (s == send)
+      return false;
+    char c = _glob_char(*s);
+
+    if (*p == '?') {
+      if (c == '/')
+        return false;
+      continue;
+    }
+
+    if (*p == '[') {
+      const char *q = p+1;
+      bool negate = q < pend && (*q == '!' || *q == '^');
+      if (negate)
+        ++q;
+      const char *start = q;
+      bool match = false;
+      for (; q < pend && (*q != ']' || q == start); ++q) {
+        if (q+2 < pend && q[1] == '-' && q[2] != ']') {
+          match |= c >= q[0] && c <= q[2];
+          q += 2;
+        }
+        else
+          match |= c == *q;
+      }
+      // no closing bracket, so treat it as a normal character
+      if (q < pend) {
+        if (c == '/' || match == negate)
+          return false;
+        p = q;
+        continue;
+      }
+    }
+
+    if (*p == '\\' && p+1 < pend)
+      ++p;
+    if (*p != c)
+      return false;
+  }
+  return s == send;
+}
+
+static bool glob_match(Slice pattern, Slice str) {
+  return _glob_match(pattern.chars, pattern.chars + pattern.length, str.chars, str.chars + str.length);
+}
+
+static void _filetree_add_rule(IgnoreRules *r, Slice line) {
+  // trailing whitespace is ignored, and so are comments
+  while (line.length && (line[line.length-1] == ' ' || line[line.length-1] == '\t' || line[line.length-1] == '\r'))
+    --line.length;
+  if (!line.length || line[0] == '#')
+    return;
+
+  IgnoreRule rule = {};
+  if (line[0] == '!') {
+    rule.negate = true;
+    line = line(1, -1);
+  }
+  else if (line[0] == '\\')
+    line = line(1, -1);
+  if (line.length && line[line.length-1] == '/') {
+    rule.dir_only = true;
+    --line.length;
+  }
+  int x;
+  rule.anchored = line.find('/', &x);
+  if (line.length && line[0] == '/')
+    line = line(1, -1);
+  if (!line.length)
+    return;
+
+  rule.pattern = String::create(line);
+  r->rules += rule;
+}
+
+// Returns the rules of the .gitignore file in dir, or parent if there is none
+static IgnoreRules* _filetree_load_rules(Path dir, IgnoreRules *parent, Array<IgnoreRules*> *all) {
+  Path path = dir.copy();
+  path.push(".gitignore");
+  String contents;
+  bool success = File::get_contents(path, &contents);
+  util_free(path);
+  if (!success)
+    return parent;
+
+  IgnoreRules *r = new IgnoreRules{parent, dir.string.length};
+  for (int y = 0; y < contents.length;)
+    _filetree_add_rule(r, contents.token(&y, '\n'));
+  util_free(contents);
+
+  if (!r->rules.size) {
+    util_free(r);
+    return parent;
+  }
+  *all += r;
+  return r;
+}
+
+// the editor ignore list, and the rules of every .gitignore from root down to (but not including) dir
+static IgnoreRules* _filetree_rules_above(Path root, Path dir, Array<IgnoreRules*> *all) {
+  IgnoreRules *r = new IgnoreRules{0, root.string.length};
+  foreach(filetree_ignore_list)
+    _filetree_add_rule(r, Slice::create(*it));
+  *all += r;
+
+  if (!dir.string.slice.begins_with(root.string.slice) || dir.string.length <= root.string.length)
+    return r;
+
+  Path p = root.copy();
+  r = _filetree_load_rules(p, r, all);
+  for (int i = root.string.length+1; i < dir.string.length; ++i) {
+    if (dir.string[i] != Path::separator)
+      continue;
+    util_free(p);
+    p = Path::create(dir.string.slice(0, i));
+    r = _filetree_load_rules(p, r, all);
+  }
+  util_free(p);
+  return r;
+}
+
+static bool _filetree_is_ignored(IgnoreRules *r, Slice path, bool is_dir) {
+  Slice name = Path::name(path);
+  // deeper .gitignores win over the ones above them, and later rules win over earlier ones
+  for (; r; r = r->parent) {
+    Slice rel = path(at_most(r->dir_length+1, path.length), -1);
+    for (int i = r->rules.size-1; i >= 0; --i) {
+      IgnoreRule &rule = r->rules[i];
+      if (rule.dir_only && !is_dir)
+        continue;
+      if (glob_match(rule.pattern.slice, rule.anchored ? rel : name))
+        return !rule.negate;
+    }
+  }
+  return false;
+}
+
+static bool filetree_is_ignored(Path root, Path path, bool is_dir) {
+  Array<IgnoreRules*> all = {};
+  IgnoreRules *r = _filetree_rules_above(root, path, &all);
+  bool result = _filetree_is_ignored(r, path.string.slice, is_dir);
+  util_free(all);
+  return result;
+}
+
+struct _FileTreeJob {
+  Path dir;
+  IgnoreRules *rules;
+};
+
+struct _FileTreeWalk {
+  Mutex mutex;
+  Condition cond;
+  Array<_FileTreeJob> jobs;
+  int num_busy; // threads that are listing a directory right now, which might give us more jobs
+  Array<Path> files;
+  Array<Path> dirs;
+  Array<IgnoreRules*> rules; // all the rules that were loaded, so we can free them afterwards
+};
+
+static void _filetree_remove_ignored(Array<Path> &paths, IgnoreRules *rules, bool is_dir) {
+  for (int i = 0; i < paths.size; ++i) {
+    if (_filetree_is_ignored(rules, paths[i].string.slice, is_dir)) {
+      util_free(paths[i]);
+      paths[i--] = paths[--paths.size];
+    }
+  }
+}
+
+static void _filetree_walk_thread(void *data) {
+  _FileTreeWalk &w = *(_FileTreeWalk*)data;
+
+  w.mutex.lock();
+  for (;;) {
+    while (!w.jobs.size && w.num_busy)
+      w.cond.wait(w.mutex);
+    if (!w.jobs.size)
+      break;
+    _FileTreeJob job = w.jobs[--w.jobs.size];
+    ++w.num_busy;
+    w.mutex.unlock();
+
+    Array<IgnoreRules*> new_rules = {};
+    Array<Path> files = {}, dirs = {};
+    IgnoreRules *rules = _filetree_load_rules(job.dir, job.rules, &new_rules);
+    File::list_dir(job.dir, &files, &dirs);
+    _filetree_remove_ignored(files, rules, false);
+    _filetree_remove_ignored(dirs, rules, true);
+
+    w.mutex.lock();
+    w.rules.push(new_rules.items, new_rules.size);
+    w.files.push(files.items, files.size);
+    for (Path d : dirs) {
+      w.dirs += d;
+      w.jobs += _FileTreeJob{d, rules};
+    }
+    --w.num_busy;
+    w.cond.broadcast();
+    new_rules.free_shallow();
+    files.free_shallow();
+    dirs.free_shallow();
+  }
+  w.mutex.unlock();
+}
+
+static int _filetree_cmp(const void *a, const void *b) {
+  Slice x = ((const Path*)a)->string.slice;
+  Slice y = ((const Path*)b)->string.slice;
+  int c = memcmp(x.chars, y.chars, at_most(x.length, y.length));
+  return c ? c : x.length - y.length;
+}
+
+// Lists every file and directory under dir (including dir) that isn't ignored, with one thread per cpu.
+// .gitignore files are picked up from root and down, and the files come out sorted
+static void filetree_walk(Path root, Path dir, Array<Path> *files, Array<Path> *dirs) {
+  _FileTreeWalk w = {};
+  Array<Thread> threads = {};
+
+  w.mutex.init();
+  w.cond.init();
+  w.dirs += dir.copy();
+  w.jobs += _FileTreeJob{w.dirs[0], _filetree_rules_above(root, dir, &w.rules)};
+
+  for (int i = 1; i < Thread::num_cpus(); ++i) {
+    Thread t;
+    if (!Thread::create(&t, _filetree_walk_thread, &w))
+      break;
+    threads += t;
+  }
+  _filetree_walk_thread(&w);
+  for (Thread &t : threads)
+    t.join();
+
+  qsort(w.files.items, w.files.size, sizeof(w.files[0]), _filetree_cmp);
+  *files = w.files;
+  *dirs = w.dirs;
+
+  threads.free_shallow();
+  w.jobs.free_shallow();
+  util_free(w.rules);
+  util_free(w.mutex);
+  util_free(w.cond);
+}
+
+#endif /* FILETREE_IMPL */
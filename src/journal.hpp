@@ -0,0 +1,800 @@
+#ifndef JOURNAL_HEADER
+#define JOURNAL_HEADER
+
+/* The undo history of every buffer that is bound to a file is streamed to a journal in .cmantic_journal/ in the project root,
+ * so that unsaved changes survive a crash, and the history survives restarts.
+ *
+ * A journal starts with a header that says what the file looked like when it was last saved, followed by a checkpoint with the
+ * whole undo history at that point. After that, every change to the history is appended as a record. Saving writes a new journal
+ * with a new checkpoint, so we never need more than the last checkpoint and the records after it.
+ *
+ * The writing is done on a background thread, that takes everything that came in since it last woke up and does one write and one
+ * fdatasync per journal, so editing never waits for the disk.
+ *
+ * header: u32 magic, u32 version, u64 modify_time, u64 size, u32 path_length, path chars
+ * record: u32 length, u32 checksum, then length bytes starting with the JournalRecordType. Actions are stored like in the UndoBlocks
+ */
+
+enum JournalRecordType {
+  JOURNAL_CHECKPOINT, // blocks, actions, next action and save point
+  JOURNAL_PUSH,       // an action added with push_undo_action
+  JOURNAL_MERGE,      // an insert that was merged into the action before it
+  JOURNAL_POP,        // an empty group was removed
+  JOURNAL_UNDO,
+  JOURNAL_REDO,
+  JOURNAL_GOTO,       // undo_goto, followed by the branch and the group
+};
+
+struct Journal {
+  Path path;
+  Array<u8> pending; // written by the main thread, and taken by the journal thread. Protected by the journal mutex
+  bool rewrite; // pending is a whole new journal that replaces the file
+  bool started; // the header and a checkpoint have been written
+  bool closed; // the buffer is gone, so the thread frees this when pending has been written
+  bool remove; // and it didn't have any history, so the file can go too
+  FILE *f; // only touched by the journal thread
+};
+
+static void journal_init();
+static void journal_quit();
+static void journal_open(BufferData &b, bool recover);
+static void journal_close(BufferData &b);
+static void journal_saved(BufferData &b);
+static void journal_push(BufferData &b, const UndoAction &a);
+static void journal_merge_insert(BufferData &b, Pos a, Pos bb, Slice s, int cursor_idx);
+static void journal_merge_insert_batch(BufferData &b, Array<BatchInsert> &inserts);
+static void journal_record(BufferData &b, JournalRecordType type);
+static void journal_goto(BufferData &b, UndoState s);
+static void journal_find_unsaved(Array<Path> *files);
+static void journal_discard_unsaved(Slice filename);
+
+#endif /* JOURNAL_HEADER */
+
+
+
+
+#ifdef JOURNAL_IMPL
+
+#define JOURNAL_DIRNAME ".cmantic_journal"
+#define JOURNAL_MAGIC 0x4a4d4d43
+// bump this whenever the format of the undo actions changes
+#define JOURNAL_VERSION 2
+#define JOURNAL_HEADER_SIZE 28
+
+struct _JournalHeader {
+  u64 modify_time, size;
+  String path;
+};
+
+static Path journal_path(Slice filename) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.journal", (unsigned long long)hash_bytes(filename.chars, filename.length));
+  Path p = G.journal.dir.copy();
+  p.push(name);
+  return p;
+}
+
+static bool journal_read(const u8 **p, const u8 *end, void *result, int n) {
+  if (end - *p < n)
+    return false;
+  memcpy(result, *p, n);
+  *p += n;
+  return true;
+}
+
+static void journal_write_header(Array<u8> &out, BufferData &b) {
+  u32 magic = JOURNAL_MAGIC, version = JOURNAL_VERSION, path_length = b.filename.length;
+  out.push((u8*)&magic, 4);
+  out.push((u8*)&version, 4);
+  out.push((u8*)&b.file_modify_time, 8);
+  out.push((u8*)&b.file_size, 8);
+  out.push((u8*)&path_length, 4);
+  out.push((u8*)b.filename.chars, b.filename.length);
+}
+
+static bool journal_read_header(const u8 **p, const u8 *end, _JournalHeader *h) {
+  u32 magic, version, path_length;
+  if (!journal_read(p, end, &magic, 4) || magic != JOURNAL_MAGIC)
+    return false;
+  if (!journal_read(p, end, &version, 4) || version != JOURNAL_VERSION)
+    return false;
+  if (!journal_read(p, end, &h->modify_time, 8) || !journal_read(p, end, &h->size, 8) || !journal_read(p, end, &path_length, 4))
+    return false;
+  if ((u32)(end - *p) < path_length)
+    return false;
+  h->path = String::create((const char*)*p, path_length);
+  *p += path_length;
+  return true;
+}
+
+// wraps payload (which starts with the record type) in a record
+static void journal_write_record(Array<u8> &out, const Array<u8> &payload) {
+  u32 length = payload.size, checksum = (u32)hash_bytes(payload.items, payload.size);
+  out.push((u8*)&length, 4);
+  out.push((u8*)&checksum, 4);
+  out.push(payload.items, payload.size);
+}
+
+// Returns false at the end, or at a record that was only partly written when we crashed
+static bool journal_next_record(const u8 **p, const u8 *end, const u8 **payload, int *length) {
+  u32 n, checksum;
+  const u8 *q = *p;
+  if (!journal_read(&q, end, &n, 4) || !journal_read(&q, end, &checksum, 4))
+    return false;
+  if (n < 1 || (u32)(end - q) < n || (u32)hash_bytes(q, n) != checksum)
+    return false;
+  *payload = q;
+  *length = n;
+  *p = q + n;
+  return true;
+}
+
+static void journal_write_block(Array<u8> &out, const UndoBlock &block) {
+  undo_write(out, block.num_actions);
+  undo_write(out, block.num_groups);
+  undo_write(out, block.data.size);
+  out.push(block.data.items, block.data.size);
+}
+
+static UndoBlock journal_read_block(const u8 *&p) {
+  UndoBlock block = {};
+  block.num_actions = undo_read(p);
+  block.num_groups = undo_read(p);
+  int n = undo_read(p);
+  block.data.reserve(n);
+  block.data.push((u8*)p, n);
+  p += n;
+  return block;
+}
+
+// the whole history, except for any actions after the first num_actions, at the state where the next action is next
+static void journal_write_checkpoint(Array<u8> &out, BufferData &b, int num_actions, int next) {
+  Array<u8> payload = {};
+  payload += (u8)JOURNAL_CHECKPOINT;
+
+  undo_write(payload, b._undo_blocks.size);
+  for (UndoBlock &block : b._undo_blocks)
+    journal_write_block(payload, block);
+
+  Array<u8> actions = {};
+  undo_compress_actions(actions, b._undo_actions.items, num_actions);
+  undo_write(payload, num_actions);
+  undo_write(payload, actions.size);
+  payload.push(actions.items, actions.size);
+  undo_write(payload, next);
+  undo_write(payload, b._last_save_undo_action);
+
+  // _undo_group is the state at _next_undo_action
+  int group = b._undo_group;
+  for (int i = next; i < b._next_undo_action; ++i)
+    if (b._undo_actions[i].type == ACTIONTYPE_GROUP_END)
+      --group;
+  for (int i = b._next_undo_action; i < next; ++i)
+    if (b._undo_actions[i].type == ACTIONTYPE_GROUP_END)
+      ++group;
+  undo_write(payload, group);
+  undo_write(payload, b._undo_first_group);
+
+  undo_write(payload, b._undo_branches.size);
+  for (UndoBranch &branch : b._undo_branches) {
+    undo_write(payload, branch.fork);
+    undo_write(payload, branch.parent);
+    undo_write(payload, branch.save);
+    journal_write_block(payload, branch.block);
+  }
+
+  journal_write_record(out, payload);
+  actions.free_shallow();
+  payload.free_shallow();
+}
+
+static void journal_read_checkpoint(BufferData &b, const u8 *p) {
+  int num_blocks = undo_read(p);
+  for (int i = 0; i < num_blocks; ++i) {
+    UndoBlock block = journal_read_block(p);
+    b._undo_blocks += block;
+    b._undo_block_bytes += sizeof(block) + block.data.cap;
+  }
+
+  int num_actions = undo_read(p);
+  int n = undo_read(p);
+  Array<u8> actions = {(u8*)p, n, n};
+  b._undo_actions.resize(num_actions);
+  undo_decompress_actions(b._undo_arena, actions, b._undo_actions.items, num_actions);
+  for (UndoAction &a : b._undo_actions)
+    b._undo_bytes += undo_action_size(a);
+  p += n;
+
+  b._next_undo_action = undo_read(p);
+  b._last_save_undo_action = undo_read(p);
+  b._undo_group = undo_read(p);
+  b._undo_first_group = undo_read(p);
+
+  int num_branches = undo_read(p);
+  for (int i = 0; i < num_branches; ++i) {
+    UndoBranch branch = {};
+    branch.fork = undo_read(p);
+    branch.parent = undo_read(p);
+    branch.save = undo_read(p);
+    branch.block = journal_read_block(p);
+    b._undo_branches += branch;
+    b._undo_branch_bytes += sizeof(branch) + branch.block.data.cap;
+  }
+}
+
+// hands data to the journal thread
+static void journal_queue(Journal *j, const Array<u8> &data, bool rewrite) {
+  G.journal.mutex.lock();
+  if (rewrite) {
+    j->pending.size = 0;
+    j->rewrite = true;
+  }
+  j->pending.push(data.items, data.size);
+  G.journal.cond.broadcast();
+  G.journal.mutex.unlock();
+}
+
+static void journal_queue_record(BufferData &b, const Array<u8> &payload) {
+  Array<u8> out = {};
+  journal_write_record(out, payload);
+  journal_queue(b.journal, out, false);
+  out.free_shallow();
+}
+
+// the history before this action hasn't been written anywhere, so start the journal with a checkpoint of that
+static void journal_start(BufferData &b, int num_actions) {
+  Array<u8> out = {};
+  journal_write_header(out, b);
+  journal_write_checkpoint(out, b, num_actions, at_most(b._next_undo_action, num_actions));
+  journal_queue(b.journal, out, true);
+  b.journal->started = true;
+  out.free_shallow();
+}
+
+static void journal_write_push(Array<u8> &out, const UndoAction &a) {
+  Array<u8> payload = {};
+  payload += (u8)JOURNAL_PUSH;
+  undo_compress_actions(payload, &a, 1);
+  journal_write_record(out, payload);
+  payload.free_shallow();
+}
+
+static void journal_push(BufferData &b, const UndoAction &a) {
+  if (!b.journal)
+    return;
+  if (!b.journal->started)
+    journal_start(b, b._undo_actions.size-1);
+
+  Array<u8> out = {};
+  journal_write_push(out, a);
+  journal_queue(b.journal, out, false);
+  out.free_shallow();
+}
+
+static void journal_merge_insert(BufferData &b, Pos a, Pos bb, Slice s, int cursor_idx) {
+  if (!b.journal)
+    return;
+
+  UndoAction act = {ACTIONTYPE_INSERT};
+  act.insert = {a, bb, s, cursor_idx};
+  Array<u8> payload = {};
+  payload += (u8)JOURNAL_MERGE;
+  undo_compress_actions(payload, &act, 1);
+  journal_queue_record(b, payload);
+  payload.free_shallow();
+}
+
+static void journal_merge_insert_batch(BufferData &b, Array<BatchInsert> &inserts) {
+  if (!b.journal)
+    return;
+
+  // the texts of the inserts are stored one after the other
+  StringBuffer text = {};
+  for (BatchInsert &e : inserts)
+    text += e.s;
+  UndoAction act = {ACTIONTYPE_INSERT_BATCH};
+  act.insert_batch = {inserts.items, inserts.size, text.slice};
+  Array<u8> payload = {};
+  payload += (u8)JOURNAL_MERGE;
+  undo_compress_actions(payload, &act, 1);
+  journal_queue_record(b, payload);
+  payload.free_shallow();
+  util_free(text);
+}
+
+static void journal_record(BufferData &b, JournalRecordType type) {
+  if (!b.journal)
+    return;
+
+  Array<u8> payload = {};
+  payload += (u8)type;
+  journal_queue_record(b, payload);
+  payload.free_shallow();
+}
+
+static void journal_goto(BufferData &b, UndoState s) {
+  if (!b.journal)
+    return;
+
+  Array<u8> payload = {};
+  payload += (u8)JOURNAL_GOTO;
+  undo_write(payload, s.branch);
+  undo_write(payload, s.group);
+  journal_queue_record(b, payload);
+  payload.free_shallow();
+}
+
+static void journal_write_type(Array<u8> &out, JournalRecordType type, int count) {
+  Array<u8> payload = {};
+  payload += (u8)type;
+  for (int i = 0; i < count; ++i)
+    journal_write_record(out, payload);
+  payload.free_shallow();
+}
+
+// The file holds the state at _last_save_undo_action, but the buffer may have been edited (or undone) while it was being written.
+// So the checkpoint is of the saved state, and the records after it bring it up to where the buffer is now
+static void journal_saved(BufferData &b) {
+  if (!b.journal)
+    return;
+
+  const int save = b._last_save_undo_action;
+  const int next = b._next_undo_action;
+  Array<u8> out = {};
+  b.journal->started = true;
+
+  // the saved state has been compressed, or left on a branch, so there is no checkpoint that matches the file.
+  // Leave the journal without a header, which makes it unusable until the next save
+  if (save < 0) {
+    journal_queue(b.journal, out, true);
+    return;
+  }
+
+  journal_write_header(out, b);
+  if (save >= next) {
+    journal_write_checkpoint(out, b, b._undo_actions.size, save);
+    int n = 0;
+    for (int i = next; i < save; ++i)
+      n += b._undo_actions[i].type == ACTIONTYPE_GROUP_END;
+    journal_write_type(out, JOURNAL_UNDO, n);
+  }
+  else {
+    // an open group can only be redone as the actions that are in it so far
+    int open = next;
+    while (open > 0 && b._undo_actions[open-1].type != ACTIONTYPE_GROUP_BEGIN && b._undo_actions[open-1].type != ACTIONTYPE_GROUP_END)
+      --open;
+    const int num_actions = open > 0 && b._undo_actions[open-1].type == ACTIONTYPE_GROUP_BEGIN ? at_least(open-1, save) : b._undo_actions.size;
+
+    journal_write_checkpoint(out, b, num_actions, save);
+    int n = 0;
+    for (int i = save; i < at_most(num_actions, next); ++i)
+      n += b._undo_actions[i].type == ACTIONTYPE_GROUP_END;
+    journal_write_type(out, JOURNAL_REDO, n);
+    for (int i = num_actions; i < next; ++i)
+      journal_write_push(out, b._undo_actions[i]);
+  }
+  journal_queue(b.journal, out, true);
+  out.free_shallow();
+}
+
+static bool journal_is_edit(const u8 *payload) {
+  switch (payload[0]) {
+    case JOURNAL_PUSH:
+      return payload[1] == ACTIONTYPE_INSERT || payload[1] == ACTIONTYPE_DELETE || payload[1] == ACTIONTYPE_INSERT_BATCH;
+    case JOURNAL_MERGE:
+    case JOURNAL_UNDO:
+    case JOURNAL_REDO:
+    case JOURNAL_GOTO:
+      return true;
+  }
+  return false;
+}
+
+// Applies the records after the checkpoint to the buffer. Returns where the last record that could be applied ends
+static const u8* journal_replay(BufferData &b, const u8 *p, const u8 *end) {
+  Array<Cursor> cursors = {};
+  cursors += Cursor{};
+  const u8 *payload;
+  int length;
+
+  for (const u8 *next = p; journal_next_record(&next, end, &payload, &length); p = next) {
+    Array<u8> data = {(u8*)payload+1, length-1, length-1};
+    UndoAction a;
+
+    switch (payload[0]) {
+      case JOURNAL_PUSH:
+        undo_decompress_actions(b._undo_arena, data, &a, 1);
+        b.redo_action(cursors, a);
+        b.push_undo_action(a);
+        if (a.type == ACTIONTYPE_GROUP_END)
+          b.undo_limit();
+        break;
+
+      case JOURNAL_MERGE: {
+        BumpAllocator arena = {};
+        bool merged = false;
+        undo_decompress_actions(arena, data, &a, 1);
+        b.redo_action(cursors, a);
+        if (a.type == ACTIONTYPE_INSERT)
+          merged = b.undo_merge_insert(a.insert.a, a.insert.b, a.insert.s, a.insert.cursor_idx);
+        else if (a.type == ACTIONTYPE_INSERT_BATCH) {
+          Array<BatchInsert> inserts = {a.insert_batch.inserts, a.insert_batch.num_inserts, a.insert_batch.num_inserts};
+          merged = b.undo_merge_insert_batch(inserts);
+        }
+        util_free(arena);
+        // the history doesn't look like it did when this was written, but the text has been changed already, so keep it as an action of its own
+        if (!merged) {
+          log_warn("Journal of %s has an insert that can't be merged, adding it as a new action\n", b.filename.chars);
+          undo_decompress_actions(b._undo_arena, data, &a, 1);
+          b.push_undo_action(a);
+        }
+        break;
+      }
+
+      case JOURNAL_POP:
+        if (b._next_undo_action < 2 || b._undo_actions[b._next_undo_action-2].type != ACTIONTYPE_GROUP_BEGIN)
+          goto done;
+        b.undo_remove_empty_group();
+        break;
+
+      case JOURNAL_UNDO:
+        if (!b._next_undo_action && !b._undo_blocks.size)
+          goto done;
+        b.undo(cursors);
+        break;
+
+      case JOURNAL_REDO:
+        if (b._next_undo_action == b._undo_actions.size)
+          goto done;
+        b.redo(cursors);
+        break;
+
+      case JOURNAL_GOTO: {
+        const u8 *q = payload+1;
+        UndoState s;
+        s.branch = undo_read(q);
+        s.group = undo_read(q);
+        if (s.branch >= b._undo_branches.size)
+          goto done;
+        b.undo_goto(cursors, s);
+        break;
+      }
+
+      default:
+        goto done;
+    }
+  }
+
+  done:
+  b.parse();
+  b._undo_last_snapshot_valid = false;
+  util_free(cursors);
+  return p;
+}
+
+// A crash in the middle of a group (like in insert mode) leaves it open, so close it like action_end would.
+// The records of that are written to out, so that they can follow the ones that were replayed
+static void journal_close_group(BufferData &b, Array<u8> &out) {
+  int i = b._next_undo_action;
+  while (i > 0 && b._undo_actions[i-1].type != ACTIONTYPE_GROUP_BEGIN && b._undo_actions[i-1].type != ACTIONTYPE_GROUP_END)
+    --i;
+  if (i == 0 || b._undo_actions[i-1].type != ACTIONTYPE_GROUP_BEGIN)
+    return;
+
+  b._undo_last_snapshot_valid = false;
+  if (b._next_undo_action == i+1) {
+    b.undo_remove_empty_group();
+    journal_write_type(out, JOURNAL_POP, 1);
+  }
+  else {
+    const int first = b._next_undo_action;
+    Array<Cursor> cursors = {};
+    b.undo_get_snapshot(i, &cursors);
+    b.undo_push_snapshot(cursors);
+    b.push_undo_action({ACTIONTYPE_GROUP_END});
+    for (int k = first; k < b._next_undo_action; ++k)
+      journal_write_push(out, b._undo_actions[k]);
+    util_free(cursors);
+  }
+  b._undo_last_snapshot_valid = false;
+}
+
+// writes a whole journal to a temporary file first, so that a crash never leaves us with half of one
+static bool journal_write_file(Path path, const u8 *data, int n) {
+  StringBuffer tmp = StringBuffer::create(path.string.slice);
+  tmp += ".tmp";
+  FILE *f;
+  bool success = false;
+
+  if (File::open(&f, tmp.chars, "wb")) {
+    log_warn("Failed to open %s for writing: %s\n", tmp.chars, strerror(errno));
+    goto done;
+  }
+  success = !File::write(f, data, n) && File::sync(f);
+  fclose(f);
+  if (success)
+    success = File::rename(tmp.chars, path.string.chars);
+  if (!success)
+    log_warn("Failed to write journal %s: %s\n", path.string.chars, strerror(errno));
+
+  done:
+  util_free(tmp);
+  return success;
+}
+
+static void journal_thread(void*) {
+  struct Work {
+    Journal *j;
+    Array<u8> data;
+    bool rewrite;
+    bool closed;
+  };
+  Array<Work> work = {};
+
+  G.journal.mutex.lock();
+  for (;;) {
+    // take everything that came in while we were writing
+    for (int i = 0; i < G.journal.journals.size; ++i) {
+      Journal *j = G.journal.journals[i];
+      if (!j->pending.size && !j->closed)
+        continue;
+      work += Work{j, j->pending, j->rewrite, j->closed};
+      j->pending = {};
+      j->rewrite = false;
+    }
+    if (!work.size) {
+      if (G.journal.quit)
+        break;
+      G.journal.cond.wait(G.journal.mutex);
+      continue;
+    }
+    G.journal.mutex.unlock();
+
+    for (Work &w : work) {
+      Journal *j = w.j;
+      if (w.rewrite) {
+        if (j->f)
+          fclose(j->f), j->f = 0;
+        journal_write_file(j->path, w.data.items, w.data.size);
+      }
+      else if (w.data.size) {
+        if (!j->f && File::open(&j->f, j->path.string.chars, "ab"))
+          j->f = 0, log_warn("Failed to open journal %s: %s\n", j->path.string.chars, strerror(errno));
+        if (j->f && (File::write(j->f, w.data.items, w.data.size) || !File::sync(j->f)))
+          log_warn("Failed to write to journal %s: %s\n", j->path.string.chars, strerror(errno));
+      }
+      w.data.free_shallow();
+
+      if (w.closed) {
+        if (j->f)
+          fclose(j->f), j->f = 0;
+        if (j->remove)
+          File::remove(j->path.string.chars);
+      }
+    }
+
+    // closed journals stay in the list until they're written, so that journal_open knows to stay away from the file
+    G.journal.mutex.lock();
+    for (Work &w : work) {
+      if (!w.closed)
+        continue;
+      G.journal.journals.remove_item_slow(w.j);
+      util_free(w.j->path);
+      delete w.j;
+    }
+    work.size = 0;
+  }
+  G.journal.mutex.unlock();
+  work.free_shallow();
+}
+
+static void journal_init() {
+  G.journal.dir = G.current_working_directory.copy();
+  G.journal.dir.push(JOURNAL_DIRNAME);
+  if (!File::make_dir(G.journal.dir)) {
+    log_warn("Failed to create journal directory %s: %s\n", G.journal.dir.string.chars, strerror(errno));
+    return;
+  }
+
+  G.journal.mutex.init();
+  G.journal.cond.init();
+  G.journal.quit = false;
+  if (!Thread::create(&G.journal.thread, journal_thread, 0)) {
+    util_free(G.journal.mutex);
+    util_free(G.journal.cond);
+    return;
+  }
+  G.journal.active = true;
+}
+
+// waits for everything to be written
+static void journal_quit() {
+  if (!G.journal.active)
+    return;
+
+  G.journal.mutex.lock();
+  G.journal.quit = true;
+  G.journal.cond.broadcast();
+  G.journal.mutex.unlock();
+  G.journal.thread.join();
+
+  G.journal.journals.free_shallow();
+  G.journal.journals = {};
+  util_free(G.journal.mutex);
+  util_free(G.journal.cond);
+  G.journal.active = false;
+}
+
+// Picks up the history of the buffer from its journal, if the file hasn't changed since the journal was written.
+// If recover is set, the changes that were never saved are applied too. Otherwise they are thrown away
+static void journal_open(BufferData &b, bool recover) {
+  if (!G.journal.active || !b.is_bound_to_file() || b.undo_disabled)
+    return;
+
+  Journal *j = new Journal{};
+  j->path = journal_path(b.filename.slice);
+
+  // if the buffer was just closed, the old journal is still being written, and will be replaced anyway
+  bool busy = false;
+  G.journal.mutex.lock();
+  for (Journal *k : G.journal.journals)
+    busy |= k->path.string.slice == j->path.string.slice;
+  G.journal.mutex.unlock();
+
+  Array<u8> file;
+  if (!busy && File::get_contents(j->path, &file)) {
+    const u8 *p = file.items, *end = file.items + file.size, *payload;
+    int length;
+    _JournalHeader h = {};
+    bool valid = journal_read_header(&p, end, &h) && h.path.slice == b.filename.slice && h.modify_time == b.file_modify_time && h.size == b.file_size;
+    valid = valid && journal_next_record(&p, end, &payload, &length) && payload[0] == JOURNAL_CHECKPOINT;
+    util_free(h.path);
+
+    if (valid) {
+      journal_read_checkpoint(b, payload+1);
+      if (recover)
+        p = journal_replay(b, p, end);
+      // the checkpoint still matches the file, so closing the group is just more records after it
+      Array<u8> closing = {};
+      journal_close_group(b, closing);
+      j->started = true;
+
+      // throw away whatever we didn't use, so that the new records follow right after
+      if (p < end || closing.size) {
+        file.size = (int)(p - file.items);
+        file.push(closing.items, closing.size);
+        journal_write_file(j->path, file.items, file.size);
+      }
+      closing.free_shallow();
+    }
+    file.free_shallow();
+  }
+
+  G.journal.mutex.lock();
+  G.journal.journals += j;
+  G.journal.mutex.unlock();
+  b.journal = j;
+}
+
+static void journal_close(BufferData &b) {
+  if (!b.journal)
+    return;
+
+  G.journal.mutex.lock();
+  b.journal->closed = true;
+  b.journal->remove = !b._undo_actions.size && !b._undo_blocks.size;
+  G.journal.cond.broadcast();
+  G.journal.mutex.unlock();
+  b.journal = 0;
+}
+
+// Reads the header of a journal, and everything after the checkpoint
+static bool journal_read_tail(Path path, _JournalHeader *h, Array<u8> *tail, int *checkpoint_end) {
+  FILE *f;
+  u8 header[JOURNAL_HEADER_SIZE];
+  const u8 *p = header;
+  u32 path_length, checkpoint[2];
+  long size;
+  bool success = false;
+  StringBuffer s = {};
+
+  *tail = {};
+  if (File::open(&f, path.string.chars, "rb"))
+    return false;
+  if (File::read(f, header, JOURNAL_HEADER_SIZE))
+    goto done;
+  memcpy(&path_length, header + JOURNAL_HEADER_SIZE - 4, 4);
+  if (path_length > 64*1024)
+    goto done;
+  s = StringBuffer::create(JOURNAL_HEADER_SIZE + path_length);
+  s.length = JOURNAL_HEADER_SIZE + path_length;
+  memcpy(s.chars, header, JOURNAL_HEADER_SIZE);
+  if (File::read(f, s.chars + JOURNAL_HEADER_SIZE, path_length))
+    goto done;
+  p = (const u8*)s.chars;
+  if (!journal_read_header(&p, p + s.length, h))
+    goto done;
+
+  // skip the checkpoint
+  if (File::read(f, checkpoint, 8) || fseek(f, checkpoint[0], SEEK_CUR))
+    goto done;
+  *checkpoint_end = JOURNAL_HEADER_SIZE + path_length + 8 + checkpoint[0];
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  if (size < *checkpoint_end)
+    goto done;
+  tail->resize(size - *checkpoint_end);
+  fseek(f, *checkpoint_end, SEEK_SET);
+  if (tail->size && File::read(f, tail->items, tail->size))
+    goto done;
+  success = true;
+
+  done:
+  if (!success) {
+    util_free(h->path);
+    tail->free_shallow();
+    *tail = {};
+  }
+  util_free(s);
+  fclose(f);
+  return success;
+}
+
+// Finds the files that were edited after they were last saved, and never saved again. Journals of files that have been changed
+// by someone else since are thrown away
+static void journal_find_unsaved(Array<Path> *files) {
+  if (!G.journal.active)
+    return;
+
+  Array<Path> journals;
+  if (!File::list_files(G.journal.dir, &journals))
+    return;
+
+  for (Path path : journals) {
+    _JournalHeader h = {};
+    Array<u8> tail;
+    int checkpoint_end;
+    u64 modify_time, size;
+    if (!path.string.slice.ends_with(".journal") || !journal_read_tail(path, &h, &tail, &checkpoint_end))
+      continue;
+
+    if (!File::info(h.path.chars, &modify_time, &size) || modify_time != h.modify_time || size != h.size)
+      File::remove(path.string.chars);
+    else {
+      bool edited = false;
+      const u8 *p = tail.items, *payload;
+      int length;
+      while (!edited && journal_next_record(&p, tail.items + tail.size, &payload, &length))
+        edited = journal_is_edit(payload);
+      if (edited)
+        *files += Path::create(h.path.slice);
+    }
+
+    util_free(h.path);
+    tail.free_shallow();
+  }
+  util_free(journals);
+}
+
+// throws away the unsaved changes in the journal of a file, but keeps the history from before
+static void journal_discard_unsaved(Slice filename) {
+  if (!G.journal.active)
+    return;
+
+  Path path = journal_path(filename);
+  _JournalHeader h = {};
+  Array<u8> tail;
+  int checkpoint_end;
+  if (journal_read_tail(path, &h, &tail, &checkpoint_end)) {
+    Array<u8> file;
+    if (File::get_contents(path, &file)) {
+      journal_write_file(path, file.items, checkpoint_end);
+      file.free_shallow();
+    }
+    util_free(h.path);
+    tail.free_shallow();
+  }
+  util_free(path);
+}
+
+#endif /* JOURNAL_IMPL */
@@ -446,12 +446,15 @@ void Pane::render_menu() {
     if (!menu.suggestions.size)
       return;
 
+    // scroll so that the selection is visible
+    const int first = at_least(menu.current_suggestion - num_lines + 1, 0);
+
     // draw highlighted line
-    push_square_quad(Rect{x - margin/2, y + menu.current_suggestion*line_height - margin/2, width + margin, line_height}, *active_highlight_background_color);
+    push_square_quad(Rect{x - margin/2, y + (menu.current_suggestion - first)*line_height - margin/2, width + margin, line_height}, *active_highlight_background_color);
 
     // draw text
     y += font_height;
-    for (int i = 0, end = at_most(menu.suggestions.size, num_lines); i < end; ++i) {
+    for (int i = first, end = at_most(menu.suggestions.size, first + num_lines); i < end; ++i) {
       push_textn(menu.suggestions[i].chars, min(menu.suggestions[i].length, num_chars), x, y, false, *text_color, font_height);
       // draw hairline
       // if (i < n-1)
@@ -534,7 +537,9 @@ void Pane::render_edit() {
 
   // calc buffer bound
   Pos buf_offset = {this->calc_left_visible_column(), this->calc_top_visible_row()};
+  d.map_lines(buf_offset.y + this->numchars_y());
   int buf_y1 = at_most(buf_offset.y + this->numchars_y(), d.lines.size);
+  d.parse_view(buf_offset.y, buf_y1);
 
   // draw gutter
   TIMING_BEGIN(TIMING_PANE_GUTTER);
@@ -620,7 +625,18 @@ void Pane::render_edit() {
     }
 
     // if there is a search term, highlight that as well
-    if (G.search_term.size) {
+    if ((G.search_regex.prog.size || G.search_term.size) && !d.is_mapped()) {
+      Array<Range> &matches = d.search_matches();
+      for (int i = d.search_match_lower_bound({0, buf_offset.y}); i < matches.size && matches[i].a.y < buf_y1; ++i)
+        canvas.fill(Range{d.to_visual_pos(matches[i].a), d.to_visual_pos(matches[i].b)}, G.search_term_background_color.color, *background_color);
+    }
+    else if (G.search_regex.prog.size) {
+      Pos pos = {0, buf_offset.y};
+      Range range;
+      for (bool stay = true; d.find(&G.search_regex, stay, &pos, &range) && pos.y < buf_y1; stay = false)
+        canvas.fill(Range{d.to_visual_pos(range.a), d.to_visual_pos(range.b)}, G.search_term_background_color.color, *background_color);
+    }
+    else if (G.search_term.size) {
       Pos pos;
       Range range;
 
@@ -664,6 +680,14 @@ void Pane::render_edit() {
   const Slice filename = d.name();
   const int header_text_size = header_height - 6;
   push_text(filename.chars, bounds.x + G.font_width, bounds.y - 3, false, d.modified() ? COLOR_ORANGE : COLOR_WHITE, header_text_size);
+
+  // render undo memory use on the right side
+  if (d.is_bound_to_file()) {
+    String undo = String::createf("undo %iK/%iK", (int)(d.undo_memory()/1024), (int)(G.undo_budget/1024));
+    const int x = bounds.x + bounds.w - (undo.length+1) * graphics_get_font_advance(header_text_size);
+    push_text(undo.chars, x, bounds.y - 3, false, d.undo_memory() > G.undo_budget*3/4 ? COLOR_ORANGE : COLOR_BLUEGREY, header_text_size);
+    util_free(undo);
+  }
   push_square_quad({bounds.p, {bounds.w, -header_height}}, G.color_scheme.menu_background);
 
   // shadow
@@ -724,7 +748,7 @@ int Pane::calc_top_visible_row() const {
 
 int Pane::calc_left_visible_column() const {
   int x = this->buffer.cursors[0].x;
-  x = this->buffer.data->lines[this->buffer.cursors[0].y].visual_offset(x, G.tab_width);
+  x = this->buffer.data->visual_x(this->buffer.cursors[0].y, x);
   x -= this->numchars_x()*6/7;
   return at_least(x, 0);
 }
@@ -1004,16 +1004,112 @@ struct TokenInfo {
 
 void util_free(TokenInfo) {}
 
+// Definitions by the hash of their name, so that looking one up doesn't mean comparing against all of them.
+// The definitions with the same hash are chained in the order they were added.
+// Hashes can collide, so the names still have to be compared.
+// Edits only change hashes and set dirty, the chains are rebuilt by the next lookup
+struct DefinitionTable {
+  Array<u64> hashes; // of the name of each definition
+  Array<int> slots; // index+1 of the first definition with each hash, 0 if empty
+  Array<int> next; // index+1 of the next definition with the same hash, 0 if it's the last
+  bool dirty; // slots and next don't match hashes
+};
+
+static void util_free(DefinitionTable &t) {
+  t.hashes.free_shallow();
+  t.slots.free_shallow();
+  t.next.free_shallow();
+  t = {};
+}
+
+static int _definition_table_slot(const DefinitionTable &t, u64 hash) {
+  const int mask = t.slots.size-1;
+  int h = (int)hash & mask;
+  while (t.slots[h] && t.hashes[t.slots[h]-1] != hash)
+    h = (h+1) & mask;
+  return h;
+}
+
+// rebuilds the table from t.hashes
+static void definition_table_rebuild(DefinitionTable &t) {
+  int n = 64;
+  while (n <= t.hashes.size*2)
+    n *= 2;
+  t.slots.resize(n);
+  t.slots.zero();
+  t.next.resize(t.hashes.size);
+  // backwards, so that each chain ends up in order
+  for (int i = t.hashes.size-1; i >= 0; --i) {
+    int h = _definition_table_slot(t, t.hashes[i]);
+    t.next[i] = t.slots[h];
+    t.slots[h] = i+1;
+  }
+  t.dirty = false;
+}
+
+// returns the first definition with the same hash as name, or -1
+static int definition_table_find(DefinitionTable &t, Slice name) {
+  if (t.dirty)
+    definition_table_rebuild(t);
+  if (!t.slots.size)
+    return -1;
+  return t.slots[_definition_table_slot(t, hash_bytes(name.chars, name.length))] - 1;
+}
+
+// returns the definition after i with the same hash, or -1
+static int definition_table_next(DefinitionTable &t, int i) {
+  if (t.dirty)
+    definition_table_rebuild(t);
+  return t.next[i] - 1;
+}
+
 struct ParseResult {
   Array<TokenInfo> tokens;
   Array<Range> definitions;
   Array<String> identifiers;
+  Array<int> identifier_table; // see parse_add_identifier
+  DefinitionTable definition_table; // for definitions, filled in by parse
+  int changed_y0, changed_y1; // the lines whose tokens were replaced by the last parse_incremental
 };
 
 static void util_free(ParseResult &p) {
   util_free(p.tokens);
   util_free(p.definitions);
   util_free(p.identifiers);
+  p.identifier_table.free_shallow();
+  util_free(p.definition_table);
+}
+
+// pushes the hash of the name of each definition in defs
+static void parse_hash_definitions(const Array<StringBuffer> lines, const Array<Range> defs, Array<u64> *hashes) {
+  for (Range r : defs) {
+    Slice name = lines[r.a.y](r.a.x, r.b.x);
+    *hashes += hash_bytes(name.chars, name.length);
+  }
+}
+
+static int _parse_identifier_slot(const Array<String> &identifiers, const Array<int> &table, Slice s) {
+  const int mask = table.size-1;
+  int h = (int)hash_bytes(s.chars, s.length) & mask;
+  while (table[h] && identifiers[table[h]-1].slice != s)
+    h = (h+1) & mask;
+  return h;
+}
+
+// Adds s to identifiers, unless it's already in there.
+// table is a hash table of indices into identifiers, plus one so that 0 is empty. It's rebuilt if it doesn't fit
+static void parse_add_identifier(Array<String> &identifiers, Array<int> &table, Slice s) {
+  if (identifiers.size*2 >= table.size) {
+    table.resize(at_least(table.size*2, 64));
+    table.zero();
+    for (int i = 0; i < identifiers.size; ++i)
+      table[_parse_identifier_slot(identifiers, table, identifiers[i].slice)] = i+1;
+  }
+  int h = _parse_identifier_slot(identifiers, table, s);
+  if (!table[h]) {
+    identifiers += String::create(s);
+    table[h] = identifiers.size;
+  }
 }
 
 #define NEXT_CHAR(n) (x += n, c = line[x])
@@ -1114,6 +1210,7 @@ static bool parse_multiline_string(Slice line, Array<StringBuffer> lines, int &x
 static ParseResult python_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1186,8 +1283,7 @@ static ParseResult python_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1209,12 +1305,13 @@ static ParseResult python_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult colorscheme_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1259,20 +1356,20 @@ static ParseResult colorscheme_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
 
   tokens += {TOKEN_EOF, 0, lines.size, 0, lines.size};
 
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult julia_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1349,8 +1446,7 @@ static ParseResult julia_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1372,12 +1468,13 @@ static ParseResult julia_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult terraform_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1446,8 +1543,7 @@ static ParseResult terraform_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1472,12 +1568,13 @@ static ParseResult terraform_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult go_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1578,8 +1675,7 @@ static ParseResult go_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1637,12 +1733,13 @@ static ParseResult go_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult bash_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1715,8 +1812,7 @@ static ParseResult bash_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1738,12 +1834,13 @@ static ParseResult bash_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult makefile_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -1816,8 +1913,7 @@ static ParseResult makefile_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -1855,12 +1951,13 @@ static ParseResult makefile_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult textfile_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
 
   int x = 0;
   int y = 0;
@@ -1917,15 +2014,14 @@ static ParseResult textfile_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
 
   tokens += {TOKEN_EOF, 0, lines.size, 0, lines.size};
 
-  return {tokens, {}, identifiers};
+  return {tokens, {}, identifiers, identifier_table};
 }
 
 // returns the index after a generic arglist, or the same index if there was none, or -1 if there was an error
@@ -1952,6 +2048,7 @@ static int skip_c_style_generics_args(int i, Array<TokenInfo> tokens) {
 static ParseResult cpp_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -2074,8 +2171,7 @@ static ParseResult cpp_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -2167,7 +2263,10 @@ static ParseResult cpp_parse(const Array<StringBuffer> lines) {
             if (i1 > i0) {
               TokenInfo t = {TOKEN_BLOCK_COMMENT, tokens[i0].a, tokens[i1].b};
               tokens.replace(i0, i1-i0, &t, 1);
+              i1 = i0+1;
             }
+            // continue after the #endif. The tokens we merged are gone, so we can't use i here
+            i = i1;
           }
           // skip parsing preprocessor commands for now
           // TODO: check for \ at end of line
@@ -2183,12 +2282,13 @@ static ParseResult cpp_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 static ParseResult csharp_parse(const Array<StringBuffer> lines) {
   Array<TokenInfo> tokens = {};
   Array<String> identifiers = {};
+  Array<int> identifier_table = {};
   Array<Range> definitions = {};
 
   int x = 0;
@@ -2308,8 +2408,7 @@ static ParseResult csharp_parse(const Array<StringBuffer> lines) {
       // add to identifier list
       if (t.token == TOKEN_IDENTIFIER) {
         Slice identifier = line(t.a.x, t.b.x);
-        if (!identifiers.find(identifier))
-          identifiers += String::create(identifier);
+        parse_add_identifier(identifiers, identifier_table, identifier);
       }
     }
   }
@@ -2394,7 +2493,10 @@ static ParseResult csharp_parse(const Array<StringBuffer> lines) {
             if (i1 > i0) {
               TokenInfo t = {TOKEN_BLOCK_COMMENT, tokens[i0].a, tokens[i1].b};
               tokens.replace(i0, i1-i0, &t, 1);
+              i1 = i0+1;
             }
+            // continue after the #endif. The tokens we merged are gone, so we can't use i here
+            i = i1;
           }
           // skip parsing preprocessor commands for now
           // TODO: check for \ at end of line
@@ -2410,7 +2512,7 @@ static ParseResult csharp_parse(const Array<StringBuffer> lines) {
         break;
     }
   }
-  return {tokens, definitions, identifiers};
+  return {tokens, definitions, identifiers, identifier_table};
 }
 
 enum Language {
@@ -2433,18 +2535,19 @@ struct LanguageSettings {
   Slice line_comment;
   ParseFun parse_fun;
   Slice name;
+  bool statement_definitions; // a definition can depend on tokens up to a '{' some lines away, like after a parameter list
 };
 LanguageSettings language_settings[] = {
-  {StaticArray<Keyword>{},           {},                  textfile_parse,    Slice::create("")},  // LANGUAGE_NULL
-  {static_array(cpp_keywords),       Slice::create("//"), cpp_parse,         Slice::create("C/C++")}, // LANGUAGE_C
-  {static_array(csharp_keywords),    Slice::create("//"), csharp_parse,      Slice::create("C#")}, // LANGUAGE_CSHARP
-  {static_array(python_keywords),    Slice::create("#"),  python_parse,      Slice::create("Python")},  // LANGUAGE_PYTHON
-  {static_array(julia_keywords),     Slice::create("#"),  julia_parse,       Slice::create("Julia")},  // LANGUAGE_JULIA
-  {static_array(bash_keywords),      Slice::create("#"),  bash_parse,        Slice::create("Shell")},  // LANGUAGE_BASH
-  {{},                               {},                  colorscheme_parse, Slice::create("Cmantic-colorscheme")},  // LANGUAGE_CMANTIC_COLORSCHEME
-  {static_array(go_keywords),        Slice::create("//"), go_parse,          Slice::create("Go")},  // LANGUAGE_GOLANG
-  {static_array(terraform_keywords), Slice::create("#"), terraform_parse,          Slice::create("Terraform")},  // LANGUAGE_TERRAFORM
-  {static_array(makefile_keywords),  Slice::create("#"), makefile_parse,          Slice::create("Makefile")},  // LANGUAGE_MAKEFILE
+  {StaticArray<Keyword>{},           {},                  textfile_parse,    Slice::create(""), false},  // LANGUAGE_NULL
+  {static_array(cpp_keywords),       Slice::create("//"), cpp_parse,         Slice::create("C/C++"), true}, // LANGUAGE_C
+  {static_array(csharp_keywords),    Slice::create("//"), csharp_parse,      Slice::create("C#"), true}, // LANGUAGE_CSHARP
+  {static_array(python_keywords),    Slice::create("#"),  python_parse,      Slice::create("Python"), false},  // LANGUAGE_PYTHON
+  {static_array(julia_keywords),     Slice::create("#"),  julia_parse,       Slice::create("Julia"), false},  // LANGUAGE_JULIA
+  {static_array(bash_keywords),      Slice::create("#"),  bash_parse,        Slice::create("Shell"), false},  // LANGUAGE_BASH
+  {{},                               {},                  colorscheme_parse, Slice::create("Cmantic-colorscheme"), false},  // LANGUAGE_CMANTIC_COLORSCHEME
+  {static_array(go_keywords),        Slice::create("//"), go_parse,          Slice::create("Go"), true},  // LANGUAGE_GOLANG
+  {static_array(terraform_keywords), Slice::create("#"), terraform_parse,          Slice::create("Terraform"), false},  // LANGUAGE_TERRAFORM
+  {static_array(makefile_keywords),  Slice::create("#"), makefile_parse,          Slice::create("Makefile"), true},  // LANGUAGE_MAKEFILE
 };
 STATIC_ASSERT(ARRAY_LEN(language_settings) == NUM_LANGUAGES, all_language_settings_defined);
 
@@ -2454,7 +2557,163 @@ static ParseResult parse(const Array<StringBuffer> lines, Language language) {
     return {};
   }
 
-  return language_settings[language].parse_fun(lines);
+  ParseResult r = language_settings[language].parse_fun(lines);
+  parse_hash_definitions(lines, r.definitions, &r.definition_table.hashes);
+  definition_table_rebuild(r.definition_table);
+  return r;
+}
+
+// Re-tokenizes the buffer after lines [y0, old_y1] have been replaced by lines [y0, new_y1]
+//
+// Instead of lexing the whole file, we lex a window of lines around the edit, starting at a line
+// that doesn't begin inside a token (block comments, multiline strings etc.).
+// The window is grown until the lexer state at the end of it matches the state of the old tokens at
+// the same line, after that point the old tokens are still valid and only need to be moved by the line diff.
+//
+// Definitions are recomputed within the window, so a few lines of context are included on each side
+// to catch definitions that span multiple lines. Since a definition can depend on tokens further away than that
+// (a return type on the line above, or a '{' after a long parameter list) the window is also grown to start and end
+// at a statement in the languages where that happens, as long as that's within PARSE_STATEMENT_LINES.
+// Identifiers are only added, never removed, until the next full parse.
+static const int PARSE_CONTEXT_LINES = 2;
+static const int PARSE_STATEMENT_LINES = 32;
+
+// whether the tokens before i end with a statement or a block, so that nothing after them depends on what came before
+static bool parse_is_statement_end(const Array<TokenInfo> &tokens, int i) {
+  while (i > 0 && (tokens[i-1].token == TOKEN_LINE_COMMENT || tokens[i-1].token == TOKEN_BLOCK_COMMENT))
+    --i;
+  if (i == 0)
+    return true;
+  const Token t = tokens[i-1].token;
+  return t == '{' || t == '}' || t == ';';
+}
+
+// returns true if the lexer can start on line y without knowing what came before it,
+// i.e. the line doesn't start inside a token, and the first token on it is not a multiline token
+// (which could be a merged #if 0 block that depends on the line above).
+// first_token is set to the first token starting on or after line y
+static bool parse_is_line_boundary(Array<TokenInfo> tokens, int y, int *first_token) {
+  // binary search for the first token ending after the start of line y
+  // the EOF token is excluded from the search, so we return it if there is no such token
+  int a = 0, b = tokens.size-1;
+  while (a < b) {
+    int mid = (a+b)/2;
+    if (tokens[mid].b > Pos{0,y})
+      b = mid;
+    else
+      a = mid+1;
+  }
+  *first_token = a;
+  TokenInfo t = tokens[a];
+  if (t.token == TOKEN_EOF)
+    return true;
+  return t.a >= Pos{0,y} && t.a.y == t.b.y;
+}
+
+// If the window would have to include line `limit` (say because another edit starts there, so the old tokens
+// past it can't be trusted) nothing is changed and false is returned
+static bool parse_incremental(ParseResult &p, const Array<StringBuffer> lines, Language language, int y0, int old_y1, int new_y1, int limit = INT_MAX) {
+  if ((int)language < LANGUAGE_NULL || (int)language >= NUM_LANGUAGES) {
+    log_err("Unknown language %i\n", (int)language);
+    return true;
+  }
+
+  Array<TokenInfo> &tokens = p.tokens;
+  const int dy = new_y1 - old_y1;
+
+  // we need to have a previous result to work from
+  if (!tokens.size || tokens.last().token != TOKEN_EOF) {
+    util_free(p);
+    p = parse(lines, language);
+    p.changed_y0 = 0;
+    p.changed_y1 = lines.size;
+    return true;
+  }
+
+  // find a line to start on which does not begin inside a token, and preferably not in the middle of a statement
+  const bool statements = language_settings[language].statement_definitions;
+  int ys = at_least(y0 - PARSE_CONTEXT_LINES, 0);
+  int i0;
+  for (;;) {
+    while (!parse_is_line_boundary(tokens, ys, &i0) && ys > 0)
+      ys = at_most(ys-1, tokens[i0].a.y);
+    if (!statements || ys == 0 || y0 - ys >= PARSE_STATEMENT_LINES || parse_is_statement_end(tokens, i0))
+      break;
+    ys = tokens[i0-1].a.y;
+  }
+
+  ParseResult r;
+  int ye = at_most(new_y1 + 1 + PARSE_CONTEXT_LINES, lines.size);
+  int i1;
+  for (;;) {
+    if (ye > limit)
+      return false;
+    Array<StringBuffer> window = {};
+    window.items = lines.items + ys;
+    window.size = window.cap = ye - ys;
+    r = language_settings[language].parse_fun(window);
+
+    // the rest of the file is in the window, so all old tokens are replaced
+    if (ye == lines.size) {
+      i1 = tokens.size-1;
+      break;
+    }
+
+    // check that the window doesn't end inside a token, and that the old tokens at the same line didn't either
+    const int ye_old = ye - dy;
+    bool old_done = parse_is_line_boundary(tokens, ye_old, &i1);
+    bool window_done = r.tokens.size < 2 || r.tokens[r.tokens.size-2].b.y < window.size;
+    window_done = window_done && (!statements || ye - new_y1 >= PARSE_STATEMENT_LINES || parse_is_statement_end(r.tokens, r.tokens.size-1));
+    if (window_done && old_done)
+      break;
+
+    util_free(r);
+    ye = at_most(ye + (ye - ys), lines.size);
+  }
+
+  // splice in the new tokens, skipping the EOF token
+  --r.tokens.size;
+  for (TokenInfo &t : r.tokens)
+    t.a.y += ys, t.b.y += ys;
+  tokens.replace(i0, i1 - i0, r.tokens.items, r.tokens.size);
+  if (dy)
+    for (int i = i0 + r.tokens.size; i < tokens.size; ++i)
+      tokens[i].a.y += dy, tokens[i].b.y += dy;
+
+  // splice in the new definitions
+  {
+    const int ye_old = ye - dy;
+    int d0 = 0;
+    while (d0 < p.definitions.size && p.definitions[d0].a < Pos{0,ys})
+      ++d0;
+    int d1 = d0;
+    while (d1 < p.definitions.size && p.definitions[d1].a < Pos{0,ye_old})
+      ++d1;
+    for (Range &d : r.definitions)
+      d.a.y += ys, d.b.y += ys;
+    p.definitions.replace(d0, d1 - d0, r.definitions.items, r.definitions.size);
+    if (dy)
+      for (int i = d0 + r.definitions.size; i < p.definitions.size; ++i)
+        p.definitions[i].a.y += dy, p.definitions[i].b.y += dy;
+
+    Array<u64> hashes = {};
+    parse_hash_definitions(lines, r.definitions, &hashes);
+    p.definition_table.hashes.replace(d0, d1 - d0, hashes.items, hashes.size);
+    p.definition_table.dirty = true;
+    hashes.free_shallow();
+  }
+
+  // add any new identifiers
+  for (String s : r.identifiers)
+    parse_add_identifier(p.identifiers, p.identifier_table, s.slice);
+  util_free(r.identifiers);
+  r.identifier_table.free_shallow();
+
+  util_free(r.tokens);
+  util_free(r.definitions);
+  p.changed_y0 = ys;
+  p.changed_y1 = ye;
+  return true;
 }
 
 #endif /* PARSE_CPP */
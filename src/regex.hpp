@@ -0,0 +1,900 @@
+#ifndef REGEX_HEADER
+#define REGEX_HEADER
+
+// Regular expressions, matched against one line at a time
+//
+//   .  [abc]  [^a-z]  \d \w \s \D \W \S  ^  $  (group)  (?:no capture)  a|b
+//   *  +  ?  {n}  {n,}  {n,m}, and lazy versions of them with a trailing ?
+//   \t is a tab, and \ in front of anything else matches that char
+//
+// There are also atoms that match a whole token of the buffer:
+//   \i identifier, \# number, \q string, \o operator, \T any token
+//
+// Lines are first run through a DFA that is built lazily as it is used, which only answers if there is a match
+// somewhere in the line. The lines that do have a match are then run through a Pike VM, which finds the leftmost
+// match and its groups. The DFA doesn't know about tokens, so patterns with token atoms only use the VM
+
+enum RegexOp {
+  REGEX_CHARS, // x: index into sets
+  REGEX_TOKEN, // x: the Token, or TOKEN_NULL for any token
+  REGEX_SPLIT, // try x first, then y
+  REGEX_JUMP,  // x
+  REGEX_SAVE,  // x: group slot
+  REGEX_BOL,
+  REGEX_EOL,
+  REGEX_MATCH,
+};
+
+struct RegexInst {
+  RegexOp op;
+  int x, y;
+};
+
+struct RegexCharSet {
+  u32 bits[8];
+  bool has(u8 c) const {return bits[c >> 5] & (1u << (c & 31));}
+  void add(u8 c) {bits[c >> 5] |= 1u << (c & 31);}
+};
+
+struct RegexDfaState {
+  int pcs; // index into Regex::_dfa_pcs
+  int num_pcs;
+  bool match_at_eol; // a match ends if the line ends here
+};
+
+struct RegexThreads {
+  Array<int> pcs; // prog.size + pc for a thread that is inside a token, and goes on to pc when it ends
+  Array<int> groups; // num_groups*2 per thread
+  int mark;
+};
+
+struct Regex {
+  Array<RegexInst> prog;
+  Array<RegexCharSet> sets;
+  int num_groups; // including the whole match, which is group 0
+  bool has_tokens;
+  StringBuffer prefix; // every match starts with this, so lines without it can be skipped with memmem
+
+  // start and end of every group of the last match, -1 if the group wasn't part of it
+  Array<int> groups;
+
+  Array<RegexDfaState> _dfa;
+  Array<int> _dfa_pcs;
+  Array<int> _dfa_next; // 256 transitions per state, REGEX_DFA_UNKNOWN if not built yet
+  Array<int> _dfa_table; // hash table of states, -1 if empty
+  int _dfa_start[2]; // in the middle of a line, and at the start of it
+
+  // scratch space
+  Array<int> _marks; // for each pc, and then for each pc that waits for the end of a token
+  int _mark;
+  Array<int> _stack;
+  Array<int> _set;
+  RegexThreads _threads[2];
+  Array<int> _start;
+};
+
+static bool regex_compile(Slice pattern, Regex *result, StringBuffer *error);
+// Finds the leftmost match that starts at or after from. The tokens are the tokens that start on the line
+static bool regex_find(Regex *r, Slice line, int from, View<TokenInfo> tokens, int *a, int *b);
+static void util_free(Regex &r);
+
+#endif /* REGEX_HEADER */
+
+
+
+
+#ifdef REGEX_IMPL
+
+#define REGEX_MAX_PROG 20000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_DFA_MAX_STATES 2048
+// transitions that aren't to a state
+#define REGEX_DFA_UNKNOWN -1
+#define REGEX_DFA_MATCH -2
+
+enum RegexNodeType {
+  RNODE_EMPTY,
+  RNODE_CHARS, // x: set, utf8: followed by the trail bytes of a multibyte char
+  RNODE_CAT,
+  RNODE_ALT,
+  RNODE_REPEAT,
+  RNODE_GROUP, // x: group, or -1 if it doesn't capture
+  RNODE_BOL,
+  RNODE_EOL,
+  RNODE_TOKEN, // x: Token
+};
+
+struct RegexNode {
+  RegexNodeType type;
+  int a, b;
+  int x;
+  int min, max; // max is -1 for no limit
+  bool lazy;
+  bool utf8;
+};
+
+struct RegexParser {
+  const char *p, *end;
+  Regex *r;
+  Array<RegexNode> nodes;
+  const char *error;
+};
+
+static void util_free(RegexThreads &t) {
+  t.pcs.free_shallow();
+  t.groups.free_shallow();
+}
+
+static void util_free(Regex &r) {
+  r.prog.free_shallow();
+  util_free(r.prefix);
+  r.sets.free_shallow();
+  r.groups.free_shallow();
+  r._dfa.free_shallow();
+  r._dfa_pcs.free_shallow();
+  r._dfa_next.free_shallow();
+  r._dfa_table.free_shallow();
+  r._marks.free_shallow();
+  r._stack.free_shallow();
+  r._set.free_shallow();
+  util_free(r._threads[0]);
+  util_free(r._threads[1]);
+  r._start.free_shallow();
+  r = {};
+}
+
+static int _regex_node(RegexParser &p, RegexNodeType type, int a = -1, int b = -1) {
+  RegexNode n = {type, a, b};
+  p.nodes += n;
+  return p.nodes.size-1;
+}
+
+static int _regex_set(RegexParser &p, const RegexCharSet &s, bool utf8) {
+  p.r->sets += s;
+  int n = _regex_node(p, RNODE_CHARS);
+  p.nodes[n].x = p.r->sets.size-1;
+  p.nodes[n].utf8 = utf8;
+  return n;
+}
+
+static void _regex_set_range(RegexCharSet &s, int a, int b) {
+  for (int c = a; c <= b; ++c)
+    s.add((u8)c);
+}
+
+// the sets of \d \w \s, returns false if c isn't one of them
+static bool _regex_class(char c, RegexCharSet *s, bool *negate) {
+  *s = {};
+  *negate = c >= 'A' && c <= 'Z';
+  switch (c) {
+    case 'd': case 'D':
+      _regex_set_range(*s, '0', '9');
+      return true;
+    case 'w': case 'W':
+      _regex_set_range(*s, '0', '9');
+      _regex_set_range(*s, 'a', 'z');
+      _regex_set_range(*s, 'A', 'Z');
+      s->add('_');
+      return true;
+    case 's': case 'S':
+      s->add(' '), s->add('\t'), s->add('\r'), s->add('\n'), s->add('\v'), s->add('\f');
+      return true;
+  }
+  return false;
+}
+
+// negated sets only match whole chars, so the trail bytes are taken out and matched separately
+static void _regex_negate(RegexCharSet &s) {
+  for (int i = 0; i < 8; ++i)
+    s.bits[i] = ~s.bits[i];
+  for (int c = 0x80; c < 0xc0; ++c)
+    s.bits[c >> 5] &= ~(1u << (c & 31));
+}
+
+static int _regex_literal(RegexParser &p, const char *s, int n) {
+  int node = -1;
+  for (int i = 0; i < n; ++i) {
+    RegexCharSet set = {};
+    set.add((u8)s[i]);
+    int c = _regex_set(p, set, false);
+    node = node < 0 ? c : _regex_node(p, RNODE_CAT, node, c);
+  }
+  return node;
+}
+
+static int _regex_utf8_length(const char *s, const char *end) {
+  int n = 1;
+  while (s+n < end && (s[n] & 0xc0) == 0x80)
+    ++n;
+  return n;
+}
+
+static int _regex_parse_alt(RegexParser &p);
+
+static int _regex_parse_class(RegexParser &p) {
+  ++p.p; // [
+  bool negate = p.p < p.end && *p.p == '^';
+  if (negate)
+    ++p.p;
+
+  RegexCharSet set = {};
+  int multibyte = -1; // alternatives for the chars that don't fit in a byte
+  for (bool first = true; p.p < p.end && (first || *p.p != ']'); first = false) {
+    const char *c = p.p;
+    RegexCharSet cls;
+    bool negated_cls;
+    if (*c == '\\' && c+1 < p.end && _regex_class(c[1], &cls, &negated_cls)) {
+      if (negated_cls)
+        _regex_negate(cls);
+      for (int i = 0; i < 8; ++i)
+        set.bits[i] |= cls.bits[i];
+      p.p += 2;
+      continue;
+    }
+    if (*c == '\\' && c+1 < p.end)
+      ++c;
+    int n = _regex_utf8_length(c, p.end);
+    p.p = c + n;
+
+    if (n > 1) {
+      if (negate) {
+        p.error = "non-ASCII chars in [^...] are not supported";
+        return -1;
+      }
+      int lit = _regex_literal(p, c, n);
+      multibyte = multibyte < 0 ? lit : _regex_node(p, RNODE_ALT, multibyte, lit);
+      continue;
+    }
+
+    // range
+    if (p.p+1 < p.end && *p.p == '-' && p.p[1] != ']') {
+      const char *d = p.p+1;
+      if (*d == '\\' && d+1 < p.end)
+        ++d;
+      if (_regex_utf8_length(d, p.end) > 1 || (u8)*d < (u8)*c) {
+        p.error = "bad range in []";
+        return -1;
+      }
+      _regex_set_range(set, (u8)*c, (u8)*d);
+      p.p = d+1;
+    }
+    else
+      set.add((u8)*c);
+  }
+  if (p.p >= p.end) {
+    p.error = "missing ]";
+    return -1;
+  }
+  ++p.p; // ]
+
+  if (negate)
+    _regex_negate(set);
+  // lead bytes have to be followed by the rest of the char
+  bool utf8 = false;
+  for (int c = 0xc0; c < 0x100; ++c)
+    utf8 |= set.has((u8)c);
+  int node = _regex_set(p, set, utf8);
+  if (multibyte >= 0)
+    node = _regex_node(p, RNODE_ALT, node, multibyte);
+  return node;
+}
+
+static int _regex_parse_atom(RegexParser &p) {
+  const char c = *p.p;
+  switch (c) {
+    case '(': {
+      ++p.p;
+      int group = -1;
+      if (p.end - p.p >= 2 && p.p[0] == '?' && p.p[1] == ':')
+        p.p += 2;
+      else
+        group = p.r->num_groups++;
+      int a = _regex_parse_alt(p);
+      if (a < 0)
+        return -1;
+      if (p.p >= p.end || *p.p != ')') {
+        p.error = "missing )";
+        return -1;
+      }
+      ++p.p;
+      int n = _regex_node(p, RNODE_GROUP, a);
+      p.nodes[n].x = group;
+      return n;
+    }
+
+    case '[':
+      return _regex_parse_class(p);
+
+    case '.': {
+      ++p.p;
+      RegexCharSet set = {};
+      set.add('\n');
+      _regex_negate(set);
+      return _regex_set(p, set, true);
+    }
+
+    case '^':
+      ++p.p;
+      return _regex_node(p, RNODE_BOL);
+
+    case '$':
+      ++p.p;
+      return _regex_node(p, RNODE_EOL);
+
+    case '*': case '+': case '?': case '{':
+      p.error = "nothing to repeat";
+      return -1;
+
+    case '\\': {
+      if (p.p+1 >= p.end) {
+        p.error = "trailing \\";
+        return -1;
+      }
+      const char e = p.p[1];
+      p.p += 2;
+
+      RegexCharSet set;
+      bool negate;
+      if (_regex_class(e, &set, &negate)) {
+        if (negate)
+          _regex_negate(set);
+        return _regex_set(p, set, negate);
+      }
+
+      Token token = TOKEN_EOF;
+      switch (e) {
+        case 'i': token = TOKEN_IDENTIFIER; break;
+        case '#': token = TOKEN_NUMBER; break;
+        case 'q': token = TOKEN_STRING; break;
+        case 'o': token = TOKEN_OPERATOR; break;
+        case 'T': token = TOKEN_NULL; break;
+      }
+      if (token != TOKEN_EOF) {
+        p.r->has_tokens = true;
+        int n = _regex_node(p, RNODE_TOKEN);
+        p.nodes[n].x = token;
+        return n;
+      }
+
+      if (e == 't')
+        return _regex_literal(p, "\t", 1);
+      --p.p;
+      int n = _regex_utf8_length(p.p, p.end);
+      p.p += n;
+      return _regex_literal(p, p.p - n, n);
+    }
+
+    default: {
+      int n = _regex_utf8_length(p.p, p.end);
+      p.p += n;
+      return _regex_literal(p, p.p - n, n);
+    }
+  }
+}
+
+static bool _regex_parse_int(RegexParser &p, int *result) {
+  if (p.p >= p.end || *p.p < '0' || *p.p > '9')
+    return false;
+  *result = 0;
+  for (; p.p < p.end && *p.p >= '0' && *p.p <= '9'; ++p.p)
+    *result = at_most(*result * 10 + (*p.p - '0'), REGEX_MAX_REPEAT+1);
+  return true;
+}
+
+static int _regex_parse_repeat(RegexParser &p) {
+  int node = _regex_parse_atom(p);
+  while (node >= 0 && p.p < p.end) {
+    int min, max;
+    const char c = *p.p;
+    if (c == '*')
+      min = 0, max = -1, ++p.p;
+    else if (c == '+')
+      min = 1, max = -1, ++p.p;
+    else if (c == '?')
+      min = 0, max = 1, ++p.p;
+    else if (c == '{') {
+      ++p.p;
+      if (!_regex_parse_int(p, &min))
+        goto bad_repeat;
+      max = min;
+      if (p.p < p.end && *p.p == ',') {
+        ++p.p;
+        if (!_regex_parse_int(p, &max))
+          max = -1;
+      }
+      if (p.p >= p.end || *p.p != '}' || (max >= 0 && max < min))
+        goto bad_repeat;
+      if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+        p.error = "too many repetitions";
+        return -1;
+      }
+      ++p.p;
+    }
+    else
+      break;
+
+    node = _regex_node(p, RNODE_REPEAT, node);
+    p.nodes[node].min = min;
+    p.nodes[node].max = max;
+    if (p.p < p.end && *p.p == '?')
+      p.nodes[node].lazy = true, ++p.p;
+  }
+  return node;
+
+  bad_repeat:
+  p.error = "bad {}";
+  return -1;
+}
+
+static int _regex_parse_cat(RegexParser &p) {
+  int node = _regex_node(p, RNODE_EMPTY);
+  while (p.p < p.end && *p.p != '|' && *p.p != ')') {
+    int n = _regex_parse_repeat(p);
+    if (n < 0)
+      return -1;
+    node = _regex_node(p, RNODE_CAT, node, n);
+  }
+  return node;
+}
+
+static int _regex_parse_alt(RegexParser &p) {
+  int node = _regex_parse_cat(p);
+  while (node >= 0 && p.p < p.end && *p.p == '|') {
+    ++p.p;
+    int n = _regex_parse_cat(p);
+    if (n < 0)
+      return -1;
+    node = _regex_node(p, RNODE_ALT, node, n);
+  }
+  return node;
+}
+
+static int _regex_emit_inst(Regex *r, RegexOp op, int x = 0, int y = 0) {
+  RegexInst inst = {op, x, y};
+  r->prog += inst;
+  return r->prog.size-1;
+}
+
+static bool _regex_emit(RegexParser &p, int n) {
+  Regex *r = p.r;
+  if (r->prog.size > REGEX_MAX_PROG) {
+    p.error = "pattern is too big";
+    return false;
+  }
+
+  const RegexNode node = p.nodes[n];
+  switch (node.type) {
+    case RNODE_EMPTY:
+      return true;
+
+    case RNODE_CHARS:
+      _regex_emit_inst(r, REGEX_CHARS, node.x);
+      if (node.utf8) {
+        // the rest of a multibyte char, set 0 is the trail bytes
+        int split = _regex_emit_inst(r, REGEX_SPLIT, r->prog.size+1);
+        _regex_emit_inst(r, REGEX_CHARS, 0);
+        _regex_emit_inst(r, REGEX_JUMP, split);
+        r->prog[split].y = r->prog.size;
+      }
+      return true;
+
+    case RNODE_CAT:
+      return _regex_emit(p, node.a) && _regex_emit(p, node.b);
+
+    case RNODE_ALT: {
+      int split = _regex_emit_inst(r, REGEX_SPLIT, r->prog.size+1);
+      if (!_regex_emit(p, node.a))
+        return false;
+      int jump = _regex_emit_inst(r, REGEX_JUMP);
+      r->prog[split].y = r->prog.size;
+      if (!_regex_emit(p, node.b))
+        return false;
+      r->prog[jump].x = r->prog.size;
+      return true;
+    }
+
+    case RNODE_REPEAT: {
+      for (int i = 0; i < node.min; ++i)
+        if (!_regex_emit(p, node.a))
+          return false;
+
+      if (node.max < 0) {
+        int split = _regex_emit_inst(r, REGEX_SPLIT, r->prog.size+1);
+        if (!_regex_emit(p, node.a))
+          return false;
+        _regex_emit_inst(r, REGEX_JUMP, split);
+        r->prog[split].y = r->prog.size;
+        if (node.lazy)
+          swap(r->prog[split].x, r->prog[split].y);
+        return true;
+      }
+
+      // (a(a(a)?)?)?
+      Array<int> splits = {};
+      for (int i = node.min; i < node.max; ++i) {
+        splits += _regex_emit_inst(r, REGEX_SPLIT, r->prog.size+1);
+        if (!_regex_emit(p, node.a)) {
+          splits.free_shallow();
+          return false;
+        }
+      }
+      for (int split : splits) {
+        r->prog[split].y = r->prog.size;
+        if (node.lazy)
+          swap(r->prog[split].x, r->prog[split].y);
+      }
+      splits.free_shallow();
+      return true;
+    }
+
+    case RNODE_GROUP:
+      if (node.x >= 0)
+        _regex_emit_inst(r, REGEX_SAVE, node.x*2);
+      if (!_regex_emit(p, node.a))
+        return false;
+      if (node.x >= 0)
+        _regex_emit_inst(r, REGEX_SAVE, node.x*2+1);
+      return true;
+
+    case RNODE_BOL:
+      _regex_emit_inst(r, REGEX_BOL);
+      return true;
+
+    case RNODE_EOL:
+      _regex_emit_inst(r, REGEX_EOL);
+      return true;
+
+    case RNODE_TOKEN:
+      _regex_emit_inst(r, REGEX_TOKEN, node.x);
+      return true;
+  }
+  return false;
+}
+
+static bool regex_compile(Slice pattern, Regex *result, StringBuffer *error) {
+  Regex r = {};
+  RegexParser p = {pattern.chars, pattern.chars + pattern.length, &r};
+  int root;
+
+  // set 0 is the trail bytes of multibyte chars
+  RegexCharSet trail = {};
+  _regex_set_range(trail, 0x80, 0xbf);
+  r.sets += trail;
+  r.num_groups = 1;
+
+  root = _regex_parse_alt(p);
+  if (root >= 0 && p.p < p.end) {
+    p.error = "unmatched )";
+    root = -1;
+  }
+  if (root < 0)
+    goto err;
+
+  _regex_emit_inst(&r, REGEX_SAVE, 0);
+  if (!_regex_emit(p, root))
+    goto err;
+  _regex_emit_inst(&r, REGEX_SAVE, 1);
+  _regex_emit_inst(&r, REGEX_MATCH);
+
+  // chars that every match has to start with
+  for (int pc = 1; r.prog[pc].op == REGEX_CHARS; ++pc) {
+    const RegexCharSet &set = r.sets[r.prog[pc].x];
+    int c = -1;
+    for (int i = 0; i < 256; ++i)
+      if (set.has((u8)i))
+        c = c == -1 ? i : -2;
+    if (c < 0)
+      break;
+    r.prefix += (char)c;
+  }
+
+  r._marks.resize(r.prog.size*2);
+  for (int &m : r._marks)
+    m = 0;
+  r.groups.resize(r.num_groups*2);
+  r._dfa_start[0] = r._dfa_start[1] = REGEX_DFA_UNKNOWN;
+  p.nodes.free_shallow();
+  *result = r;
+  return true;
+
+  err:
+  if (error)
+    error->appendf("%s at %i", p.error, (int)(p.p - pattern.chars));
+  p.nodes.free_shallow();
+  util_free(r);
+  return false;
+}
+
+// The DFA states are sets of the instructions that wait for input, i.e. CHARS, TOKEN, EOL and MATCH
+
+static void _regex_closure(Regex *r, int pc, bool bol, bool eol, Array<int> &out) {
+  r->_stack += pc;
+  while (r->_stack.size) {
+    pc = r->_stack.last();
+    --r->_stack.size;
+    if (r->_marks[pc] == r->_mark)
+      continue;
+    r->_marks[pc] = r->_mark;
+
+    const RegexInst &inst = r->prog[pc];
+    switch (inst.op) {
+      case REGEX_JUMP: r->_stack += inst.x; break;
+      case REGEX_SPLIT: r->_stack += inst.y; r->_stack += inst.x; break;
+      case REGEX_SAVE: r->_stack += pc+1; break;
+      case REGEX_BOL: if (bol) r->_stack += pc+1; break;
+      case REGEX_EOL: if (eol) r->_stack += pc+1; else out += pc; break;
+      default: out += pc; break;
+    }
+  }
+}
+
+static int _regex_int_cmp(const void *a, const void *b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+static void _regex_dfa_reset(Regex *r) {
+  r->_dfa.size = 0;
+  r->_dfa_pcs.size = 0;
+  r->_dfa_next.size = 0;
+  r->_dfa_table.size = 0;
+  r->_dfa_start[0] = r->_dfa_start[1] = REGEX_DFA_UNKNOWN;
+}
+
+static void _regex_dfa_insert(Regex *r, int state, u64 hash) {
+  int mask = r->_dfa_table.size-1;
+  int i = (int)(hash & mask);
+  while (r->_dfa_table[i] >= 0)
+    i = (i+1) & mask;
+  r->_dfa_table[i] = state;
+}
+
+static u64 _regex_dfa_hash(const int *pcs, int n) {
+  return hash_bytes(pcs, n*sizeof(*pcs));
+}
+
+// Finds or adds the state with the pcs in r->_set. Returns REGEX_DFA_MATCH if a match has ended,
+// and REGEX_DFA_UNKNOWN if there are too many states
+static int _regex_dfa_state(Regex *r) {
+  Array<int> &set = r->_set;
+  for (int pc : set)
+    if (r->prog[pc].op == REGEX_MATCH)
+      return REGEX_DFA_MATCH;
+
+  qsort(set.items, set.size, sizeof(set[0]), _regex_int_cmp);
+  u64 hash = _regex_dfa_hash(set.items, set.size);
+  if (r->_dfa_table.size) {
+    int mask = r->_dfa_table.size-1;
+    for (int i = (int)(hash & mask); r->_dfa_table[i] >= 0; i = (i+1) & mask) {
+      const RegexDfaState &s = r->_dfa[r->_dfa_table[i]];
+      if (s.num_pcs == set.size && !memcmp(&r->_dfa_pcs[s.pcs], set.items, set.size*sizeof(set[0])))
+        return r->_dfa_table[i];
+    }
+  }
+
+  if (r->_dfa.size >= REGEX_DFA_MAX_STATES)
+    return REGEX_DFA_UNKNOWN;
+
+  RegexDfaState s = {r->_dfa_pcs.size, set.size};
+  r->_dfa_pcs.push(set.items, set.size);
+
+  // does a match end if the line ends here?
+  Array<int> eol = {};
+  ++r->_mark;
+  for (int pc : set)
+    if (r->prog[pc].op == REGEX_EOL)
+      _regex_closure(r, pc, false, true, eol);
+  for (int pc : eol)
+    if (r->prog[pc].op == REGEX_MATCH)
+      s.match_at_eol = true;
+  eol.free_shallow();
+
+  r->_dfa += s;
+  int *next = r->_dfa_next.pushn(256);
+  for (int i = 0; i < 256; ++i)
+    next[i] = REGEX_DFA_UNKNOWN;
+  const int state = r->_dfa.size-1;
+
+  // keep the table at most half full
+  if (r->_dfa.size*2 > r->_dfa_table.size) {
+    r->_dfa_table.resize(at_least(r->_dfa_table.size*2, 64));
+    for (int &t : r->_dfa_table)
+      t = -1;
+    for (int i = 0; i < r->_dfa.size; ++i) {
+      const RegexDfaState &d = r->_dfa[i];
+      _regex_dfa_insert(r, i, _regex_dfa_hash(&r->_dfa_pcs[d.pcs], d.num_pcs));
+    }
+  }
+  else
+    _regex_dfa_insert(r, state, hash);
+  return state;
+}
+
+static int _regex_dfa_start(Regex *r, bool bol) {
+  if (r->_dfa_start[bol] == REGEX_DFA_UNKNOWN) {
+    r->_set.size = 0;
+    ++r->_mark;
+    _regex_closure(r, 0, bol, false, r->_set);
+    int s = _regex_dfa_state(r);
+    if (s == REGEX_DFA_UNKNOWN) {
+      _regex_dfa_reset(r);
+      return _regex_dfa_start(r, bol);
+    }
+    r->_dfa_start[bol] = s;
+  }
+  return r->_dfa_start[bol];
+}
+
+static int _regex_dfa_step(Regex *r, int state, u8 c) {
+  Array<int> &set = r->_set;
+  set.size = 0;
+  ++r->_mark;
+  const RegexDfaState &s = r->_dfa[state];
+  for (int i = 0; i < s.num_pcs; ++i) {
+    const int pc = r->_dfa_pcs[s.pcs + i];
+    if (r->prog[pc].op == REGEX_CHARS && r->sets[r->prog[pc].x].has(c))
+      _regex_closure(r, pc+1, false, false, set);
+  }
+  // a match can also start at the next char
+  _regex_closure(r, 0, false, false, set);
+
+  int next = _regex_dfa_state(r);
+  if (next == REGEX_DFA_UNKNOWN) {
+    // too many states, start over
+    _regex_dfa_reset(r);
+    next = _regex_dfa_state(r);
+  }
+  else
+    r->_dfa_next[state*256 + c] = next;
+  return next;
+}
+
+// is there a match in the line that starts at or after from?
+static bool _regex_dfa_search(Regex *r, Slice line, int from) {
+  int state = _regex_dfa_start(r, from == 0);
+  const u8 *s = (const u8*)line.chars;
+  for (int i = from; i < line.length; ++i) {
+    if (state == REGEX_DFA_MATCH)
+      return true;
+    int next = r->_dfa_next.items[state*256 + s[i]];
+    if (next == REGEX_DFA_UNKNOWN)
+      next = _regex_dfa_step(r, state, s[i]);
+    state = next;
+  }
+  return state == REGEX_DFA_MATCH || r->_dfa[state].match_at_eol;
+}
+
+static void _regex_add_thread(Regex *r, RegexThreads &t, int pc, int x, int n, int *groups) {
+  if (r->_marks[pc] == t.mark)
+    return;
+  r->_marks[pc] = t.mark;
+
+  const RegexInst &inst = r->prog[pc];
+  switch (inst.op) {
+    case REGEX_JUMP:
+      _regex_add_thread(r, t, inst.x, x, n, groups);
+      break;
+    case REGEX_SPLIT:
+      _regex_add_thread(r, t, inst.x, x, n, groups);
+      _regex_add_thread(r, t, inst.y, x, n, groups);
+      break;
+    case REGEX_SAVE: {
+      int old = groups[inst.x];
+      groups[inst.x] = x;
+      _regex_add_thread(r, t, pc+1, x, n, groups);
+      groups[inst.x] = old;
+      break;
+    }
+    case REGEX_BOL:
+      if (x == 0)
+        _regex_add_thread(r, t, pc+1, x, n, groups);
+      break;
+    case REGEX_EOL:
+      if (x == n)
+        _regex_add_thread(r, t, pc+1, x, n, groups);
+      break;
+    default:
+      t.pcs += pc;
+      t.groups.push(groups, r->num_groups*2);
+      break;
+  }
+}
+
+// A thread that is inside a token, and goes on to pc once it ends.
+// Tokens don't overlap, so every thread that waits at the same pc is in the same token, and only the first one is kept
+static void _regex_add_token_thread(Regex *r, RegexThreads &t, int pc, int *groups) {
+  const int id = r->prog.size + pc;
+  if (r->_marks[id] == t.mark)
+    return;
+  r->_marks[id] = t.mark;
+  t.pcs += id;
+  t.groups.push(groups, r->num_groups*2);
+}
+
+static void _regex_threads_clear(Regex *r, RegexThreads &t) {
+  t.pcs.size = 0;
+  t.groups.size = 0;
+  t.mark = ++r->_mark;
+}
+
+static bool regex_find(Regex *r, Slice line, int from, View<TokenInfo> tokens, int *a, int *b) {
+  if (from > line.length)
+    return false;
+  if (r->prefix.length) {
+    const char *p = (const char*)memmem(r->prefix.chars, r->prefix.length, line.chars + from, line.length - from);
+    if (!p)
+      return false;
+    from = p - line.chars;
+  }
+  if (!r->has_tokens && !_regex_dfa_search(r, line, from))
+    return false;
+
+  // Pike VM. Threads are kept in order of priority, so the first one to match wins, and the ones after it are dropped.
+  // A token atom steps through its token one char at a time like any other thread, so it keeps its place in the order
+  const int num_slots = r->num_groups*2;
+  RegexThreads *cur = &r->_threads[0], *next = &r->_threads[1];
+  _regex_threads_clear(r, *cur);
+
+  r->_start.resize(num_slots);
+  for (int &g : r->_start)
+    g = -1;
+
+  bool matched = false;
+  int token = 0;
+  for (int x = from;; ++x) {
+    if (!matched)
+      _regex_add_thread(r, *cur, 0, x, line.length, r->_start.items);
+    else if (!cur->pcs.size)
+      break;
+
+    // the first token that starts at or after x. The one before it is the one that threads inside a token are in
+    while (token < tokens.size && tokens[token].a.x < x)
+      ++token;
+
+    _regex_threads_clear(r, *next);
+    for (int i = 0; i < cur->pcs.size; ++i) {
+      int *groups = &cur->groups[i*num_slots];
+      if (cur->pcs[i] >= r->prog.size) {
+        const int pc = cur->pcs[i] - r->prog.size;
+        if (tokens[token-1].b.x == x+1)
+          _regex_add_thread(r, *next, pc, x+1, line.length, groups);
+        else
+          _regex_add_token_thread(r, *next, pc, groups);
+        continue;
+      }
+      const int pc = cur->pcs[i];
+      const RegexInst &inst = r->prog[pc];
+
+      if (inst.op == REGEX_CHARS) {
+        if (x < line.length && r->sets[inst.x].has((u8)line[x]))
+          _regex_add_thread(r, *next, pc+1, x+1, line.length, groups);
+      }
+      else if (inst.op == REGEX_TOKEN) {
+        if (token < tokens.size) {
+          const TokenInfo &t = tokens[token];
+          if (t.a.x == x && t.b.y == t.a.y && t.b.x > x && (inst.x == TOKEN_NULL || t.token == inst.x)) {
+            if (t.b.x == x+1)
+              _regex_add_thread(r, *next, pc+1, x+1, line.length, groups);
+            else
+              _regex_add_token_thread(r, *next, pc+1, groups);
+          }
+        }
+      }
+      else if (inst.op == REGEX_MATCH) {
+        matched = true;
+        memcpy(r->groups.items, groups, num_slots*sizeof(*groups));
+        break;
+      }
+    }
+    swap(cur, next);
+
+    if (x >= line.length)
+      break;
+  }
+  if (matched) {
+    *a = r->groups[0];
+    *b = r->groups[1];
+  }
+  return matched;
+}
+
+#endif /* REGEX_IMPL */
@@ -0,0 +1,252 @@
+#ifndef TRIGRAM_HEADER
+#define TRIGRAM_HEADER
+
+// A posting list index of the trigrams (three byte sequences) in a set of files.
+// A file can only contain a string if it contains every trigram of it, so a query is narrowed
+// down to the files that are in the posting lists of all of its trigrams before anything is read.
+//
+// Trigrams are 24 bit numbers, and the ones that span an endline are left out, since searches are per line.
+//
+// When a file changes it gets a new id, and the old one is only marked as dead. That way the ids in
+// each posting list are always increasing, and nothing has to be removed from them.
+// The dead ids are compacted away when there are as many of them as there are live ones.
+
+struct TrigramFile {
+  String path;
+  bool dead; // removed or replaced by a newer id
+  bool indexed; // false if we didn't look inside it (too big, or unreadable), so it can contain anything
+};
+
+struct TrigramIndex {
+  Array<TrigramFile> files; // the ids in the posting lists index into this
+  Array<int> _path_table; // hash table of the latest id+1 of each path, 0 if empty
+  Array<u32> _keys; // hash table of trigrams
+  Array<int> _values; // index+1 into _postings for each of _keys, 0 if empty
+  Array<Array<int>> _postings;
+  int num_live;
+  int num_postings; // total length of the posting lists
+
+  // the result of the last narrow()
+  Array<int> _hits; // number of the query trigrams each id has
+  int _num_query_trigrams;
+  Array<u32> _query; // scratch for narrow()
+  Array<u64> _bits;
+
+  void add(Slice path, bool indexed, View<u32> trigrams);
+  void remove(Slice path);
+  // Finds the files that may contain s. Returns false if s is too short to say anything about that.
+  // Use may_contain afterwards to check each file
+  bool narrow(Slice s);
+  bool may_contain(Slice path);
+
+  int _find(Slice path);
+  int _path_slot(Slice path);
+  int _trigram_slot(u32 t);
+  void _compact();
+};
+
+// Pushes every distinct trigram of s onto result. bits is scratch space, which is grown to 2^24 bits and left zeroed
+static void trigram_extract(const char *s, int n, Array<u32> *result, Array<u64> *bits);
+static void util_free(TrigramIndex &t);
+
+#endif /* TRIGRAM_HEADER */
+
+
+
+
+#ifdef TRIGRAM_IMPL
+
+static void util_free(TrigramFile &f) {
+  util_free(f.path);
+}
+
+static void util_free(TrigramIndex &t) {
+  util_free(t.files);
+  t._path_table.free_shallow();
+  t._keys.free_shallow();
+  t._values.free_shallow();
+  for (Array<int> &p : t._postings)
+    p.free_shallow();
+  t._postings.free_shallow();
+  t._hits.free_shallow();
+  t._query.free_shallow();
+  t._bits.free_shallow();
+  t = {};
+}
+
+static void trigram_extract(const char *s, int n, Array<u32> *result, Array<u64> *bits) {
+  if (!bits->size) {
+    bits->resize((1 << 24) / 64);
+    bits->zero();
+  }
+  const int first = result->size;
+  u32 t = 0;
+  int run = 0; // chars since the last endline
+  for (int i = 0; i < n; ++i) {
+    const u8 c = (u8)s[i];
+    if (c == '\n' || c == '\r') {
+      run = 0;
+      continue;
+    }
+    t = ((t << 8) | c) & 0xFFFFFF;
+    if (++run < 3)
+      continue;
+    u64 &word = (*bits)[t >> 6];
+    const u64 bit = (u64)1 << (t & 63);
+    if (word & bit)
+      continue;
+    word |= bit;
+    *result += t;
+  }
+  for (int i = first; i < result->size; ++i)
+    (*bits)[(*result)[i] >> 6] = 0;
+}
+
+int TrigramIndex::_path_slot(Slice path) {
+  const int mask = _path_table.size-1;
+  int h = (int)hash_bytes(path.chars, path.length) & mask;
+  while (_path_table[h] && files[_path_table[h]-1].path.slice != path)
+    h = (h+1) & mask;
+  return h;
+}
+
+int TrigramIndex::_find(Slice path) {
+  if (!_path_table.size)
+    return -1;
+  return _path_table[_path_slot(path)] - 1;
+}
+
+int TrigramIndex::_trigram_slot(u32 t) {
+  const int mask = _keys.size-1;
+  int h = (int)((t * 2654435761u) >> 8) & mask;
+  while (_values[h] && _keys[h] != t)
+    h = (h+1) & mask;
+  return h;
+}
+
+void TrigramIndex::add(Slice path, bool indexed, View<u32> trigrams) {
+  remove(path);
+  if (files.size - num_live >= at_least(num_live, 1024))
+    _compact();
+
+  const int id = files.size;
+  files += TrigramFile{String::create(path), false, indexed};
+  ++num_live;
+
+  if (files.size*2 >= _path_table.size) {
+    _path_table.resize(at_least(_path_table.size*2, 1024));
+    _path_table.zero();
+    // later ids overwrite the earlier ones of the same path
+    for (int i = 0; i < files.size; ++i)
+      _path_table[_path_slot(files[i].path.slice)] = i+1;
+  }
+  else
+    _path_table[_path_slot(path)] = id+1;
+
+  for (int i = 0; i < trigrams.size; ++i) {
+    const u32 t = trigrams[i];
+    if ((_postings.size+1)*2 >= _keys.size) {
+      Array<u32> keys = _keys;
+      Array<int> values = _values;
+      _keys = {};
+      _values = {};
+      _keys.resize(at_least(keys.size*2, 4096));
+      _values.resize(_keys.size);
+      _values.zero();
+      for (int j = 0; j < keys.size; ++j) {
+        if (!values[j])
+          continue;
+        int h = _trigram_slot(keys[j]);
+        _keys[h] = keys[j];
+        _values[h] = values[j];
+      }
+      keys.free_shallow();
+      values.free_shallow();
+    }
+    int h = _trigram_slot(t);
+    if (!_values[h]) {
+      _keys[h] = t;
+      _postings += Array<int>{};
+      _values[h] = _postings.size;
+    }
+    _postings[_values[h]-1] += id;
+  }
+  num_postings += trigrams.size;
+}
+
+void TrigramIndex::remove(Slice path) {
+  int id = _find(path);
+  if (id < 0 || files[id].dead)
+    return;
+  files[id].dead = true;
+  --num_live;
+}
+
+// drops the dead ids, and renumbers the live ones. Since the renumbering keeps the order, the posting lists stay sorted
+void TrigramIndex::_compact() {
+  Array<int> new_id = {};
+  new_id.resize(files.size);
+  int n = 0;
+  for (int i = 0; i < files.size; ++i) {
+    if (files[i].dead) {
+      new_id[i] = -1;
+      util_free(files[i]);
+      continue;
+    }
+    new_id[i] = n;
+    files[n++] = files[i];
+  }
+  files.size = n;
+
+  num_postings = 0;
+  for (Array<int> &p : _postings) {
+    int k = 0;
+    for (int id : p)
+      if (new_id[id] >= 0)
+        p[k++] = new_id[id];
+    p.size = k;
+    num_postings += k;
+  }
+
+  _path_table.zero();
+  for (int i = 0; i < files.size; ++i)
+    _path_table[_path_slot(files[i].path.slice)] = i+1;
+  _hits.size = 0;
+  new_id.free_shallow();
+}
+
+bool TrigramIndex::narrow(Slice s) {
+  if (s.length < 3)
+    return false;
+
+  _hits.resize(files.size);
+  _hits.zero();
+  _num_query_trigrams = 0;
+
+  _query.size = 0;
+  trigram_extract(s.chars, s.length, &_query, &_bits);
+  for (u32 t : _query) {
+    ++_num_query_trigrams;
+    if (!_keys.size)
+      break;
+    int h = _trigram_slot(t);
+    // no indexed file has it
+    if (!_values[h])
+      break;
+    for (int id : _postings[_values[h]-1])
+      ++_hits[id];
+  }
+  // a query with an endline has no trigrams, and can't be found by a per line search anyway
+  if (!_query.size)
+    _num_query_trigrams = 1;
+  return true;
+}
+
+bool TrigramIndex::may_contain(Slice path) {
+  int id = _find(path);
+  if (id < 0 || id >= _hits.size || files[id].dead || !files[id].indexed)
+    return true;
+  return _hits[id] == _num_query_trigrams;
+}
+
+#endif /* TRIGRAM_IMPL */
@@ -18,6 +18,9 @@
   #include <dirent.h>
   #include <fcntl.h>
   #include <signal.h>
+  #include <pthread.h>
+  #include <sys/inotify.h>
+  #include <sys/mman.h>
 #else
   #ifndef WIN32_LEAN_AND_MEAN
     #define WIN32_LEAN_AND_MEAN 1
@@ -25,6 +28,7 @@
   #define NOMINMAX
   #include <windows.h>
   #include <direct.h>
+  #include <io.h>
   #include <sys/types.h>
 #endif
 #include <cstddef>
@@ -38,6 +42,11 @@
 #include <math.h>
 #include <sys/stat.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define UTIL_SSE2 1
+  #include <emmintrin.h>
+#endif
+
 #ifdef _MSC_VER
   typedef __int8 i8;
   typedef __int16 i16;
@@ -195,6 +204,7 @@ float angle_to_range(float v, float a, float b);
 static void* alloc(size_t size, size_t align = alignof(max_align_t));
 static void* realloc(void *prev, size_t prev_size, size_t size, size_t align = alignof(max_align_t));
 static void dealloc(void *mem, size_t size);
+static u64 hash_bytes(const void *data, int n);
 
 template<class T>
 static T* alloc() {
@@ -730,7 +740,7 @@ union Array {
 
   void insert(int i, T value) {
     pushn(1);
-    memmove(items+i+1, items+i, (size-i)*sizeof(T));
+    memmove(items+i+1, items+i, (size-i-1)*sizeof(T));
     items[i] = value;
   }
 
@@ -927,12 +937,30 @@ struct File {
   static bool write(FILE *f, const void *data, int len);
   static bool read(FILE *f, void *buf, int n);
   static int open(FILE **f, const char *filename, const char *mode);
+  static bool sync(FILE *f); // flushes f all the way to the disk
+  static bool rename(const char *from, const char *to); // replaces to if it exists
+  static bool remove(const char *path);
+  static bool make_dir(Path p); // succeeds if it already exists
+  static bool real_path(const char *path, StringBuffer *result); // follows symlinks
+  static bool copy_permissions(const char *from, FILE *to); // succeeds if from doesn't exist
   static bool change_dir(Path p);
   static bool was_modified(const char *path, u64 *time);
+  static bool info(const char *path, u64 *modify_time, u64 *size);
   static bool cwd(Path *p);
+  static Path temp_dir();
   static FileType filetype(Path path);
   static bool list_files(Path p, Array<Path> *result);
+  static bool list_dir(Path p, Array<Path> *files, Array<Path> *dirs); // like list_files, but sorts out directories without having to stat every entry
+};
+
+// A file mapped read-only into memory. The pages are only read from the disk when they are touched
+struct MappedFile {
+  const char *data;
+  u64 size;
+
+  static bool open(const char *path, MappedFile *result);
 };
+void util_free(MappedFile &m);
 
 
 
@@ -993,6 +1021,42 @@ struct TempAllocator {
 };
 void util_free(TempAllocator &t);
 
+
+/*****************************************************
+*                                                    *
+*                   Bump allocator                   *
+*                                                    *
+*****************************************************/
+
+// Hands out memory from big chunks, and frees a chunk when everything in it has been freed
+// Good for things that are mostly freed in the same order they were allocated, like undo history
+// It is not an Allocator on the stack, you call it directly
+//
+// Usage
+//
+//   BumpAllocator a = {};
+//   char *s = (char*)a.alloc(5);
+//   s = (char*)a.grow(s, 5, 10);
+//   a.dealloc(s);
+//   util_free(a);
+
+struct BumpAllocator {
+  struct Chunk {
+    int size;
+    int cap;
+    int num_live; // allocations that haven't been freed yet
+    max_align_t data;
+  };
+  Array<Chunk*> chunks; // new allocations go in the last one
+  long bytes; // size of all the chunks
+
+  void* alloc(int size);
+  // grows the allocation in place if it was the last one made, otherwise moves it
+  void* grow(const void *mem, int size, int new_size);
+  void dealloc(const void *mem);
+};
+void util_free(BumpAllocator &a);
+
 template<class T>
 struct GroupedData {
   TempAllocator storage;
@@ -1078,12 +1142,13 @@ static void* default_realloc(int, void *, void *prev, size_t, size_t size, size_
 }
 
 // You shall not have an allocator stack greater than 64 or I will personally come and slap you for writing shit code (i.e. have so little discipline in your control flow that you let it happen).
-static Allocator allocators[64] = {{default_alloc, default_realloc, default_dealloc, 0}};
-static int num_allocators = 1;
-static void *(*current_alloc)(int index, void *alloc_data, size_t size, size_t align) = default_alloc;
-static void *(*current_realloc)(int index, void *alloc_data, void *prev, size_t prev_size, size_t size, size_t align) = default_realloc;
-static void (*current_dealloc)(int index, void *alloc_data, void*, size_t size) = default_dealloc;
-static void *current_alloc_data;
+// The stack is per thread, so worker threads always start out with the default allocator
+static thread_local Allocator allocators[64] = {{default_alloc, default_realloc, default_dealloc, 0}};
+static thread_local int num_allocators = 1;
+static thread_local void *(*current_alloc)(int index, void *alloc_data, size_t size, size_t align) = default_alloc;
+static thread_local void *(*current_realloc)(int index, void *alloc_data, void *prev, size_t prev_size, size_t size, size_t align) = default_realloc;
+static thread_local void (*current_dealloc)(int index, void *alloc_data, void*, size_t size) = default_dealloc;
+static thread_local void *current_alloc_data;
 
 static void* alloc(size_t size, size_t align) {
   return current_alloc(num_allocators-1, current_alloc_data, size, align);
@@ -1136,20 +1201,138 @@ static void pop_allocator() {
 
 
 
+// index of lowest set bit, x must be non-zero
+static int lowest_bit(u32 x) {
+  #ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+  #else
+    return __builtin_ctz(x);
+  #endif
+}
+
+// pushes the index of every occurrence of c in s onto result
+static void memchr_all(const char *s, int n, char c, Array<int> *result) {
+  int i = 0;
+  #ifdef UTIL_SSE2
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16) {
+    u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s+i)), needle));
+    for (; mask; mask &= mask-1)
+      *result += i + lowest_bit(mask);
+  }
+  #endif
+  for (; i < n; ++i)
+    if (s[i] == c)
+      *result += i;
+}
+
+// index of highest set bit, x must be non-zero
+static int highest_bit(u32 x) {
+  #ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse(&i, x);
+    return (int)i;
+  #else
+    return 31 - __builtin_clz(x);
+  #endif
+}
+
+static int popcount(u32 x) {
+  #ifdef _MSC_VER
+    return (int)__popcnt(x);
+  #else
+    return __builtin_popcount(x);
+  #endif
+}
+
+// number of occurrences of c in s
+static int memcount(const char *s, int n, char c) {
+  int i = 0, count = 0;
+  #ifdef UTIL_SSE2
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= n; i += 16)
+    count += popcount((u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(s+i)), needle)));
+  #endif
+  for (; i < n; ++i)
+    count += s[i] == c;
+  return count;
+}
+
+// Substring search. 16 positions are tested at a time by comparing the first and the last byte of the needle,
+// and only where both match do we compare the rest
 static const void *memmem(const void *needle, int needle_len, const void *haystack, int haystack_len) {
-  char *h, *hend;
+  const char *n = (const char*)needle;
+  const char *h = (const char*)haystack;
   if (!needle_len || haystack_len < needle_len)
     return 0;
+  if (needle_len == 1)
+    return memchr(h, n[0], haystack_len);
+
+  const int last = needle_len-1;
+  const int end = haystack_len - last; // number of positions the needle can start at
+  int i = 0;
+  #ifdef UTIL_SSE2
+  const __m128i first_char = _mm_set1_epi8(n[0]);
+  const __m128i last_char = _mm_set1_epi8(n[last]);
+  for (; i + 16 <= end; i += 16) {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(h+i)), first_char);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(h+i+last)), last_char);
+    for (u32 mask = (u32)_mm_movemask_epi8(_mm_and_si128(a, b)); mask; mask &= mask-1) {
+      const int j = i + lowest_bit(mask);
+      if (!memcmp(h+j+1, n+1, needle_len-2))
+        return h+j;
+    }
+  }
+  #endif
+  for (; i < end; ++i)
+    if (h[i] == n[0] && h[i+last] == n[last] && !memcmp(h+i+1, n+1, needle_len-2))
+      return h+i;
+  return 0;
+}
 
-  h = (char*)haystack;
-  hend = h + haystack_len - needle_len + 1;
+// Same as memmem, but finds the last occurrence
+static const void *memrmem(const void *needle, int needle_len, const void *haystack, int haystack_len) {
+  const char *n = (const char*)needle;
+  const char *h = (const char*)haystack;
+  if (!needle_len || haystack_len < needle_len)
+    return 0;
 
-  for (; h < hend; ++h)
-    if (memcmp(needle, h, needle_len) == 0)
-      return h;
+  const int last = needle_len-1;
+  int i = haystack_len - last;
+  #ifdef UTIL_SSE2
+  const __m128i first_char = _mm_set1_epi8(n[0]);
+  const __m128i last_char = _mm_set1_epi8(n[last]);
+  for (; i >= 16; i -= 16) {
+    __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(h+i-16)), first_char);
+    __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(h+i-16+last)), last_char);
+    for (u32 mask = (u32)_mm_movemask_epi8(_mm_and_si128(a, b)); mask;) {
+      const int k = highest_bit(mask);
+      const int j = i - 16 + k;
+      if (needle_len < 2 || !memcmp(h+j+1, n+1, needle_len-2))
+        return h+j;
+      mask &= ~(1u << k);
+    }
+  }
+  #endif
+  for (--i; i >= 0; --i)
+    if (h[i] == n[0] && h[i+last] == n[last] && (needle_len < 2 || !memcmp(h+i+1, n+1, needle_len-2)))
+      return h+i;
   return 0;
 }
 
+// 64 bit FNV-1a
+static u64 hash_bytes(const void *data, int n) {
+  const u8 *d = (const u8*)data;
+  u64 h = 14695981039346656037ULL;
+  for (int i = 0; i < n; ++i) {
+    h ^= d[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
 #define TO_STR(s) (*(Slice*)(&(s)))
 
 #define STRING_METHODS_IMPL(classname) \
@@ -1410,20 +1593,9 @@ bool Slice::find(const char *chars, int length, char c, int *result) {
 }
 
 bool Slice::find_r(const char *chars, int length, Slice &s, int *result) {
-  // TODO: implement properly
-  char *p = (char*)memmem(s.chars, s.length, chars, length);
+  const void *p = memrmem(s.chars, s.length, chars, length);
   if (!p)
     return false;
-
-  char *next;
-  while (1) {
-    if (p+1 >= chars+length)
-      break;
-    next = (char*)memmem(s.chars, s.length, p+1, chars + length - p - 1);
-    if (!next)
-      break;
-    p = next;
-  }
   *result = (char*)p - chars;
   return true;
 }
@@ -1824,7 +1996,7 @@ static const char* TERM_RESET_FORMAT = "";
 static const char* TERM_RESET_COLOR = "";
 static const char* TERM_RESET = "";
 
-static StringBuffer logging_buffer;
+static thread_local StringBuffer logging_buffer;
 #define LOGGING_LEVEL_IMPLEMENTATION(level, color) \
 void log_##level(Slice s) {fprintf(stderr, "%s%.*s%s", color, s.length, s.chars, TERM_RESET_COLOR);} \
 void log_##level(String s) {log_##level(s.slice);} \
@@ -1959,6 +2131,61 @@ int File::open(FILE **f, const char *filename, const char *mode) {
   #endif
 }
 
+bool File::sync(FILE *f) {
+  if (fflush(f))
+    return false;
+  #ifdef OS_WINDOWS
+  return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(f)));
+  #else
+  return !fdatasync(fileno(f));
+  #endif
+}
+
+bool File::rename(const char *from, const char *to) {
+  #ifdef OS_WINDOWS
+  return MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING);
+  #else
+  return !::rename(from, to);
+  #endif
+}
+
+bool File::remove(const char *path) {
+  return !::remove(path);
+}
+
+bool File::make_dir(Path p) {
+  #ifdef OS_WINDOWS
+  return CreateDirectory(p.string.chars, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+  #else
+  return !mkdir(p.string.chars, 0755) || errno == EEXIST;
+  #endif
+}
+
+bool File::real_path(const char *path, StringBuffer *result) {
+  #ifdef OS_WINDOWS
+  *result = StringBuffer::create(path);
+  return true;
+  #else
+  char *p = realpath(path, 0);
+  if (!p)
+    return false;
+  *result = StringBuffer::create(p);
+  free(p);
+  return true;
+  #endif
+}
+
+bool File::copy_permissions(const char *from, FILE *to) {
+  #ifdef OS_WINDOWS
+  return true;
+  #else
+  struct stat attr;
+  if (stat(from, &attr))
+    return errno == ENOENT;
+  return !fchmod(fileno(to), attr.st_mode & 07777);
+  #endif
+}
+
 #ifdef OS_LINUX
 
 bool File::change_dir(Path p) {
@@ -1976,6 +2203,15 @@ bool File::was_modified(const char *path, u64 *time) {
   return result;
 }
 
+bool File::info(const char *path, u64 *modify_time, u64 *size) {
+  struct stat attr;
+  if (stat(path, &attr))
+    return false;
+  *modify_time = (u64)attr.st_mtim.tv_sec * 1000000000ULL + (u64)attr.st_mtim.tv_nsec;
+  *size = (u64)attr.st_size;
+  return true;
+}
+
 bool File::cwd(Path *p) {
   StringBuffer s = {};
   s.extend(64);
@@ -1998,6 +2234,11 @@ bool File::cwd(Path *p) {
   return false;
 }
 
+Path File::temp_dir() {
+  const char *dir = getenv("TMPDIR");
+  return Path::create(Slice::create(dir && *dir ? dir : "/tmp"));
+}
+
 FileType File::filetype(Path path) {
   struct stat buf;
   int err = stat(path.string.chars, &buf);
@@ -2029,6 +2270,39 @@ bool File::list_files(Path p, Array<Path> *result) {
   return true;
 }
 
+bool File::list_dir(Path p, Array<Path> *files, Array<Path> *dirs) {
+  DIR *dp = opendir(p.string.chars);
+  if (!dp)
+    return false;
+
+  for (struct dirent *ep; ep = readdir(dp), ep;) {
+    if (ep->d_name[0] == '.')
+      continue;
+
+    Path pp = p.copy();
+    pp.push(ep->d_name);
+
+    // only stat when the filesystem doesn't tell us the type, or for symlinks
+    FileType type = FILETYPE_UNKNOWN;
+    if (ep->d_type == DT_REG)
+      type = FILETYPE_FILE;
+    else if (ep->d_type == DT_DIR)
+      type = FILETYPE_DIR;
+    else if (ep->d_type == DT_LNK || ep->d_type == DT_UNKNOWN)
+      type = filetype(pp);
+
+    if (type == FILETYPE_FILE)
+      files->push(pp);
+    else if (type == FILETYPE_DIR)
+      dirs->push(pp);
+    else
+      util_free(pp);
+  }
+
+  closedir(dp);
+  return true;
+}
+
 #else
 
 bool File::change_dir(Path p) {
@@ -2057,6 +2331,17 @@ bool File::cwd(Path *p) {
   return false;
 }
 
+Path File::temp_dir() {
+  char dir[MAX_PATH+1];
+  int n = GetTempPath(sizeof(dir), dir);
+  if (!n || n > MAX_PATH)
+    return Path::create(Slice::create("."));
+  // it comes with a trailing backslash
+  if (dir[n-1] == '\\')
+    --n;
+  return Path::create(Slice::create(dir, n));
+}
+
 FileType File::filetype(Path path) {
   DWORD res = GetFileAttributes(path.string.chars);
   if (res == INVALID_FILE_ATTRIBUTES)
@@ -2091,6 +2376,31 @@ bool File::list_files(Path directory, Array<Path> *result) {
   return true;
 }
 
+bool File::list_dir(Path directory, Array<Path> *files, Array<Path> *dirs) {
+  Path dir = directory.copy();
+  WIN32_FIND_DATA find_data;
+  dir.push("*");
+  HANDLE handle = FindFirstFile(dir.string.chars, &find_data);
+  util_free(dir);
+
+  if (handle == INVALID_HANDLE_VALUE)
+    return false;
+
+  do {
+    if (find_data.cFileName[0] == '.')
+      continue;
+    Path p = directory.copy();
+    p.push(find_data.cFileName);
+    if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+      dirs->push(p);
+    else
+      files->push(p);
+  } while (FindNextFile(handle, &find_data) != 0);
+
+  FindClose(handle);
+  return true;
+}
+
 bool File::was_modified(const char *path, u64 *time) {
   FILETIME mod;
   HANDLE f = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
@@ -2112,8 +2422,67 @@ bool File::was_modified(const char *path, u64 *time) {
   return result;
 }
 
+bool File::info(const char *path, u64 *modify_time, u64 *size) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data))
+    return false;
+  *modify_time = data.ftLastWriteTime.dwLowDateTime | ((u64)data.ftLastWriteTime.dwHighDateTime << 32);
+  *size = data.nFileSizeLow | ((u64)data.nFileSizeHigh << 32);
+  return true;
+}
+
 #endif /* OS */
 
+bool MappedFile::open(const char *path, MappedFile *result) {
+  *result = {};
+  u64 n = 0;
+  #ifdef OS_WINDOWS
+  LARGE_INTEGER size;
+  HANDLE mapping = 0;
+  HANDLE f = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (f == INVALID_HANDLE_VALUE)
+    return false;
+  if (GetFileSizeEx(f, &size) && (n = (u64)size.QuadPart))
+    mapping = CreateFileMapping(f, 0, PAGE_READONLY, 0, 0, 0);
+  CloseHandle(f);
+  if (!mapping)
+    return false;
+  // the view keeps the mapping alive
+  void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!p)
+    return false;
+  #else
+  struct stat attr;
+  void *p = MAP_FAILED;
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  if (!fstat(fd, &attr) && (n = (u64)attr.st_size))
+    p = mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  // we mostly read it from the start and forward
+  posix_madvise(p, n, POSIX_MADV_SEQUENTIAL);
+  #endif
+
+  result->data = (const char*)p;
+  result->size = n;
+  return true;
+}
+
+void util_free(MappedFile &m) {
+  if (m.data) {
+    #ifdef OS_WINDOWS
+    UnmapViewOfFile(m.data);
+    #else
+    munmap((void*)m.data, m.size);
+    #endif
+  }
+  m = {};
+}
+
 bool File::get_contents(const char *path, Array<u8> *result) {
   size_t size;
   *result = {};
@@ -2132,13 +2501,15 @@ bool File::get_contents(const char *path, Array<u8> *result) {
   fseek(f, 0, SEEK_SET);
 
   *result = {alloc_array<u8>(size), (int)size, (int)size};
-  if (fread(result->items, size, 1, f) != 1)
+  if (size && fread(result->items, size, 1, f) != 1)
     goto err;
 
   fclose(f);
   return true;
 
   err:
+  result->free_shallow();
+  *result = {};
   if (f)
     fclose(f);
   return false;
@@ -2588,6 +2959,407 @@ static bool call_async(View<Slice> command, Stream *output) {
 #endif
 
 
+
+/***************************************************************
+***************************************************************
+*                                                            **
+*                                                            **
+*                           THREADS                          **
+*                                                            **
+*                                                            **
+***************************************************************
+***************************************************************/
+
+// Anything shared between threads must be protected by a Mutex.
+// The allocator stack and logging are per thread, so those are safe to use from any thread.
+//
+// Example:
+//
+// static void worker(void *data) {...}
+//
+// Thread t;
+// if (!Thread::create(&t, worker, data))
+//   ..
+// t.join();
+
+struct Mutex {
+  #ifdef OS_WINDOWS
+  CRITICAL_SECTION handle;
+  #else
+  pthread_mutex_t handle;
+  #endif
+
+  void init();
+  void lock();
+  void unlock();
+};
+
+struct Condition {
+  #ifdef OS_WINDOWS
+  CONDITION_VARIABLE handle;
+  #else
+  pthread_cond_t handle;
+  #endif
+
+  void init();
+  void wait(Mutex &m); // m must be locked
+  void broadcast();
+};
+
+struct Thread {
+  #ifdef OS_WINDOWS
+  HANDLE handle;
+  #else
+  pthread_t handle;
+  #endif
+
+  static bool create(Thread *t, void (*fun)(void *data), void *data);
+  static int num_cpus();
+  void join();
+};
+
+struct _ThreadStart {
+  void (*fun)(void *data);
+  void *data;
+};
+
+#ifdef OS_WINDOWS
+
+void Mutex::init() {InitializeCriticalSection(&handle);}
+void Mutex::lock() {EnterCriticalSection(&handle);}
+void Mutex::unlock() {LeaveCriticalSection(&handle);}
+static void util_free(Mutex &m) {DeleteCriticalSection(&m.handle);}
+
+void Condition::init() {InitializeConditionVariable(&handle);}
+void Condition::wait(Mutex &m) {SleepConditionVariableCS(&handle, &m.handle, INFINITE);}
+void Condition::broadcast() {WakeAllConditionVariable(&handle);}
+static void util_free(Condition &) {}
+
+static DWORD WINAPI _thread_start(void *arg) {
+  _ThreadStart start = *(_ThreadStart*)arg;
+  ::free(arg);
+  start.fun(start.data);
+  return 0;
+}
+
+bool Thread::create(Thread *t, void (*fun)(void *data), void *data) {
+  _ThreadStart *start = (_ThreadStart*)malloc(sizeof(_ThreadStart));
+  *start = {fun, data};
+  t->handle = CreateThread(NULL, 0, _thread_start, start, 0, NULL);
+  if (!t->handle) {
+    log_err("Failed to create thread\n");
+    ::free(start);
+    return false;
+  }
+  return true;
+}
+
+void Thread::join() {
+  WaitForSingleObject(handle, INFINITE);
+  CloseHandle(handle);
+}
+
+int Thread::num_cpus() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return at_least((int)info.dwNumberOfProcessors, 1);
+}
+
+#else
+
+void Mutex::init() {pthread_mutex_init(&handle, NULL);}
+void Mutex::lock() {pthread_mutex_lock(&handle);}
+void Mutex::unlock() {pthread_mutex_unlock(&handle);}
+static void util_free(Mutex &m) {pthread_mutex_destroy(&m.handle);}
+
+void Condition::init() {pthread_cond_init(&handle, NULL);}
+void Condition::wait(Mutex &m) {pthread_cond_wait(&handle, &m.handle);}
+void Condition::broadcast() {pthread_cond_broadcast(&handle);}
+static void util_free(Condition &c) {pthread_cond_destroy(&c.handle);}
+
+static void* _thread_start(void *arg) {
+  _ThreadStart start = *(_ThreadStart*)arg;
+  ::free(arg);
+  start.fun(start.data);
+  return 0;
+}
+
+bool Thread::create(Thread *t, void (*fun)(void *data), void *data) {
+  _ThreadStart *start = (_ThreadStart*)malloc(sizeof(_ThreadStart));
+  *start = {fun, data};
+  int err = pthread_create(&t->handle, NULL, _thread_start, start);
+  if (err) {
+    log_err("Failed to create thread: %s\n", strerror(err));
+    ::free(start);
+    return false;
+  }
+  return true;
+}
+
+void Thread::join() {
+  pthread_join(handle, NULL);
+}
+
+int Thread::num_cpus() {
+  return at_least((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+}
+
+#endif
+
+
+
+/***************************************************************
+***************************************************************
+*                                                            **
+*                                                            **
+*                        FILE WATCHER                        **
+*                                                            **
+*                                                            **
+***************************************************************
+***************************************************************/
+
+// A hash table of index+1 into an array of paths, 0 if empty. The size is always a power of two
+static int path_table_slot(const Array<int> &table, const Array<Path> &paths, Slice p) {
+  const int mask = table.size-1;
+  int h = (int)hash_bytes(p.chars, p.length) & mask;
+  while (table[h] && paths[table[h]-1].string.slice != p)
+    h = (h+1) & mask;
+  return h;
+}
+
+// the index of p in paths, or -1
+static int path_table_find(const Array<int> &table, const Array<Path> &paths, Slice p) {
+  if (!table.size)
+    return -1;
+  return table[path_table_slot(table, paths, p)] - 1;
+}
+
+// Appends p to paths, and takes ownership of it, unless it's already there. Then it's freed instead.
+// The table is rebuilt when it gets too full, so it can start out empty even if paths isn't
+static void path_table_insert(Array<int> &table, Array<Path> &paths, Path p) {
+  if ((paths.size+1)*2 >= table.size) {
+    int n = 64;
+    while ((paths.size+1)*2 >= n)
+      n *= 2;
+    table.resize(n);
+    table.zero();
+    for (int i = 0; i < paths.size; ++i)
+      table[path_table_slot(table, paths, paths[i].string.slice)] = i+1;
+  }
+  int h = path_table_slot(table, paths, p.string.slice);
+  if (table[h]) {
+    util_free(p);
+    return;
+  }
+  paths += p;
+  table[h] = paths.size;
+}
+
+// Watches directories (not recursively) for files that are written, created, moved or deleted.
+// poll() never blocks, so it can be called every frame
+//
+// Example:
+//
+// FileWatcher w;
+// w.init();
+// w.watch(dir);
+// ...
+// Array<Path> changed = {};
+// w.poll(&changed);
+
+struct FileWatchedDir {
+  Path dir;
+  #ifdef OS_WINDOWS
+  HANDLE handle;
+  OVERLAPPED overlapped;
+  DWORD *buffer; // must be DWORD aligned
+  #else
+  int wd;
+  #endif
+};
+
+struct FileWatcher {
+  Array<FileWatchedDir> dirs;
+  #ifdef OS_LINUX
+  int fd;
+  #endif
+  Array<int> _changed_table; // see path_table_insert, for the paths of the current poll
+
+  bool init();
+  bool watch(Path dir);
+  // Appends full paths of changed files, each path at most once.
+  // Returns false if the OS dropped events, then anything in the watched dirs may have changed
+  bool poll(Array<Path> *changed);
+  void _push(Array<Path> *changed, Path dir, Slice name);
+};
+
+void FileWatcher::_push(Array<Path> *changed, Path dir, Slice name) {
+  Path p = dir.copy();
+  p.push(name);
+  path_table_insert(_changed_table, *changed, p);
+}
+
+#ifdef OS_WINDOWS
+
+#define FILE_WATCHER_BUFFER_SIZE 16384
+#define FILE_WATCHER_FILTER (FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE)
+
+bool FileWatcher::init() {
+  *this = {};
+  return true;
+}
+
+static bool _file_watcher_listen(FileWatchedDir &d) {
+  return ReadDirectoryChangesW(d.handle, d.buffer, FILE_WATCHER_BUFFER_SIZE, FALSE, FILE_WATCHER_FILTER, NULL, &d.overlapped, NULL);
+}
+
+bool FileWatcher::watch(Path dir) {
+  for (FileWatchedDir &d : dirs)
+    if (d.dir.string.slice == dir.string.slice)
+      return true;
+
+  FileWatchedDir d = {};
+  d.handle = CreateFile(dir.string.chars, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+  if (d.handle == INVALID_HANDLE_VALUE) {
+    log_warn("Failed to watch %s (%i)\n", dir.string.chars, GetLastError());
+    return false;
+  }
+  d.buffer = (DWORD*)malloc(FILE_WATCHER_BUFFER_SIZE);
+  d.overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (!_file_watcher_listen(d)) {
+    log_warn("Failed to watch %s (%i)\n", dir.string.chars, GetLastError());
+    CloseHandle(d.overlapped.hEvent);
+    CloseHandle(d.handle);
+    ::free(d.buffer);
+    return false;
+  }
+  d.dir = dir.copy();
+  dirs += d;
+  return true;
+}
+
+bool FileWatcher::poll(Array<Path> *changed) {
+  bool complete = true;
+  _changed_table.size = 0;
+  for (FileWatchedDir &d : dirs) {
+    DWORD n;
+    if (!GetOverlappedResult(d.handle, &d.overlapped, &n, FALSE))
+      continue;
+    // the buffer overflowed
+    if (!n)
+      complete = false;
+
+    for (u8 *p = (u8*)d.buffer; n;) {
+      FILE_NOTIFY_INFORMATION *info = (FILE_NOTIFY_INFORMATION*)p;
+      char name[MAX_PATH*4];
+      int len = WideCharToMultiByte(CP_UTF8, 0, info->FileName, info->FileNameLength/sizeof(WCHAR), name, sizeof(name), NULL, NULL);
+      if (len > 0)
+        _push(changed, d.dir, Slice::create(name, len));
+      if (!info->NextEntryOffset)
+        break;
+      p += info->NextEntryOffset;
+    }
+
+    ResetEvent(d.overlapped.hEvent);
+    _file_watcher_listen(d);
+  }
+  return complete;
+}
+
+static void util_free(FileWatcher &w) {
+  for (FileWatchedDir &d : w.dirs) {
+    CancelIo(d.handle);
+    CloseHandle(d.overlapped.hEvent);
+    CloseHandle(d.handle);
+    ::free(d.buffer);
+    util_free(d.dir);
+  }
+  w.dirs.free_shallow();
+  w._changed_table.free_shallow();
+  w = {};
+}
+
+#else
+
+bool FileWatcher::init() {
+  *this = {};
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1) {
+    log_err("Failed to initialize inotify: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool FileWatcher::watch(Path dir) {
+  if (fd <= 0)
+    return false;
+  int wd = inotify_add_watch(fd, dir.string.chars, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd == -1) {
+    log_warn("Failed to watch %s: %s\n", dir.string.chars, strerror(errno));
+    return false;
+  }
+  // inotify gives back the same descriptor if we watch the same dir twice
+  for (FileWatchedDir &d : dirs)
+    if (d.wd == wd)
+      return true;
+  dirs += FileWatchedDir{dir.copy(), wd};
+  return true;
+}
+
+bool FileWatcher::poll(Array<Path> *changed) {
+  if (fd <= 0)
+    return true;
+
+  bool complete = true;
+  _changed_table.size = 0;
+  alignas(struct inotify_event) char buf[4096];
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      break;
+
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *e = (struct inotify_event*)p;
+      p += sizeof(*e) + e->len;
+
+      if (e->mask & IN_Q_OVERFLOW) {
+        complete = false;
+        continue;
+      }
+      if (e->mask & IN_IGNORED) {
+        for (int i = 0; i < dirs.size; ++i) {
+          if (dirs[i].wd == e->wd) {
+            util_free(dirs[i].dir);
+            dirs[i--] = dirs[--dirs.size];
+          }
+        }
+        continue;
+      }
+      if (!e->len)
+        continue;
+
+      for (FileWatchedDir &d : dirs)
+        if (d.wd == e->wd)
+          _push(changed, d.dir, Slice::create(e->name));
+    }
+  }
+  return complete;
+}
+
+static void util_free(FileWatcher &w) {
+  if (w.fd > 0)
+    close(w.fd);
+  for (FileWatchedDir &d : w.dirs)
+    util_free(d.dir);
+  w.dirs.free_shallow();
+  w._changed_table.free_shallow();
+  w = {};
+}
+
+#endif
+
+
 #if 1
 #define IF_ALLOC_DEBUG(stmt)
 #else
@@ -2697,6 +3469,79 @@ static void* temporary_realloc(int index, void *data, void *prev, size_t prev_si
 
 static void temporary_dealloc(int, void*, void*, size_t) {}
 
+// every allocation starts with a pointer to its chunk
+#define BUMP_HEADER_SIZE ((int)sizeof(max_align_t))
+#define BUMP_CHUNK_SIZE (64*1024)
+
+void* BumpAllocator::alloc(int size) {
+  size = (int)ALIGNI(size, BUMP_HEADER_SIZE) + BUMP_HEADER_SIZE;
+
+  Chunk *c = chunks.size ? chunks.last() : 0;
+  if (!c || c->size + size > c->cap) {
+    int cap = at_least(size, BUMP_CHUNK_SIZE);
+    c = (Chunk*)::alloc(offsetof(Chunk, data) + cap, alignof(Chunk));
+    c->size = 0;
+    c->cap = cap;
+    c->num_live = 0;
+    chunks += c;
+    bytes += cap;
+  }
+
+  char *mem = (char*)&c->data + c->size;
+  *(Chunk**)mem = c;
+  c->size += size;
+  ++c->num_live;
+  return mem + BUMP_HEADER_SIZE;
+}
+
+void* BumpAllocator::grow(const void *mem, int size, int new_size) {
+  if (!mem)
+    return alloc(new_size);
+
+  Chunk *c = *(Chunk**)((char*)mem - BUMP_HEADER_SIZE);
+  char *end = (char*)mem + ALIGNI(size, BUMP_HEADER_SIZE);
+  int extra = (int)ALIGNI(new_size, BUMP_HEADER_SIZE) - (int)ALIGNI(size, BUMP_HEADER_SIZE);
+  if (c == chunks.last() && end == (char*)&c->data + c->size && c->size + extra <= c->cap) {
+    c->size += extra;
+    return (void*)mem;
+  }
+
+  void *result = alloc(new_size);
+  memcpy(result, mem, size);
+  dealloc(mem);
+  return result;
+}
+
+void BumpAllocator::dealloc(const void *mem) {
+  if (!mem)
+    return;
+
+  Chunk *c = *(Chunk**)((char*)mem - BUMP_HEADER_SIZE);
+  if (--c->num_live)
+    return;
+
+  // the current chunk is kept around for the next allocations
+  if (c == chunks.last()) {
+    c->size = 0;
+    return;
+  }
+  for (int i = 0; i < chunks.size; ++i) {
+    if (chunks[i] == c) {
+      chunks.remove_slow(i);
+      break;
+    }
+  }
+  bytes -= c->cap;
+  ::dealloc(c, offsetof(Chunk, data) + c->cap);
+}
+
+void util_free(BumpAllocator &a) {
+  for (BumpAllocator::Chunk *c : a.chunks)
+    dealloc(c, offsetof(BumpAllocator::Chunk, data) + c->cap);
+  a.chunks.free_shallow();
+  a = {};
+}
+
 
 
 /***************************************************************